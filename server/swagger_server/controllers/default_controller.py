@@ -25,14 +25,43 @@ _script_dir = os.path.dirname(os.path.abspath(__file__))
 exec_path = os.path.abspath(os.path.join(_script_dir, "../../../streaming_driver/build/telepresence_streaming_driver"))
 process = None
 streaming_thread = None
+stop_requested = False  # set by the stop endpoint, any other exit of the driver is unexpected
+driver_restarts = 0
+
+# How long a stopped driver gets to drain and release the cameras before it is terminated, above its --shutdown-ms
+DRIVER_STOP_TIMEOUT_S = 5.0
 
 # Lock to synchronize access to global state across threads
 state_lock = threading.Lock()
 
+# Latest driver event of each type per camera, fed by the driver's JSON-lines event stream on stdout
+driver_events = {}
+driver_events_lock = threading.Lock()
+
+# Camera state as the driver last reported it, exposed as driver_state by the state endpoint
+CAMERA_STATES = {
+    "pipeline_building": "starting",
+    "pipeline_playing": "streaming",
+    "config_committed": "streaming",
+    "standby": "standby",
+    "pipeline_stopped": "stopped",
+    "config_rejected": "error",
+}
+camera_states = {}
+
+# The driver is restarted when it exits on its own, at most this many times per start. A camera the driver gave up
+# on only shows as error, restarting the driver would tear down the healthy cameras too.
+MAX_DRIVER_RESTARTS = 3
+
+
+# Optional config keys passed through to the driver unchanged
+DRIVER_OPTIONAL_KEYS = ("mtu", "pacing", "batchSend", "slices", "restartInterval", "shmOutput", "shmSlots",
+                        "stageQueues", "stageQueueMs")
+
 
 def cfg_dict_from_state(s: dict) -> dict:
     # Match the keys to what C++ ConfigFromJson expects
-    return {
+    cfg = {
         "ip": s["ip_address"],
         "portLeft": int(s["port_left"]),
         "portRight": int(s["port_right"]),
@@ -44,12 +73,43 @@ def cfg_dict_from_state(s: dict) -> dict:
         "videoMode": s["video_mode"],  # "mono"/"stereo"
         "fps": int(s["fps"]),
     }
+    # Optional driver tuning, the driver falls back to its defaults when absent
+    for key in DRIVER_OPTIONAL_KEYS:
+        if key in s:
+            cfg[key] = s[key]
+    return cfg
+
+
+def handle_driver_event(event: dict):
+    camera = event.get("camera", "driver")
+    name = event.get("event")
+    # The driver retries a failed pipeline with a backoff, retry_ms is null once it gave up on the camera
+    gave_up = name == "pipeline_failed" and event.get("retry_ms") is None
+    with driver_events_lock:
+        driver_events.setdefault(camera, {})[name] = event
+        if name == "pipeline_failed":
+            camera_states[camera] = {"state": "error" if gave_up else "retrying", "event": event}
+        elif name in CAMERA_STATES:
+            camera_states[camera] = {"state": CAMERA_STATES[name], "event": event}
+        elif name == "shutdown":
+            for state in camera_states.values():
+                state["state"] = "stopped"
+    if name in ("config_rejected", "pipeline_failed"):
+        print(f"Driver {name} ({camera}): {event}")
+    if gave_up:
+        print(f"Driver gave up on camera {camera}, the other cameras keep streaming")
 
 
 def stdout_reader_thread(process):
     """Background thread that continuously drains stdout to prevent pipe blocking."""
     try:
         for line in iter(process.stdout.readline, ""):
+            if line.startswith("{"):
+                try:
+                    handle_driver_event(json.loads(line))
+                    continue
+                except ValueError:
+                    pass
             print(line, end="")
     except Exception as e:
         print(f"Stdout reader error: {e}")
@@ -59,7 +119,7 @@ def stdout_reader_thread(process):
 
 
 def run_streaming_process():
-    global stream_state, is_streaming, process
+    global stream_state, is_streaming, process, stop_requested, driver_restarts
 
     with state_lock:
         if is_streaming and process:
@@ -67,30 +127,45 @@ def run_streaming_process():
             configure_streaming_process()
             return
 
-        print("Starting streaming process!")
         is_streaming = True
+        stop_requested = False
+        driver_restarts = 0
+
+    while True:
+        with state_lock:
+            print("Starting streaming process!")
+            # Events come on stdout, the human-readable log goes straight to our stderr
+            process = subprocess.Popen(
+                [exec_path, "--log", "both"],
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                stderr=None,
+                text=True,  # Ensures the output is in string format rather than bytes
+                bufsize=1,  # Line-buffered output
+            )
+        with driver_events_lock:
+            camera_states.clear()
+
+        # Start dedicated thread for reading stdout (prevents pipe blocking)
+        stdout_thread = threading.Thread(target=stdout_reader_thread, args=(process,), daemon=True)
+        stdout_thread.start()
+
+        # Send initial config immediately after start
+        configure_streaming_process()
 
-        process = subprocess.Popen(
-            [exec_path],
-            stdin=subprocess.PIPE,
-            stdout=subprocess.PIPE,
-            stderr=subprocess.STDOUT,
-            text=True,  # Ensures the output is in string format rather than bytes
-            bufsize=1,  # Line-buffered output
-        )
-
-    # Start dedicated thread for reading stdout (prevents pipe blocking)
-    stdout_thread = threading.Thread(target=stdout_reader_thread, args=(process,), daemon=True)
-    stdout_thread.start()
-
-    # Send initial config immediately after start
-    configure_streaming_process()
-
-    # Wait for process to exit (don't block on stdout reading)
-    process.wait()
-
-    with state_lock:
-        is_streaming = False
+        # Wait for process to exit (don't block on stdout reading)
+        process.wait()
+
+        with state_lock:
+            restart = not stop_requested and driver_restarts < MAX_DRIVER_RESTARTS
+            if restart:
+                driver_restarts += 1
+            else:
+                is_streaming = False
+        if not restart:
+            break
+        print(f"The streaming process ended unexpectedly (exit code {process.returncode}), "
+              f"restart {driver_restarts} of {MAX_DRIVER_RESTARTS}")
     print("The streaming process has ended")
 
 
@@ -150,6 +225,7 @@ def api_v1_stream_state_get():  # noqa: E501
                 "video_mode": "stereo",
                 "fps": 60,
                 "is_streaming": False,
+                "driver_state": {"cameras": {}, "restarts": 0},
             }
 
         # If the subprocess died unexpectedly, reflect that in is_streaming
@@ -157,15 +233,22 @@ def api_v1_stream_state_get():  # noqa: E501
 
         state = dict(stream_state)  # copy
         state["is_streaming"] = bool(is_streaming and alive)
-        return state
+        restarts = driver_restarts
+
+    with driver_events_lock:
+        cameras = {camera: {"state": s["state"], "event": s["event"].get("event"), "ts": s["event"].get("ts")}
+                   for camera, s in camera_states.items()}
+    state["driver_state"] = {"cameras": cameras, "restarts": restarts}
+    return state
 
 
 def api_v1_stream_stop_post():
-    global is_streaming, streaming_thread, process
+    global is_streaming, streaming_thread, process, stop_requested
 
     with state_lock:
         if not is_streaming or process is None:
             return "Stream already stopped!"
+        stop_requested = True
 
         try:
             if process.stdin:
@@ -174,7 +257,11 @@ def api_v1_stream_stop_post():
         except Exception as e:
             print(f"Failed to send stop command: {e}")
 
-        process.terminate()
+        # A signal on top of the stop command would only cut the drain short
+        try:
+            process.wait(timeout=DRIVER_STOP_TIMEOUT_S)
+        except subprocess.TimeoutExpired:
+            process.terminate()
 
     # Join thread outside lock to avoid deadlock
     if streaming_thread:
@@ -0,0 +1,59 @@
+//
+// Network impairment proxy: forwards UDP from a local port to the receiver through the impairments of a scenario
+// file (see impairment.h), e.g. between the driver and a receiver on the same machine. Runs until interrupted.
+// Usage: impair_proxy <scenario.json> <listen port> <host> <port> [<listen port> <host> <port> ...]
+//
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "impairment.h"
+
+std::atomic<bool> interrupted{false};
+
+void OnSignal(int) {
+    interrupted.store(true);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 5 || (argc - 2) % 3 != 0) {
+        std::cerr << "Usage: " << argv[0] << " <scenario.json> <listen port> <host> <port> [<listen port> <host> <port> ...]\n";
+        return 2;
+    }
+
+    ImpairmentScenario scenario;
+    try {
+        scenario = LoadImpairmentScenario(argv[1]);
+    } catch (const std::exception &e) {
+        std::cerr << argv[1] << ": " << e.what() << "\n";
+        return 2;
+    }
+
+    // Each stream gets its own generator with the same seed, a stream's fate doesn't depend on the others
+    std::vector<std::unique_ptr<ImpairmentProxy> > proxies;
+    for (int i = 2; i + 2 < argc; i += 3) {
+        auto proxy = std::make_unique<ImpairmentProxy>();
+        proxy->name = std::string("proxy_") + argv[i];
+        if (!StartImpairmentProxy(*proxy, scenario, std::atoi(argv[i]), argv[i + 1], std::atoi(argv[i + 2]))) {
+            return 1;
+        }
+        proxies.push_back(std::move(proxy));
+    }
+
+    std::signal(SIGINT, OnSignal);
+    std::signal(SIGTERM, OnSignal);
+    while (!interrupted.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    for (auto &proxy: proxies) {
+        StopImpairmentProxy(*proxy);
+        PrintImpairmentStats(proxy->name, proxy->impairment.stats);
+    }
+    return 0;
+}
@@ -0,0 +1,708 @@
+//
+// Loopback latency benchmark: the software sender pipelines stream to the receiving pipelines over UDP on localhost,
+// in one process. Per codec it reports the latency of every stage from the frame metadata in the RTP header,
+// glass-to-glass latency (capture to the end of the receiving pipeline), fps, loss and the PSNR/SSIM of every decoded
+// frame against its reference frame (see quality.h), as JSON. With a scenario file the packets pass an impairment
+// proxy (see impairment.h) on their way to the receiver.
+// The sweep mode runs a grid of codec x resolution x fps x JPEG quality/bitrate x H.264/H.265 slices and reports
+// encode time, latency, bits per frame, PSNR and SSIM per point, plus the Pareto-optimal points of every resolution
+// and fps. bench/grids/slices.json compares 1, 2 and 4 slices per frame.
+// The camera mode streams 1, 2, 4 ... N JPEG cameras at once, each from its own test source, and reports per-camera
+// and total fps, loss and process CPU.
+// Every run reports the packets/s leaving the payloader and the process CPU (sender and receiver together), the
+// batch_send axis of the sweep compares udpsink with the batched sender (udp_batch.h), see
+// bench/grids/batch_send.json.
+// Usage: loopback_bench [seconds] [width] [height] [fps] [output.json] [scenario.json]
+//        loopback_bench --sweep [grid.json] [output.json]
+//        loopback_bench --cameras <N> [seconds] [output.json]
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <gst/gst.h>
+#include "config.h"
+#include "impairment.h"
+#include "json.hpp"
+#include "logging.h"
+#include "pipelines.h"
+#include "quality.h"
+#include "receiver.h"
+#include "udp_batch.h"
+
+using json = nlohmann::json;
+
+constexpr int BENCH_BASE_PORT = 5700;
+constexpr int BENCH_PROXY_PORT_OFFSET = 1000;
+constexpr std::chrono::seconds BENCH_WARMUP{1};
+
+std::mutex received_mutex;
+std::map<std::string, std::vector<ReceivedFrame> > received_frames; // by receiving pipeline name
+std::atomic<bool> measuring{false};
+
+void OnFrameReceived(const std::string &pipelineName, const ReceivedFrame &frame) {
+    if (!measuring.load()) { return; }
+    std::lock_guard<std::mutex> lock(received_mutex);
+    received_frames[pipelineName].push_back(frame);
+}
+
+// Mean and percentiles in ms
+json Summarize(std::vector<double> valuesUs) {
+    if (valuesUs.empty()) { return nullptr; }
+    std::sort(valuesUs.begin(), valuesUs.end());
+    double sum = 0;
+    for (double value: valuesUs) { sum += value; }
+    const auto at = [&valuesUs](double quantile) {
+        return valuesUs[std::min(valuesUs.size() - 1, static_cast<size_t>(quantile * valuesUs.size()))] / 1000.0;
+    };
+    return {{"mean", sum / valuesUs.size() / 1000.0}, {"p50", at(0.5)}, {"p95", at(0.95)}, {"p99", at(0.99)},
+            {"max", valuesUs.back() / 1000.0}};
+}
+
+// Mean and the bad end of the distribution, for PSNR and SSIM
+json SummarizeQuality(std::vector<double> values) {
+    if (values.empty()) { return nullptr; }
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double value: values) { sum += value; }
+    return {{"mean", sum / values.size()}, {"p5", values[static_cast<size_t>(0.05 * values.size())]}, {"min", values.front()}};
+}
+
+template<typename T>
+json SummarizeStage(const std::vector<ReceivedFrame> &frames, T ReceivedFrame::*stage) {
+    std::vector<double> values;
+    for (const auto &frame: frames) {
+        values.push_back(static_cast<double>(frame.*stage));
+    }
+    return Summarize(values);
+}
+
+// The sender's reference frames and the quality of the decoded frames measured against them (see quality.h)
+struct QualityMeter {
+    ReferenceFrames references;
+    std::mutex mutex;
+    std::vector<FrameQuality> frames;
+    uint64_t unmatched = 0; // decoded frames without a reference
+    uint64_t withoutMetadata = 0; // decoded frames whose buffer could not be matched to a frame id
+};
+
+void OnDecodedFrameQuality(const DecodedFrame &frame, void *userData) {
+    auto &meter = *static_cast<QualityMeter *>(userData);
+    if (!measuring.load() || !frame.planar || frame.size < static_cast<size_t>(frame.stride) * frame.height) { return; }
+    if (!frame.matched) {
+        std::lock_guard<std::mutex> lock(meter.mutex);
+        meter.withoutMetadata++;
+        return;
+    }
+
+    FrameQuality quality{};
+    const bool matched = MeasureFrameQuality(meter.references, frame.frameId, frame.data, frame.stride, frame.width,
+                                             frame.height, quality);
+    quality.latencyMs = (static_cast<double>(frame.decodedUs) - static_cast<double>(frame.captureUs)) / 1000.0;
+
+    std::lock_guard<std::mutex> lock(meter.mutex);
+    if (matched) {
+        meter.frames.push_back(quality);
+    } else {
+        meter.unmatched++;
+    }
+}
+
+json SummarizeFrameQuality(const QualityMeter &meter, bool perFrame) {
+    std::vector<double> psnr, ssim, measureUs;
+    json frames = json::array();
+    for (const auto &frame: meter.frames) {
+        psnr.push_back(frame.psnr);
+        ssim.push_back(frame.ssim);
+        measureUs.push_back(frame.measureUs);
+        if (perFrame) {
+            frames.push_back({{"frame_id", frame.frameId}, {"psnr_db", frame.psnr}, {"ssim", frame.ssim},
+                              {"latency_ms", frame.latencyMs}});
+        }
+    }
+    json quality = {{"frames_compared", meter.frames.size()}, {"frames_without_reference", meter.unmatched},
+                    {"frames_without_metadata", meter.withoutMetadata},
+                    {"references_without_capture", meter.references.unmatched.load()},
+                    {"psnr_db", SummarizeQuality(psnr)}, {"ssim", SummarizeQuality(ssim)},
+                    {"measure_ms", Summarize(measureUs)}};
+    if (perFrame) {
+        quality["frames"] = frames;
+    }
+    return quality;
+}
+
+struct EncodedSize {
+    std::atomic<uint64_t> frames{0}, bytes{0};
+};
+
+GstPadProbeReturn OnEncodedBuffer(GstPad *, GstPadProbeInfo *info, gpointer data) {
+    if (!measuring.load()) { return GST_PAD_PROBE_OK; }
+    auto &size = *static_cast<EncodedSize *>(data);
+    size.frames++;
+    size.bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+    return GST_PAD_PROBE_OK;
+}
+
+// Payloaders push a buffer list per frame, or single buffers once an identity splits them
+GstPadProbeReturn OnPayloadedPackets(GstPad *, GstPadProbeInfo *info, gpointer data) {
+    if (!measuring.load()) { return GST_PAD_PROBE_OK; }
+    auto &packets = *static_cast<std::atomic<uint64_t> *>(data);
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        packets += gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    } else {
+        packets++;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstElement *Launch(const std::string &description, const std::string &name) {
+    GError *error = nullptr;
+    GstElement *pipeline = gst_parse_launch(description.c_str(), &error);
+    if (error != nullptr) {
+        std::cerr << name << ": " << error->message << "\n";
+        g_clear_error(&error);
+        if (pipeline != nullptr) { gst_object_unref(pipeline); }
+        return nullptr;
+    }
+    gst_element_set_name(pipeline, name.c_str());
+    return pipeline;
+}
+
+uint64_t GetProcessCpuNs() {
+    timespec res{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &res);
+    return static_cast<uint64_t>(res.tv_sec) * 1'000'000'000 + res.tv_nsec;
+}
+
+// False as soon as any of the pipelines posts an error or EOS
+bool RunUntil(const std::vector<GstElement *> &pipelines, std::chrono::steady_clock::time_point until) {
+    std::vector<GstBus *> buses;
+    for (GstElement *pipeline: pipelines) {
+        buses.push_back(gst_element_get_bus(pipeline));
+    }
+    bool ok = true;
+    while (ok && std::chrono::steady_clock::now() < until) {
+        for (GstBus *bus: buses) {
+            GstMessage *msg = gst_bus_timed_pop_filtered(bus, 10 * GST_MSECOND,
+                                                         static_cast<GstMessageType>(GST_MESSAGE_ERROR | GST_MESSAGE_EOS));
+            if (msg == nullptr) { continue; }
+            if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+                GError *error = nullptr;
+                gst_message_parse_error(msg, &error, nullptr);
+                std::cerr << GST_OBJECT_NAME(GST_MESSAGE_SRC(msg)) << ": " << error->message << "\n";
+                g_clear_error(&error);
+            }
+            gst_message_unref(msg);
+            ok = false;
+        }
+    }
+    for (GstBus *bus: buses) {
+        gst_object_unref(bus);
+    }
+    return ok;
+}
+
+StreamingConfig GetBenchConfig(Codec codec, int index, int width, int height, int fps) {
+    StreamingConfig cfg{};
+    cfg.ip = "127.0.0.1";
+    cfg.portLeft = cfg.portRight = BENCH_BASE_PORT + index;
+    cfg.codec = codec;
+    cfg.encodingQuality = 85;
+    cfg.bitrate = 4'000'000;
+    cfg.horizontalResolution = width;
+    cfg.verticalResolution = height;
+    cfg.fps = fps;
+    return cfg;
+}
+
+// Streams cfg for `seconds` after the warmup. With a quality meter the sender keeps its reference frames and the
+// receiver decodes into an appsink, where every frame is compared against its reference.
+json RunLoopback(StreamingConfig cfg, const std::string &codecName, int seconds, const ImpairmentScenario *scenario,
+                 QualityMeter *quality, bool perFrame) {
+    const int receiverPort = cfg.portLeft;
+    if (scenario != nullptr) {
+        cfg.portLeft = cfg.portRight = receiverPort + BENCH_PROXY_PORT_OFFSET;
+    }
+    const CameraDescriptor camera{0, "bench", cfg.portLeft, "none"};
+
+    const ReceiverSink sink = quality != nullptr ? RECEIVER_APPSINK_I420 : RECEIVER_HEADLESS;
+    std::ostringstream sender, receiver;
+    switch (cfg.codec) {
+        case JPEG: sender = GetJpegStreamingPipeline(cfg, camera);
+            receiver = GetJpegReceivingPipeline(cfg, receiverPort, sink);
+            break;
+        case H264: sender = GetH264StreamingPipeline(cfg, camera);
+            receiver = GetH264ReceivingPipeline(cfg, receiverPort, sink);
+            break;
+        case H265: sender = GetH265StreamingPipeline(cfg, camera);
+            receiver = GetH265ReceivingPipeline(cfg, receiverPort, sink);
+            break;
+        default:
+            return {{"codec", codecName}, {"error", "unsupported codec"}};
+    }
+
+    const std::string senderName = "sender_" + codecName, receiverName = "receiver_" + codecName;
+    json result = {{"codec", codecName}};
+    GstElement *rx = Launch(receiver.str(), receiverName);
+    GstElement *tx = rx != nullptr ? Launch(sender.str(), senderName) : nullptr;
+    if (tx == nullptr) {
+        if (rx != nullptr) { gst_object_unref(rx); }
+        result["error"] = "cannot build the pipelines";
+        return result;
+    }
+    AttachReceivingMetadata(rx);
+    AttachStreamingMetadata(tx);
+    if (quality != nullptr) {
+        AttachReferenceCapture(tx, &quality->references);
+        AttachFrameDelivery(rx, codecName, OnDecodedFrameQuality, quality);
+    }
+
+    EncodedSize encoded;
+    GstElement *encIdent = gst_bin_get_by_name(GST_BIN(tx), "enc_ident");
+    if (encIdent != nullptr) {
+        GstPad *src = gst_element_get_static_pad(encIdent, "src");
+        gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, OnEncodedBuffer, &encoded, nullptr);
+        gst_object_unref(src);
+        gst_object_unref(encIdent);
+    }
+
+    std::atomic<uint64_t> packets{0};
+    GstElement *payloader = gst_bin_get_by_name(GST_BIN(tx), "payloader");
+    if (payloader != nullptr) {
+        GstPad *src = gst_element_get_static_pad(payloader, "src");
+        gst_pad_add_probe(src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          OnPayloadedPackets, &packets, nullptr);
+        gst_object_unref(src);
+        gst_object_unref(payloader);
+    }
+
+    if (!AttachUdpBatchSender(tx, cfg.ip, cfg.portLeft, cfg.pacing <= 0)) {
+        gst_object_unref(tx);
+        gst_object_unref(rx);
+        result["error"] = "cannot open the batched UDP sender";
+        return result;
+    }
+
+    ImpairmentProxy proxy;
+    proxy.name = "proxy_" + codecName;
+    if (scenario != nullptr && !StartImpairmentProxy(proxy, *scenario, cfg.portLeft, cfg.ip, receiverPort)) {
+        gst_object_unref(tx);
+        gst_object_unref(rx);
+        result["error"] = "cannot start the impairment proxy";
+        return result;
+    }
+
+    // Receiver first, so that the first frames are not sent into a closed port
+    gst_element_set_state(rx, GST_STATE_PLAYING);
+    gst_element_set_state(tx, GST_STATE_PLAYING);
+
+    bool ok = RunUntil({tx, rx}, std::chrono::steady_clock::now() + BENCH_WARMUP);
+    const uint64_t sentBefore = GetStreamingStats(senderName).framesPayloaded.load();
+    const uint64_t lostBefore = GetReceivingStats(receiverName).lostPackets.load();
+    const uint64_t cpuBefore = GetProcessCpuNs();
+    const auto begin = std::chrono::steady_clock::now();
+    measuring.store(true);
+    ok = ok && RunUntil({tx, rx}, begin + std::chrono::seconds(seconds));
+    measuring.store(false);
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    const double cpuSeconds = (GetProcessCpuNs() - cpuBefore) / 1e9;
+    const uint64_t sent = GetStreamingStats(senderName).framesPayloaded.load() - sentBefore;
+    const uint64_t lostPackets = GetReceivingStats(receiverName).lostPackets.load() - lostBefore;
+
+    gst_element_set_state(tx, GST_STATE_NULL);
+    gst_element_set_state(rx, GST_STATE_NULL);
+    gst_object_unref(tx);
+    gst_object_unref(rx);
+
+    if (scenario != nullptr) {
+        StopImpairmentProxy(proxy);
+        const ImpairmentStats &stats = proxy.impairment.stats;
+        result["impairment"] = {{"packets", stats.packets}, {"passed", stats.passed}, {"dropped_random", stats.droppedRandom},
+                                {"dropped_burst", stats.droppedBurst}, {"dropped_queue", stats.droppedQueue},
+                                {"reordered", stats.reordered}};
+    }
+
+    std::vector<ReceivedFrame> frames;
+    {
+        std::lock_guard<std::mutex> lock(received_mutex);
+        frames.swap(received_frames[receiverName]);
+    }
+    if (!ok) {
+        result["error"] = "pipeline error";
+    }
+
+    result["frames_sent"] = sent;
+    result["frames_received"] = frames.size();
+    result["fps"] = frames.size() / elapsed;
+    result["frame_loss"] = sent > 0 ? std::max(0.0, 1.0 - static_cast<double>(frames.size()) / sent) : 0.0;
+    result["packets_lost"] = lostPackets;
+    result["bits_per_frame"] = encoded.frames > 0 ? 8.0 * encoded.bytes / encoded.frames : 0.0;
+    result["bitrate_kbps"] = 8.0 * encoded.bytes / elapsed / 1000.0;
+    result["packets_per_s"] = packets / elapsed;
+    result["cpu_percent"] = 100.0 * cpuSeconds / elapsed;
+    if (quality != nullptr) {
+        std::lock_guard<std::mutex> lock(quality->mutex);
+        result["quality"] = SummarizeFrameQuality(*quality, perFrame);
+    }
+    result["glass_to_glass_ms"] = SummarizeStage(frames, &ReceivedFrame::totalUs);
+    result["stages_ms"] = {
+        {"convert", SummarizeStage(frames, &ReceivedFrame::convertUs)},
+        {"encode", SummarizeStage(frames, &ReceivedFrame::encodeUs)},
+        {"payload", SummarizeStage(frames, &ReceivedFrame::payloadUs)},
+        {"network", SummarizeStage(frames, &ReceivedFrame::networkUs)},
+        {"depayload", SummarizeStage(frames, &ReceivedFrame::depayUs)},
+        {"decode", SummarizeStage(frames, &ReceivedFrame::decodeUs)},
+        {"queue", SummarizeStage(frames, &ReceivedFrame::queueUs)},
+        {"videoconvert", SummarizeStage(frames, &ReceivedFrame::videoconvertUs)},
+        {"videoflip", SummarizeStage(frames, &ReceivedFrame::videoflipUs)},
+    };
+    return result;
+}
+
+// A grid file overrides any of these
+const json DEFAULT_SWEEP_GRID = {
+    {"seconds", 3},
+    {"codecs", json::array({"JPEG", "H264", "H265"})},
+    {"resolutions", json::array({json::array({1280, 720}), json::array({1920, 1080})})},
+    {"fps", json::array({30, 60})},
+    {"jpeg_quality", json::array({50, 70, 85, 95})},
+    {"bitrate_kbps", json::array({2000, 4000, 8000, 16000})},
+    {"slices", json::array({0})},
+    {"batch_send", json::array({false})},
+    {"scenario", nullptr},
+};
+
+json GetOrNull(const json &result, const json::json_pointer &pointer) {
+    return result.contains(pointer) ? result.at(pointer) : json(nullptr);
+}
+
+bool IsParetoCandidate(const json &point) {
+    return !point.contains("error") && point["bits_per_frame"].is_number() && point["latency_p95_ms"].is_number() &&
+           point["psnr_db"].is_number();
+}
+
+// Fewer bits per frame, lower latency and higher quality are better
+bool Dominates(const json &a, const json &b) {
+    const double aBits = a["bits_per_frame"], bBits = b["bits_per_frame"];
+    const double aLatency = a["latency_p95_ms"], bLatency = b["latency_p95_ms"];
+    const double aPsnr = a["psnr_db"], bPsnr = b["psnr_db"];
+    return aBits <= bBits && aLatency <= bLatency && aPsnr >= bPsnr &&
+           (aBits < bBits || aLatency < bLatency || aPsnr > bPsnr);
+}
+
+// Within one resolution and fps, the operator picks those first and the encoder setting second
+void MarkPareto(json &points) {
+    for (auto &point: points) {
+        bool optimal = IsParetoCandidate(point);
+        for (const auto &other: points) {
+            if (!optimal) { break; }
+            optimal = !(IsParetoCandidate(other) && other["width"] == point["width"] && other["height"] == point["height"] &&
+                        other["fps"] == point["fps"] && Dominates(other, point));
+        }
+        point["pareto"] = optimal;
+    }
+}
+
+void PrintSweepTable(const json &points) {
+    const auto cell = [](const json &value, int precision) {
+        std::ostringstream oss;
+        if (value.is_number()) {
+            oss << std::fixed << std::setprecision(precision) << value.get<double>();
+        } else {
+            oss << "-";
+        }
+        return oss.str();
+    };
+
+    std::cout << std::left << std::setw(6) << "codec" << std::setw(11) << "resolution" << std::setw(5) << "fps" <<
+            std::setw(12) << "setting" << std::right << std::setw(9) << "enc ms" << std::setw(9) << "p50 ms" <<
+            std::setw(9) << "p95 ms" << std::setw(11) << "kbit/frame" << std::setw(9) << "Mbit/s" << std::setw(8) <<
+            "PSNR" << std::setw(7) << "SSIM" << std::setw(7) << "loss" << std::setw(9) << "pkt/s" << std::setw(7) <<
+            "CPU %" << "  pareto\n";
+    for (const auto &point: points) {
+        const std::string resolution = std::to_string(point["width"].get<int>()) + "x" +
+                                       std::to_string(point["height"].get<int>());
+        std::string setting = point.contains("jpeg_quality")
+                                  ? "q" + std::to_string(point["jpeg_quality"].get<int>())
+                                  : std::to_string(point["bitrate_kbps_target"].get<int>()) + "k";
+        if (point.value("slices", 0) > 0) {
+            setting += "/" + std::to_string(point["slices"].get<int>()) + "s";
+        }
+        if (point.value("batch_send", false)) {
+            setting += "/b";
+        }
+        const json kbitPerFrame = point["bits_per_frame"].is_number() ? json(point["bits_per_frame"].get<double>() / 1000) : json();
+        const json mbitPerS = point["bitrate_kbps"].is_number() ? json(point["bitrate_kbps"].get<double>() / 1000) : json();
+        std::cout << std::left << std::setw(6) << point["codec"].get<std::string>() << std::setw(11) << resolution <<
+                std::setw(5) << point["fps"].get<int>() << std::setw(12) << setting << std::right <<
+                std::setw(9) << cell(point["encode_ms"], 2) << std::setw(9) << cell(point["latency_p50_ms"], 1) <<
+                std::setw(9) << cell(point["latency_p95_ms"], 1) << std::setw(11) << cell(kbitPerFrame, 1) <<
+                std::setw(9) << cell(mbitPerS, 2) << std::setw(8) << cell(point["psnr_db"], 2) <<
+                std::setw(7) << cell(point["ssim"], 3) <<
+                std::setw(7) << cell(point["frame_loss"], 3) << std::setw(9) << cell(point["packets_per_s"], 0) <<
+                std::setw(7) << cell(point["cpu_percent"], 1) << "  " << (point["pareto"].get<bool>() ? "*" : "") <<
+                (point.contains("error") ? point["error"].get<std::string>() : "") << "\n";
+    }
+}
+
+int RunSweep(const std::string &gridPath, const std::string &output) {
+    json grid = DEFAULT_SWEEP_GRID;
+    ImpairmentScenario scenario;
+    try {
+        if (!gridPath.empty()) {
+            std::ifstream file(gridPath);
+            if (!file) {
+                throw std::runtime_error("cannot open the grid");
+            }
+            grid.update(json::parse(file));
+        }
+        if (!grid["scenario"].is_null()) {
+            scenario = LoadImpairmentScenario(grid["scenario"].get<std::string>());
+        }
+    } catch (const std::exception &e) {
+        std::cerr << gridPath << ": " << e.what() << "\n";
+        return 2;
+    }
+    const int seconds = grid["seconds"];
+
+    // JPEG has no slices, its points run once
+    const json jpegSlices = json::array({0});
+    size_t total = 0;
+    for (const auto &codecName: grid["codecs"]) {
+        total += grid["resolutions"].size() * grid["fps"].size() *
+                (codecName == "JPEG" ? grid["jpeg_quality"].size() : grid["bitrate_kbps"].size() * grid["slices"].size()) *
+                grid["batch_send"].size();
+    }
+
+    json points = json::array();
+    int index = 0;
+    for (const auto &codecName: grid["codecs"]) {
+        const Codec codec = GetCodecFromString(codecName.get<std::string>());
+        for (const auto &resolution: grid["resolutions"]) {
+            for (const auto &fps: grid["fps"]) {
+                for (const auto &setting: codec == JPEG ? grid["jpeg_quality"] : grid["bitrate_kbps"]) {
+                    for (const auto &slices: codec == JPEG ? jpegSlices : grid["slices"]) {
+                        for (const auto &batchSend: grid["batch_send"]) {
+                            StreamingConfig cfg = GetBenchConfig(codec, index, resolution[0], resolution[1], fps);
+                            json point = {{"codec", codecName}, {"width", cfg.horizontalResolution},
+                                          {"height", cfg.verticalResolution}, {"fps", cfg.fps}};
+                            if (codec == JPEG) {
+                                cfg.encodingQuality = setting;
+                                point["jpeg_quality"] = setting;
+                            } else {
+                                cfg.bitrate = setting.get<int>() * 1000;
+                                point["bitrate_kbps_target"] = setting;
+                                cfg.slices = slices;
+                                point["slices"] = slices;
+                            }
+                            cfg.batchSend = batchSend;
+                            point["batch_send"] = batchSend;
+                            std::cout << "Sweep " << ++index << "/" << total << ": " << point.dump() << "\n";
+
+                            // Every point gets its own pipeline names, the frame history of earlier points must
+                            // not match
+                            const std::string name = codecName.get<std::string>() + "_" + std::to_string(index);
+                            QualityMeter quality;
+                            const json result = RunLoopback(cfg, name, seconds,
+                                                            grid["scenario"].is_null() ? nullptr : &scenario, &quality, false);
+
+                            point["encode_ms"] = GetOrNull(result, "/stages_ms/encode/p50"_json_pointer);
+                            point["latency_p50_ms"] = GetOrNull(result, "/glass_to_glass_ms/p50"_json_pointer);
+                            point["latency_p95_ms"] = GetOrNull(result, "/glass_to_glass_ms/p95"_json_pointer);
+                            point["bits_per_frame"] = GetOrNull(result, "/bits_per_frame"_json_pointer);
+                            point["bitrate_kbps"] = GetOrNull(result, "/bitrate_kbps"_json_pointer);
+                            point["packets_per_s"] = GetOrNull(result, "/packets_per_s"_json_pointer);
+                            point["cpu_percent"] = GetOrNull(result, "/cpu_percent"_json_pointer);
+                            point["psnr_db"] = GetOrNull(result, "/quality/psnr_db/mean"_json_pointer);
+                            point["psnr_p5_db"] = GetOrNull(result, "/quality/psnr_db/p5"_json_pointer);
+                            point["ssim"] = GetOrNull(result, "/quality/ssim/mean"_json_pointer);
+                            point["fps_received"] = GetOrNull(result, "/fps"_json_pointer);
+                            point["frame_loss"] = GetOrNull(result, "/frame_loss"_json_pointer);
+                            if (result.contains("error")) {
+                                point["error"] = result["error"];
+                            }
+                            points.push_back(point);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    MarkPareto(points);
+    PrintSweepTable(points);
+
+    json pareto = json::array();
+    for (const auto &point: points) {
+        if (point["pareto"].get<bool>()) { pareto.push_back(point); }
+    }
+    std::ofstream file(output, std::ios::trunc);
+    file << json{{"benchmark", "sweep"}, {"grid", grid}, {"points", points}, {"pareto", pareto}}.dump(2) << "\n";
+    return 0;
+}
+
+// One run of `count` cameras streaming at once. Every run gets its own pipeline names, so the frame history of the
+// previous one cannot match.
+json RunCameras(int count, int seconds, int width, int height, int fps) {
+    std::vector<GstElement *> pipelines;
+    std::vector<std::string> senderNames, receiverNames;
+    json result = {{"cameras", count}};
+    for (int i = 0; i < count; i++) {
+        const StreamingConfig cfg = GetBenchConfig(JPEG, i, width, height, fps);
+        const std::string name = "cam" + std::to_string(i) + "_of_" + std::to_string(count);
+        const CameraDescriptor camera{i, name, cfg.portLeft, "none"};
+        GstElement *rx = Launch(GetJpegReceivingPipeline(cfg, cfg.portLeft, RECEIVER_HEADLESS).str(), "receiver_" + name);
+        GstElement *tx = rx != nullptr ? Launch(GetJpegStreamingPipeline(cfg, camera).str(), "sender_" + name) : nullptr;
+        if (tx == nullptr) {
+            if (rx != nullptr) { gst_object_unref(rx); }
+            result["error"] = "cannot build the pipelines";
+            break;
+        }
+        AttachReceivingMetadata(rx);
+        AttachStreamingMetadata(tx);
+        pipelines.push_back(rx);
+        pipelines.push_back(tx);
+        senderNames.push_back("sender_" + name);
+        receiverNames.push_back("receiver_" + name);
+    }
+
+    // All at once, the way the driver's workers bring the cameras up
+    bool ok = !result.contains("error");
+    for (GstElement *pipeline: pipelines) {
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    }
+    ok = ok && RunUntil(pipelines, std::chrono::steady_clock::now() + BENCH_WARMUP);
+
+    std::vector<uint64_t> sentBefore;
+    for (const auto &name: senderNames) {
+        sentBefore.push_back(GetStreamingStats(name).framesPayloaded.load());
+    }
+    const uint64_t cpuBefore = GetProcessCpuNs();
+    const auto begin = std::chrono::steady_clock::now();
+    measuring.store(true);
+    ok = ok && RunUntil(pipelines, begin + std::chrono::seconds(seconds));
+    measuring.store(false);
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    const double cpuSeconds = (GetProcessCpuNs() - cpuBefore) / 1e9;
+
+    for (GstElement *pipeline: pipelines) {
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+    }
+
+    json perCamera = json::array();
+    double totalFps = 0, minFps = -1;
+    uint64_t totalSent = 0, totalReceived = 0, lostPackets = 0;
+    for (size_t i = 0; i < senderNames.size(); i++) {
+        const uint64_t sent = GetStreamingStats(senderNames[i]).framesPayloaded.load() - sentBefore[i];
+        size_t received;
+        {
+            std::lock_guard<std::mutex> lock(received_mutex);
+            received = received_frames[receiverNames[i]].size();
+            received_frames.erase(receiverNames[i]);
+        }
+        const double cameraFps = received / elapsed;
+        totalFps += cameraFps;
+        minFps = minFps < 0 ? cameraFps : std::min(minFps, cameraFps);
+        totalSent += sent;
+        totalReceived += received;
+        lostPackets += GetReceivingStats(receiverNames[i]).lostPackets.load();
+        perCamera.push_back({{"frames_sent", sent}, {"frames_received", received}, {"fps", cameraFps}});
+    }
+
+    if (!ok && !result.contains("error")) {
+        result["error"] = "pipeline error";
+    }
+    result["per_camera"] = perCamera;
+    result["fps_total"] = totalFps;
+    result["fps_min"] = std::max(minFps, 0.0);
+    result["frame_loss"] = totalSent > 0 ? std::max(0.0, 1.0 - static_cast<double>(totalReceived) / totalSent) : 0.0;
+    result["packets_lost"] = lostPackets;
+    result["cpu_percent"] = 100.0 * cpuSeconds / elapsed;
+    std::cout << count << " cameras: " << totalFps << " fps total, " << result["fps_min"] << " fps slowest camera, " <<
+            result["frame_loss"] << " frame loss, " << result["cpu_percent"] << " % CPU\n";
+    return result;
+}
+
+int RunCameraScaling(int maxCameras, int seconds, const std::string &output) {
+    constexpr int width = 1280, height = 720, fps = 30;
+    json runs = json::array();
+    bool failed = false;
+    for (int count = 1;; count = std::min(count * 2, maxCameras)) {
+        json result = RunCameras(count, seconds, width, height, fps);
+        failed |= result.contains("error");
+        runs.push_back(result);
+        if (count == maxCameras) { break; }
+    }
+
+    std::ofstream file(output, std::ios::trunc);
+    file << json{{"benchmark", "cameras"}, {"width", width}, {"height", height}, {"fps", fps}, {"seconds", seconds},
+                 {"runs", runs}}.dump(2) << "\n";
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 && std::string(argv[1]) == "--cameras") {
+        const int maxCameras = std::atoi(argv[2]);
+        if (maxCameras < 1) {
+            std::cerr << "Invalid camera count passed!\n";
+            return 2;
+        }
+        gst_init(nullptr, nullptr);
+        gst_debug_set_default_threshold(GST_LEVEL_ERROR);
+        receivedFrameCallback = OnFrameReceived;
+        return RunCameraScaling(maxCameras, argc > 3 ? std::atoi(argv[3]) : 5, argc > 4 ? argv[4] : "cameras_bench.json");
+    }
+    if (argc > 1 && std::string(argv[1]) == "--sweep") {
+        gst_init(nullptr, nullptr);
+        gst_debug_set_default_threshold(GST_LEVEL_ERROR);
+        receivedFrameCallback = OnFrameReceived;
+        return RunSweep(argc > 2 ? argv[2] : "", argc > 3 ? argv[3] : "sweep_bench.json");
+    }
+
+    const int seconds = argc > 1 ? std::atoi(argv[1]) : 10;
+    const int width = argc > 2 ? std::atoi(argv[2]) : 1280;
+    const int height = argc > 3 ? std::atoi(argv[3]) : 720;
+    const int fps = argc > 4 ? std::atoi(argv[4]) : 30;
+    const std::string output = argc > 5 ? argv[5] : "loopback_bench.json";
+    const std::string scenarioPath = argc > 6 ? argv[6] : "";
+
+    ImpairmentScenario scenario;
+    if (!scenarioPath.empty()) {
+        try {
+            scenario = LoadImpairmentScenario(scenarioPath);
+        } catch (const std::exception &e) {
+            std::cerr << scenarioPath << ": " << e.what() << "\n";
+            return 2;
+        }
+    }
+
+    gst_init(nullptr, nullptr);
+    gst_debug_set_default_threshold(GST_LEVEL_ERROR);
+    receivedFrameCallback = OnFrameReceived;
+
+    json report = {{"benchmark", "loopback"}, {"width", width}, {"height", height}, {"fps", fps}, {"seconds", seconds},
+                   {"scenario", scenarioPath.empty() ? json(nullptr) : json(scenarioPath)}, {"codecs", json::array()}};
+    int index = 0;
+    bool failed = false;
+    for (const auto &[codec, name]: std::vector<std::pair<Codec, std::string> >{{JPEG, "JPEG"}, {H264, "H264"}, {H265, "H265"}}) {
+        std::cout << "Running " << name << " for " << seconds << " s...\n";
+        QualityMeter quality;
+        json result = RunLoopback(GetBenchConfig(codec, index++, width, height, fps), name, seconds,
+                                  scenarioPath.empty() ? nullptr : &scenario, &quality, true);
+        failed |= result.contains("error");
+        report["codecs"].push_back(result);
+    }
+
+    std::ofstream file(output, std::ios::trunc);
+    file << report.dump(2) << "\n";
+    std::cout << report.dump(2) << "\n";
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,360 @@
+//
+// Microbenchmarks of the driver's per-buffer and control paths: the identity handoffs, the payloader probe adding
+// the RTP metadata, config parsing, the hot-update lookup and launch string generation, plus the 1080p quality
+// kernels, the JPEG restart marker insertion the sender runs on every frame and the per-packet cost of pushing the
+// payloader's buffer lists into udpsink whole or split by an identity. Reports ns/op and heap allocations/op, GLib's
+// included.
+// Usage: micro_bench [iterations] [output.json]
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include "config.h"
+#include "hot_update.h"
+#include "jpeg_restart.h"
+#include "json.hpp"
+#include "logging.h"
+#include "pipelines.h"
+#include "quality.h"
+
+using json = nlohmann::json;
+
+// Every heap allocation of the process goes through these, the glibc allocator underneath does the work
+std::atomic<uint64_t> allocations{0};
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+}
+
+constexpr const char *BENCH_PIPELINE_NAME = "pipeline_left";
+constexpr GstClockTime FRAME_INTERVAL = GST_SECOND / 60;
+
+json results = json::array();
+volatile size_t sink = 0; // keeps results of the measured code alive
+
+// `prepare` runs untimed before every batch of `batchSize` ops, for ops consuming their input
+void Measure(const std::string &name, uint64_t iterations, uint64_t batchSize, const std::function<void(uint64_t)> &prepare,
+             const std::function<void(uint64_t)> &op) {
+    double ns = 0;
+    uint64_t allocs = 0, ops = 0;
+    for (uint64_t batch = 0; ops < iterations; batch++) {
+        prepare(batch);
+        const uint64_t allocBefore = allocations.load(std::memory_order_relaxed);
+        const auto begin = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batchSize; i++) {
+            op(batch * batchSize + i);
+        }
+        ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        allocs += allocations.load(std::memory_order_relaxed) - allocBefore;
+        ops += batchSize;
+    }
+
+    std::cout << name << ": " << ns / ops << " ns/op, " << static_cast<double>(allocs) / ops << " allocs/op\n";
+    results.push_back({{"name", name}, {"ns_per_op", ns / ops}, {"allocs_per_op", static_cast<double>(allocs) / ops},
+                       {"iterations", ops}});
+}
+
+void Measure(const std::string &name, uint64_t iterations, const std::function<void(uint64_t)> &op) {
+    op(0); // first-time allocations, e.g. map entries
+    Measure(name, iterations, iterations, [](uint64_t) {}, op);
+}
+
+GstElement *AddIdentity(GstElement *pipeline, const char *name) {
+    GstElement *identity = gst_element_factory_make("identity", name);
+    gst_bin_add(GST_BIN(pipeline), identity);
+    return identity;
+}
+
+GstBuffer *MakeRtpBuffer(GstClockTime pts, uint32_t rtpTimestamp) {
+    GstBuffer *buffer = gst_rtp_buffer_new_allocate(1200, 0, 0);
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    gst_rtp_buffer_map(buffer, GST_MAP_WRITE, &rtp);
+    gst_rtp_buffer_set_timestamp(&rtp, rtpTimestamp);
+    gst_rtp_buffer_unmap(&rtp);
+    GST_BUFFER_PTS(buffer) = pts;
+    return buffer;
+}
+
+void BenchStreamingInstrumentation(uint64_t iterations) {
+    GstElement *pipeline = gst_pipeline_new(BENCH_PIPELINE_NAME);
+    GstElement *camsrc = AddIdentity(pipeline, "camsrc_ident");
+    GstElement *vidconv = AddIdentity(pipeline, "vidconv_ident");
+    GstElement *enc = AddIdentity(pipeline, "enc_ident");
+    GstPad *payloaderSrc = gst_element_get_static_pad(AddIdentity(pipeline, "payloader"), "src");
+    GstBuffer *frame = gst_buffer_new_allocate(nullptr, 64, nullptr);
+
+    const auto passStages = [&](GstClockTime pts) {
+        GST_BUFFER_PTS(frame) = pts;
+        OnIdentityHandoffCameraStreaming(camsrc, frame, nullptr);
+        OnIdentityHandoffCameraStreaming(vidconv, frame, nullptr);
+        OnIdentityHandoffCameraStreaming(enc, frame, nullptr);
+    };
+    Measure("identity handoffs (3 stages of a frame)", iterations, [&](uint64_t i) { passStages(i * FRAME_INTERVAL); });
+
+    // The probe consumes its buffers, a batch is prepared untimed. Batches stay below the captured frame history,
+    // so every packet finds its frame.
+    constexpr uint64_t batchSize = CAPTURED_FRAMES_HISTORY / 2;
+    std::vector<GstBuffer *> packets(batchSize);
+    uint64_t nextFrame = iterations;
+    const auto probe = [&](uint64_t i) {
+        GstPadProbeInfo info{};
+        info.type = GST_PAD_PROBE_TYPE_BUFFER;
+        info.data = packets[i % batchSize];
+        OnPayloaderProbeCameraStreaming(payloaderSrc, &info, nullptr);
+        gst_buffer_unref(GST_PAD_PROBE_INFO_BUFFER(&info));
+    };
+
+    Measure("payloader probe, first packet of a frame (RTP metadata)", iterations, batchSize, [&](uint64_t) {
+        for (auto &packet: packets) {
+            const GstClockTime pts = nextFrame++ * FRAME_INTERVAL;
+            passStages(pts);
+            packet = MakeRtpBuffer(pts, static_cast<uint32_t>(nextFrame));
+        }
+    }, probe);
+
+    Measure("payloader probe, further packet of a frame", iterations, batchSize, [&](uint64_t) {
+        for (auto &packet: packets) {
+            packet = MakeRtpBuffer(nextFrame * FRAME_INTERVAL, static_cast<uint32_t>(nextFrame));
+        }
+    }, probe);
+
+    gst_buffer_unref(frame);
+    gst_object_unref(payloaderSrc);
+    gst_object_unref(pipeline);
+}
+
+void BenchControlPath(uint64_t iterations) {
+    const std::string message = R"({"cmd": "update", "config": {"ip": "192.168.1.100", "portLeft": 8554, "portRight": 8556,
+        "codec": "H264", "encodingQuality": 85, "bitrate": 4000000, "horizontalResolution": 1920, "verticalResolution": 1080,
+        "videoMode": "stereo", "fps": 60, "mtu": 1300, "pacing": 0.5, "stageQueues": ["capture", "encode"]}})";
+    const json parsed = json::parse(message);
+
+    Measure("control message parse + ConfigFromJson", iterations, [&](uint64_t) {
+        sink = sink + ConfigFromJson(json::parse(message).at("config")).fps;
+    });
+    Measure("ConfigFromJson", iterations, [&](uint64_t) {
+        sink = sink + ConfigFromJson(parsed.at("config")).fps;
+    });
+
+    const StreamingConfig cfg = ConfigFromJson(parsed.at("config"));
+    StreamingConfig changed = cfg;
+    changed.bitrate = 2'000'000;
+    changed.ip = "192.168.1.101";
+    Measure("GetHotUpdatePlan (2 live fields)", iterations, [&](uint64_t) {
+        sink = sink + GetHotUpdatePlan(cfg, changed).live.size();
+    });
+
+    const CameraDescriptor camera = GetDefaultCameraMap()[0];
+    for (const auto &[codec, name]: std::vector<std::pair<Codec, std::string> >{{JPEG, "JPEG"}, {H264, "H264"}, {H265, "H265"}}) {
+        StreamingConfig codecCfg = cfg;
+        codecCfg.codec = codec;
+        Measure("launch string " + name, iterations, [&](uint64_t) {
+            std::ostringstream oss;
+            switch (codec) {
+                case JPEG: oss = GetJpegStreamingPipeline(codecCfg, camera);
+                    break;
+                case H264: oss = GetH264StreamingPipeline(codecCfg, camera);
+                    break;
+                default: oss = GetH265StreamingPipeline(codecCfg, camera);
+                    break;
+            }
+            sink = sink + oss.str().size();
+        });
+    }
+}
+
+// A gradient against a noisy copy of it, 1080p luma
+void BenchQualityKernels(uint64_t iterations) {
+    constexpr int width = 1920, height = 1080;
+    std::vector<uint8_t> reference(width * height), decoded(width * height);
+    uint32_t noise = 1;
+    for (size_t i = 0; i < reference.size(); i++) {
+        noise = noise * 1664525 + 1013904223;
+        reference[i] = static_cast<uint8_t>(i % width + i / width);
+        decoded[i] = static_cast<uint8_t>(std::clamp(reference[i] + static_cast<int>(noise >> 28) - 8, 0, 255));
+    }
+
+    // Full frames are ~1 ms each, far fewer iterations do
+    const uint64_t frames = std::max<uint64_t>(1, iterations / 1000);
+    Measure("PSNR 1080p luma", frames, [&](uint64_t) {
+        sink = sink + static_cast<size_t>(ComputePsnr(decoded.data(), width, reference.data(), width, width, height));
+    });
+    Measure("SSIM 1080p luma", frames, [&](uint64_t) {
+        sink = sink + static_cast<size_t>(100 * ComputeSsim(decoded.data(), width, reference.data(), width, width, height));
+    });
+}
+
+// A noisy 1080p gradient encoded like jpegenc does (4:2:0, standard Huffman tables)
+std::vector<uint8_t> EncodeTestJpeg(int width, int height, int quality) {
+    std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+    uint32_t noise = 1;
+    for (size_t i = 0; i < rgb.size(); i++) {
+        noise = noise * 1664525 + 1013904223;
+        const size_t pixel = i / 3;
+        rgb[i] = static_cast<uint8_t>(pixel % width / 8 + pixel / width / 8 + (noise >> 29) + i % 3 * 40);
+    }
+
+    jpeg_compress_struct cinfo{};
+    jpeg_error_mgr err{};
+    unsigned char *outBuffer = nullptr;
+    unsigned long outSize = 0;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &outBuffer, &outSize);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = rgb.data() + static_cast<size_t>(cinfo.next_scanline) * width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    std::vector<uint8_t> jpeg(outBuffer, outBuffer + outSize);
+    jpeg_destroy_compress(&cinfo);
+    free(outBuffer);
+    return jpeg;
+}
+
+// OnEncoderProbeJpegRestart runs this on the encoder's streaming thread for every frame
+void BenchJpegRestart(uint64_t iterations) {
+    const std::vector<uint8_t> jpeg = EncodeTestJpeg(1920, 1080, 85);
+    std::vector<uint8_t> restarted;
+
+    // Several ms per frame, far fewer iterations do
+    const uint64_t frames = std::max<uint64_t>(1, iterations / 1000);
+    for (const int restartRows: {1, 4}) {
+        Measure("JPEG restart markers 1080p q85, every " + std::to_string(restartRows) + " MCU rows", frames, [&](uint64_t) {
+            sink = sink + AddJpegRestartMarkers(jpeg.data(), jpeg.size(), restartRows, restarted);
+        });
+    }
+}
+
+void OnBenchHandoff(GstElement *, GstBuffer *, gpointer) {
+    sink = sink + 1;
+}
+
+// The payloader pushes a buffer list per frame. udpsink (multiudpsink render_list) sends a whole list with one
+// sendmmsg, the rtppay_ident identity the sender used before split it into one handoff and one send per packet.
+// The target is a loopback socket nobody reads, the kernel drops what overflows it.
+void BenchUdpPush(uint64_t iterations) {
+    constexpr uint64_t packetsPerFrame = 30, framesPerBatch = 32;
+    const int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (receiver < 0 || bind(receiver, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        getsockname(receiver, reinterpret_cast<sockaddr *>(&address), &addressLength) != 0) {
+        std::cerr << "Could not bind a loopback socket, skipping the udpsink benchmark\n";
+        if (receiver >= 0) { close(receiver); }
+        return;
+    }
+
+    for (const bool split: {false, true}) {
+        GstElement *pipeline = gst_pipeline_new("pipeline_udp_push");
+        GstElement *udpsink = gst_element_factory_make("udpsink", "udpsink");
+        g_object_set(udpsink, "host", "127.0.0.1", "port", static_cast<gint>(ntohs(address.sin_port)), "sync", FALSE,
+                     "async", FALSE, nullptr);
+        gst_bin_add(GST_BIN(pipeline), udpsink);
+        GstElement *first = udpsink;
+        if (split) {
+            first = AddIdentity(pipeline, "rtppay_ident");
+            g_signal_connect(first, "handoff", G_CALLBACK(OnBenchHandoff), nullptr);
+            gst_element_link(first, udpsink);
+        }
+
+        GstPad *src = gst_pad_new("src", GST_PAD_SRC);
+        GstPad *firstSink = gst_element_get_static_pad(first, "sink");
+        gst_pad_link(src, firstSink);
+        gst_object_unref(firstSink);
+        gst_pad_set_active(src, TRUE);
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+        GstCaps *caps = gst_caps_from_string("application/x-rtp");
+        GstSegment segment;
+        gst_segment_init(&segment, GST_FORMAT_TIME);
+        gst_pad_push_event(src, gst_event_new_stream_start("udp_push"));
+        gst_pad_push_event(src, gst_event_new_caps(caps));
+        gst_pad_push_event(src, gst_event_new_segment(&segment));
+        gst_caps_unref(caps);
+
+        // Timed per packet, the list of a frame is pushed with its first packet
+        std::vector<GstBufferList *> lists(framesPerBatch);
+        uint32_t rtpTimestamp = 0;
+        const std::string name = split ? "udpsink behind an identity splitting the lists (per packet)"
+                                       : "udpsink, " + std::to_string(packetsPerFrame) + "-packet buffer lists (per packet)";
+        Measure(name, iterations, packetsPerFrame * framesPerBatch, [&](uint64_t batch) {
+            for (uint64_t f = 0; f < framesPerBatch; f++) {
+                const GstClockTime pts = (batch * framesPerBatch + f) * FRAME_INTERVAL;
+                rtpTimestamp += 1500;
+                lists[f] = gst_buffer_list_new_sized(packetsPerFrame);
+                for (uint64_t p = 0; p < packetsPerFrame; p++) {
+                    gst_buffer_list_add(lists[f], MakeRtpBuffer(pts, rtpTimestamp));
+                }
+            }
+        }, [&](uint64_t i) {
+            if (i % packetsPerFrame == 0) {
+                sink = sink + gst_pad_push_list(src, lists[i / packetsPerFrame % framesPerBatch]);
+            }
+        });
+
+        gst_pad_set_active(src, FALSE);
+        gst_object_unref(src);
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+    }
+    close(receiver);
+}
+
+int main(int argc, char *argv[]) {
+    const uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100'000;
+    const std::string output = argc > 2 ? argv[2] : "";
+
+    gst_init(nullptr, nullptr);
+    BenchStreamingInstrumentation(iterations);
+    BenchControlPath(iterations);
+    BenchQualityKernels(iterations);
+    BenchJpegRestart(iterations);
+    BenchUdpPush(iterations);
+
+    if (!output.empty()) {
+        std::ofstream file(output, std::ios::trunc);
+        file << json{{"benchmark", "micro"}, {"results", results}}.dump(2) << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+//
+// Shared-memory ring throughput benchmark: one writer thread publishing frames, one reader process consuming
+// them in place. Usage: shm_ring_bench [width] [height] [fps, 0 = as fast as possible] [seconds] [slots]
+//
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include "shm_ring.h"
+
+constexpr const char *BENCH_RING_NAME = "/telepresence_shm_bench";
+
+inline uint64_t GetCurrentUs() {
+    struct timespec res{};
+    clock_gettime(CLOCK_REALTIME, &res);
+    return static_cast<uint64_t>(res.tv_sec) * 1'000'000 + res.tv_nsec / 1000;
+}
+
+int RunReader(int seconds) {
+    ShmRing ring;
+    const auto openDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (!OpenShmRing(ring, BENCH_RING_NAME)) {
+        if (std::chrono::steady_clock::now() > openDeadline) {
+            std::cerr << "reader: cannot open " << BENCH_RING_NAME << "\n";
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    uint64_t lastIndex = UINT64_MAX, frames = 0, skipped = 0, torn = 0, latencyUs = 0, maxLatencyUs = 0, checksum = 0;
+    const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        ShmFrameView view;
+        if (!PeekLatestShmFrame(ring, view, lastIndex)) { continue; }
+
+        // Touch every cache line, the way a consumer looking at the whole frame would
+        for (uint32_t i = 0; i < view.size; i += 64) {
+            checksum += view.data[i];
+        }
+        if (!IsShmFrameValid(view)) {
+            torn++;
+            continue;
+        }
+
+        const uint64_t latency = GetCurrentUs() - view.captureUs;
+        latencyUs += latency;
+        maxLatencyUs = std::max(maxLatencyUs, latency);
+        if (lastIndex != UINT64_MAX && view.index > lastIndex + 1) {
+            skipped += view.index - lastIndex - 1;
+        }
+        lastIndex = view.index;
+        frames++;
+    }
+
+    std::cout << "reader: " << frames << " frames, " << skipped << " skipped, " << torn << " torn, " <<
+            (frames ? latencyUs / frames : 0) << " us avg latency, " << maxLatencyUs << " us max latency" <<
+            " (checksum " << checksum % 256 << ")\n";
+    CloseShmRing(ring);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const int width = argc > 1 ? std::atoi(argv[1]) : 1920;
+    const int height = argc > 2 ? std::atoi(argv[2]) : 1080;
+    const int fps = argc > 3 ? std::atoi(argv[3]) : 0;
+    const int seconds = argc > 4 ? std::atoi(argv[4]) : 5;
+    const int slots = argc > 5 ? std::atoi(argv[5]) : 4;
+    const auto frameSize = static_cast<uint32_t>(width * height * 3 / 2); // NV12
+
+    ShmRing ring;
+    if (!CreateShmRing(ring, BENCH_RING_NAME, slots, frameSize)) {
+        std::cerr << "writer: cannot create " << BENCH_RING_NAME << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    const pid_t reader = fork();
+    if (reader == 0) {
+        CloseShmRing(ring);
+        return RunReader(seconds);
+    }
+
+    std::vector<uint8_t> frame(frameSize);
+    uint64_t frames = 0, copyUs = 0;
+    const auto begin = std::chrono::steady_clock::now();
+    const auto end = begin + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        frame[frames % frameSize] = static_cast<uint8_t>(frames);
+
+        const auto copyBegin = GetCurrentUs();
+        WriteShmRing(ring, frame.data(), frameSize, frames, GetCurrentUs(), SHM_FRAME_RAW, width, height, "NV12");
+        copyUs += GetCurrentUs() - copyBegin;
+        frames++;
+
+        if (fps > 0) {
+            std::this_thread::sleep_until(begin + std::chrono::microseconds(1'000'000LL * frames / fps));
+        }
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::cout << "writer: " << width << "x" << height << " NV12, " << slots << " slots, " <<
+            frames / elapsed << " frames/s, " << frames * static_cast<double>(frameSize) / elapsed / 1e9 << " GB/s, " <<
+            static_cast<double>(copyUs) / frames << " us/frame copy\n";
+
+    int status = 0;
+    waitpid(reader, &status, 0);
+    DestroyShmRing(ring);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
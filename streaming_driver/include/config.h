@@ -0,0 +1,106 @@
+//
+// Streaming config as it arrives from the supervisor in the "update" control message, and its defaults
+//
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "json.hpp"
+#include "pipelines.h"
+
+inline const StreamingConfig DEFAULT_STREAMING_CONFIG = {
+    "192.168.1.100", 8554, 8556, Codec::JPEG, 85, 400000, 1920, 1080, VideoMode::STEREO, 60
+};
+
+inline Codec GetCodecFromString(const std::string &codecString) {
+    if (codecString == "JPEG") return Codec::JPEG;
+    if (codecString == "VP8") return Codec::VP8;
+    if (codecString == "VP9") return Codec::VP9;
+    if (codecString == "H264") return Codec::H264;
+    if (codecString == "H265") return Codec::H265;
+    throw std::invalid_argument("Invalid codec passed!");
+}
+
+inline VideoMode GetVideoModeFromString(const std::string &videoModeString) {
+    if (videoModeString == "stereo") return VideoMode::STEREO;
+    if (videoModeString == "mono") return VideoMode::MONO;
+    throw std::invalid_argument("Invalid video mode passed!");
+}
+
+inline StageQueue GetStageQueueFromString(const std::string &stageString) {
+    if (stageString == "capture") return StageQueue::STAGE_QUEUE_CAPTURE;
+    if (stageString == "convert") return StageQueue::STAGE_QUEUE_CONVERT;
+    if (stageString == "encode") return StageQueue::STAGE_QUEUE_ENCODE;
+    throw std::invalid_argument("Invalid stage queue passed!");
+}
+
+inline ShmOutputMode GetShmOutputModeFromString(const std::string &shmOutputString) {
+    if (shmOutputString == "none") return ShmOutputMode::SHM_NONE;
+    if (shmOutputString == "raw") return ShmOutputMode::SHM_RAW;
+    if (shmOutputString == "encoded") return ShmOutputMode::SHM_ENCODED;
+    if (shmOutputString == "both") return ShmOutputMode::SHM_BOTH;
+    throw std::invalid_argument("Invalid shared-memory output passed!");
+}
+
+inline StreamingConfig ConfigFromJson(const nlohmann::json &c) {
+    StreamingConfig out;
+    out.ip = c.at("ip").get<std::string>();
+    out.portLeft = c.at("portLeft").get<int>();
+    out.portRight = c.at("portRight").get<int>();
+    out.codec = GetCodecFromString(c.at("codec").get<std::string>());
+    out.encodingQuality = c.at("encodingQuality").get<int>();
+    out.bitrate = c.at("bitrate").get<int>();
+    out.horizontalResolution = c.at("horizontalResolution").get<int>();
+    out.verticalResolution = c.at("verticalResolution").get<int>();
+    out.videoMode = GetVideoModeFromString(c.at("videoMode").get<std::string>());
+    out.fps = c.at("fps").get<int>();
+    out.mtu = c.value("mtu", DEFAULT_STREAMING_CONFIG.mtu);
+    out.pacing = c.value("pacing", DEFAULT_STREAMING_CONFIG.pacing);
+    out.batchSend = c.value("batchSend", DEFAULT_STREAMING_CONFIG.batchSend);
+    out.slices = c.value("slices", DEFAULT_STREAMING_CONFIG.slices);
+    if (out.slices < 0 || out.slices > 64) throw std::invalid_argument("Invalid slice count passed!");
+    out.restartInterval = c.value("restartInterval", DEFAULT_STREAMING_CONFIG.restartInterval);
+    if (out.restartInterval < 0) throw std::invalid_argument("Invalid restart interval passed!");
+    out.stageQueues = 0;
+    for (const auto &stage: c.value("stageQueues", std::vector<std::string>{})) {
+        out.stageQueues |= GetStageQueueFromString(stage);
+    }
+    out.stageQueueMs = c.value("stageQueueMs", DEFAULT_STREAMING_CONFIG.stageQueueMs);
+    if (out.stageQueueMs < 1) throw std::invalid_argument("Invalid stage queue latency bound passed!");
+    out.shmOutput = GetShmOutputModeFromString(c.value("shmOutput", std::string("none")));
+    out.shmSlots = c.value("shmSlots", DEFAULT_STREAMING_CONFIG.shmSlots);
+    if (out.shmSlots < 2 || out.shmSlots > 64) throw std::invalid_argument("Invalid shared-memory slot count passed!");
+    if (out.mtu < 200 || out.mtu > 65000) throw std::invalid_argument("Invalid MTU passed!");
+    if (out.pacing < 0 || out.pacing > 1) throw std::invalid_argument("Invalid pacing fraction passed!");
+    return out;
+}
+
+inline std::string CodecToString(Codec codec) {
+    switch (codec) {
+        case JPEG: return "JPEG";
+        case VP8: return "VP8";
+        case VP9: return "VP9";
+        case H264: return "H264";
+        case H265: return "H265";
+        default: return "UNKNOWN";
+    }
+}
+
+inline std::string ShmOutputModeToString(ShmOutputMode mode) {
+    switch (mode) {
+        case SHM_NONE: return "none";
+        case SHM_RAW: return "raw";
+        case SHM_ENCODED: return "encoded";
+        case SHM_BOTH: return "both";
+        default: return "UNKNOWN";
+    }
+}
+
+inline std::string VideoModeToString(VideoMode mode) {
+    switch (mode) {
+        case STEREO: return "STEREO";
+        case MONO: return "MONO";
+        default: return "UNKNOWN";
+    }
+}
@@ -0,0 +1,56 @@
+//
+// Machine-readable event stream for the supervisor, one JSON object per line on stdout
+//
+// Every event has "ts" (CLOCK_REALTIME us, same clock as GetCurrentUs()), "event" and, when it concerns a single
+// camera, "camera" (its name from the camera map). The human-readable log is selected separately, see --log.
+//
+#pragma once
+
+#include <iostream>
+#include <mutex>
+#include <string>
+#include "json.hpp"
+#include "logging.h"
+
+enum LogMode {
+    LOG_HUMAN, // free-form text on stdout, no events (the default)
+    LOG_EVENTS, // events on stdout, free-form text dropped
+    LOG_BOTH // events on stdout, free-form text moved to stderr
+};
+
+inline std::mutex eventsMutex;
+inline std::ostream eventsOut(nullptr); // no-op until SetLogMode() enables the events
+
+// Called once at startup, before any thread logs
+inline void SetLogMode(LogMode mode) {
+    if (mode == LOG_HUMAN) { return; }
+
+    eventsOut.rdbuf(std::cout.rdbuf());
+    eventsOut.setf(std::ios::unitbuf);
+    // A stream without a buffer discards everything written to it
+    std::cout.rdbuf(mode == LOG_BOTH ? std::cerr.rdbuf() : nullptr);
+}
+
+inline bool EventsEnabled() {
+    return eventsOut.rdbuf() != nullptr;
+}
+
+// Streaming pipelines are named "pipeline_<camera>"
+inline std::string GetCameraFromPipelineName(const std::string &pipelineName) {
+    const std::string prefix = "pipeline_";
+    return pipelineName.compare(0, prefix.size(), prefix) == 0 ? pipelineName.substr(prefix.size()) : pipelineName;
+}
+
+inline void EmitEvent(const std::string &event, const std::string &camera, nlohmann::json fields = nlohmann::json::object()) {
+    if (!EventsEnabled()) { return; }
+
+    fields["ts"] = GetCurrentUs();
+    fields["event"] = event;
+    if (!camera.empty()) {
+        fields["camera"] = camera;
+    }
+
+    const std::string line = fields.dump() + "\n";
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    eventsOut << line;
+}
@@ -0,0 +1,201 @@
+//
+// Which config changes a running camera pipeline can take on the fly, and how
+//
+// Every StreamingConfig field has a row saying, per codec, whether a change is set live on the running elements,
+// needs a new pipeline (which reopens the camera), or does not affect the pipeline at all. A config update applies
+// only the live rows that actually changed, a single rebuild row makes it a rebuild.
+//
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <gst/gst.h>
+#include "jpeg_restart.h"
+#include "pacing.h"
+#include "pipelines.h"
+#include "stage_queues.h"
+#include "udp_batch.h"
+
+enum UpdateScope {
+    UPDATE_NONE, // not part of this codec's pipeline
+    UPDATE_LIVE, // set on the running pipeline
+    UPDATE_REBUILD // needs a new pipeline
+};
+
+constexpr int CODEC_COUNT = 5;
+
+struct HotUpdateRule {
+    const char *field;
+    bool (*changed)(const StreamingConfig &oldCfg, const StreamingConfig &newCfg);
+    UpdateScope scope[CODEC_COUNT]; // indexed by Codec
+    bool (*apply)(GstElement *pipeline, const StreamingConfig &cfg, int port); // for UPDATE_LIVE rows
+    void (*take)(StreamingConfig &to, const StreamingConfig &from); // copies the row's fields
+};
+
+// Adding a StreamingConfig field without a row would let its changes pass silently, so count them. TieConfig
+// binds every field of the struct, a new field breaks it first.
+static_assert(std::tuple_size_v<decltype(TieConfig(std::declval<const StreamingConfig &>()))> == 19,
+              "new StreamingConfig fields need a row in GetHotUpdateRules()");
+
+// Sets a property on a named element, failing when the element or a writable property of that name is missing
+template<typename T>
+inline bool SetElementProperty(GstElement *pipeline, const char *elementName, const char *property, T value) {
+    GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), elementName);
+    if (element == nullptr) {
+        std::cerr << "Failed to find " << elementName << " element\n";
+        return false;
+    }
+
+    const GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(element), property);
+    const bool writable = spec != nullptr && (spec->flags & G_PARAM_WRITABLE);
+    if (writable) {
+        g_object_set(element, property, value, nullptr);
+    } else {
+        std::cerr << elementName << " has no writable " << property << " property\n";
+    }
+    gst_object_unref(element);
+    return writable;
+}
+
+inline bool ApplyDestination(GstElement *pipeline, const StreamingConfig &cfg, int port) {
+    if (cfg.batchSend) {
+        return UpdateUdpBatchSender(pipeline, cfg.ip, port);
+    }
+    return SetElementProperty(pipeline, "udpsink", "host", cfg.ip.c_str()) &&
+           SetElementProperty(pipeline, "udpsink", "port", port);
+}
+
+inline bool ApplyQuality(GstElement *pipeline, const StreamingConfig &cfg, int) {
+    return SetElementProperty(pipeline, "encoder", "quality", cfg.encodingQuality);
+}
+
+inline bool ApplyBitrate(GstElement *pipeline, const StreamingConfig &cfg, int) {
+    return SetElementProperty(pipeline, "encoder", "bitrate", GetEncoderBitrate(cfg));
+}
+
+// The payloader picks up the new MTU with the next frame
+inline bool ApplyMtu(GstElement *pipeline, const StreamingConfig &cfg, int) {
+    return SetElementProperty(pipeline, "payloader", "mtu", static_cast<guint>(cfg.mtu));
+}
+
+inline bool ApplyPacing(GstElement *pipeline, const StreamingConfig &cfg, int) {
+    return UpdatePacketPacer(pipeline, cfg.pacing, cfg.fps);
+}
+
+inline bool ApplyRestartInterval(GstElement *pipeline, const StreamingConfig &cfg, int) {
+    UpdateJpegRestartInserter(pipeline, cfg.restartInterval);
+    return true;
+}
+
+inline bool ApplyStageQueueMs(GstElement *pipeline, const StreamingConfig &cfg, int) {
+    for (const char *name: STAGE_QUEUE_NAMES) {
+        GstElement *queue = gst_bin_get_by_name(GST_BIN(pipeline), name);
+        if (queue == nullptr) { continue; }
+        g_object_set(queue, "max-size-time", static_cast<guint64>(cfg.stageQueueMs) * GST_MSECOND, nullptr);
+        gst_object_unref(queue);
+    }
+    return true;
+}
+
+inline const std::vector<HotUpdateRule> &GetHotUpdateRules() {
+    constexpr UpdateScope N = UPDATE_NONE, L = UPDATE_LIVE, R = UPDATE_REBUILD;
+    using C = const StreamingConfig &;
+    using T = StreamingConfig &;
+
+    static const std::vector<HotUpdateRule> rules = {
+        //                                                               JPEG VP8 VP9 H264 H265
+        {"codec", [](C a, C b) { return a.codec != b.codec; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.codec = from.codec; }},
+        {"resolution", [](C a, C b) { return a.horizontalResolution != b.horizontalResolution ||
+                                             a.verticalResolution != b.verticalResolution; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.horizontalResolution = from.horizontalResolution; to.verticalResolution = from.verticalResolution; }},
+        {"fps", [](C a, C b) { return a.fps != b.fps; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.fps = from.fps; }},
+        // A single camera pipeline is the same in both modes, MONO only decides whether the camera runs
+        {"videoMode", [](C a, C b) { return a.videoMode != b.videoMode; }, {N, N, N, N, N}, nullptr,
+         [](T to, C from) { to.videoMode = from.videoMode; }},
+        {"destination", [](C a, C b) { return a.ip != b.ip || a.portLeft != b.portLeft || a.portRight != b.portRight; },
+         {L, R, R, L, L}, ApplyDestination,
+         [](T to, C from) { to.ip = from.ip; to.portLeft = from.portLeft; to.portRight = from.portRight; }},
+        {"encodingQuality", [](C a, C b) { return a.encodingQuality != b.encodingQuality; }, {L, R, R, N, N}, ApplyQuality,
+         [](T to, C from) { to.encodingQuality = from.encodingQuality; }},
+        {"bitrate", [](C a, C b) { return a.bitrate != b.bitrate; }, {N, R, R, L, L}, ApplyBitrate,
+         [](T to, C from) { to.bitrate = from.bitrate; }},
+        {"mtu", [](C a, C b) { return a.mtu != b.mtu; }, {L, R, R, L, L}, ApplyMtu,
+         [](T to, C from) { to.mtu = from.mtu; }},
+        // The pacing stage is only present in the pipeline when enabled, its fraction is read per frame
+        {"pacing", [](C a, C b) { return (a.pacing > 0) != (b.pacing > 0); }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.pacing = from.pacing; }},
+        {"pacingFraction", [](C a, C b) { return a.pacing != b.pacing && a.pacing > 0 && b.pacing > 0; },
+         {L, R, R, L, L}, ApplyPacing,
+         [](T to, C from) { to.pacing = from.pacing; }},
+        {"batchSend", [](C a, C b) { return a.batchSend != b.batchSend; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.batchSend = from.batchSend; }},
+        {"slices", [](C a, C b) { return a.slices != b.slices; }, {N, R, R, R, R}, nullptr,
+         [](T to, C from) { to.slices = from.slices; }},
+        {"restartInterval", [](C a, C b) { return a.restartInterval != b.restartInterval; }, {L, R, R, N, N}, ApplyRestartInterval,
+         [](T to, C from) { to.restartInterval = from.restartInterval; }},
+        {"shmOutput", [](C a, C b) { return a.shmOutput != b.shmOutput; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.shmOutput = from.shmOutput; }},
+        {"shmSlots", [](C a, C b) { return a.shmSlots != b.shmSlots && b.shmOutput != SHM_NONE; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.shmSlots = from.shmSlots; }},
+        {"stageQueues", [](C a, C b) { return a.stageQueues != b.stageQueues; }, {R, R, R, R, R}, nullptr,
+         [](T to, C from) { to.stageQueues = from.stageQueues; }},
+        {"stageQueueMs", [](C a, C b) { return a.stageQueueMs != b.stageQueueMs && b.stageQueues != 0; },
+         {L, R, R, L, L}, ApplyStageQueueMs,
+         [](T to, C from) { to.stageQueueMs = from.stageQueueMs; }},
+    };
+    return rules;
+}
+
+struct HotUpdatePlan {
+    bool rebuild = false;
+    std::string reason; // field forcing the rebuild
+    std::vector<const HotUpdateRule *> live;
+};
+
+inline HotUpdatePlan GetHotUpdatePlan(const StreamingConfig &oldCfg, const StreamingConfig &newCfg) {
+    HotUpdatePlan plan;
+    for (const auto &rule: GetHotUpdateRules()) {
+        if (!rule.changed(oldCfg, newCfg)) { continue; }
+
+        // The running pipeline's codec, as in GetLiveSubset. A codec change is a rebuild by the first row anyway.
+        const UpdateScope scope = rule.scope[oldCfg.codec];
+        if (scope == UPDATE_REBUILD || (scope == UPDATE_LIVE && rule.apply == nullptr)) {
+            plan.rebuild = true;
+            plan.reason = rule.field;
+            return plan;
+        }
+        if (scope == UPDATE_LIVE) {
+            plan.live.push_back(&rule);
+        }
+    }
+    return plan;
+}
+
+// The live-settable changes of newCfg on top of oldCfg, applied right away while a rebuild for the rest waits
+inline StreamingConfig GetLiveSubset(const StreamingConfig &oldCfg, const StreamingConfig &newCfg) {
+    StreamingConfig out = oldCfg;
+    for (const auto &rule: GetHotUpdateRules()) {
+        if (rule.changed(oldCfg, newCfg) && rule.scope[oldCfg.codec] == UPDATE_LIVE) {
+            rule.take(out, newCfg);
+        }
+    }
+    return out;
+}
+
+// Returns false when a live update could not be applied, the pipeline then has to be rebuilt
+inline bool ApplyHotUpdate(GstElement *pipeline, const HotUpdatePlan &plan, const StreamingConfig &newCfg, int port) {
+    bool success = true;
+    for (const auto *rule: plan.live) {
+        std::cout << "Updating " << rule->field << "\n";
+        if (!rule->apply(pipeline, newCfg, port)) {
+            std::cerr << "Failed to update " << rule->field << "\n";
+            success = false;
+        }
+    }
+    return success;
+}
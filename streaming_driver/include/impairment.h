@@ -0,0 +1,306 @@
+//
+// Network impairment emulation for local testing: a UDP proxy between sender and receiver applying loss (random
+// and bursty), delay, jitter, reordering and a bandwidth cap, driven by a scenario file
+//
+// Scenario file:
+// {"seed": 42, "loop": false, "phases": [
+//     {"duration_s": 10, "loss": 0.01, "burst_enter": 0.005, "burst_exit": 0.3, "burst_loss": 0.8,
+//      "delay_ms": 20, "jitter_ms": 5, "reorder": 0.01, "reorder_ms": 10, "bandwidth_kbps": 8000, "queue_ms": 100}]}
+// Every field of a phase is optional. Phases follow each other from the first packet on, the last one holds unless
+// the scenario loops.
+//
+// All random decisions come from one generator seeded by the scenario and drawn the same number of times per
+// packet, the same packet sequence gets the same fate on every run. Only drops at the bandwidth cap depend on the
+// packet timing.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "json.hpp"
+
+constexpr size_t IMPAIRMENT_MAX_PACKET = 65536;
+constexpr int IMPAIRMENT_POLL_MS = 10;
+
+struct ImpairmentPhase {
+    double durationS = 0; // 0: until the end of the scenario
+    double loss = 0; // random loss probability
+    // Gilbert-Elliott bursts: probability of entering and leaving the bad state per packet, loss while in it
+    double burstEnter = 0, burstExit = 1, burstLoss = 1;
+    double delayMs = 0, jitterMs = 0; // jitter is uniform within +-jitterMs and may reorder packets, like netem
+    double reorder = 0, reorderMs = 10; // probability of holding a packet back by reorderMs
+    double bandwidthKbps = 0; // 0: unlimited
+    double queueMs = 200; // packets waiting longer than this for the capped link are dropped
+};
+
+struct ImpairmentScenario {
+    uint32_t seed = 0;
+    bool loop = false;
+    std::vector<ImpairmentPhase> phases;
+};
+
+inline void CheckProbability(double value, const char *name) {
+    if (value < 0 || value > 1) {
+        throw std::invalid_argument(std::string("Invalid ") + name + " passed!");
+    }
+}
+
+inline ImpairmentScenario ImpairmentScenarioFromJson(const nlohmann::json &j) {
+    ImpairmentScenario scenario;
+    scenario.seed = j.value("seed", 0u);
+    scenario.loop = j.value("loop", false);
+    for (const auto &p: j.at("phases")) {
+        ImpairmentPhase phase;
+        phase.durationS = p.value("duration_s", phase.durationS);
+        phase.loss = p.value("loss", phase.loss);
+        phase.burstEnter = p.value("burst_enter", phase.burstEnter);
+        phase.burstExit = p.value("burst_exit", phase.burstExit);
+        phase.burstLoss = p.value("burst_loss", phase.burstLoss);
+        phase.delayMs = p.value("delay_ms", phase.delayMs);
+        phase.jitterMs = p.value("jitter_ms", phase.jitterMs);
+        phase.reorder = p.value("reorder", phase.reorder);
+        phase.reorderMs = p.value("reorder_ms", phase.reorderMs);
+        phase.bandwidthKbps = p.value("bandwidth_kbps", phase.bandwidthKbps);
+        phase.queueMs = p.value("queue_ms", phase.queueMs);
+
+        CheckProbability(phase.loss, "loss");
+        CheckProbability(phase.burstEnter, "burst_enter");
+        CheckProbability(phase.burstExit, "burst_exit");
+        CheckProbability(phase.burstLoss, "burst_loss");
+        CheckProbability(phase.reorder, "reorder");
+        if (phase.durationS < 0) throw std::invalid_argument("Invalid duration_s passed!");
+        if (phase.delayMs < 0 || phase.jitterMs < 0 || phase.reorderMs < 0) throw std::invalid_argument("Invalid delay passed!");
+        if (phase.bandwidthKbps < 0) throw std::invalid_argument("Invalid bandwidth_kbps passed!");
+        if (phase.queueMs < 0) throw std::invalid_argument("Invalid queue_ms passed!");
+        scenario.phases.push_back(phase);
+    }
+    if (scenario.phases.empty()) throw std::invalid_argument("Invalid scenario passed, no phases!");
+    return scenario;
+}
+
+inline ImpairmentScenario LoadImpairmentScenario(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Cannot open the scenario " + path);
+    }
+    return ImpairmentScenarioFromJson(nlohmann::json::parse(file));
+}
+
+struct ImpairmentStats {
+    uint64_t packets = 0, passed = 0, droppedRandom = 0, droppedBurst = 0, droppedQueue = 0, reordered = 0;
+};
+
+// Decides the fate of every packet, no I/O
+struct NetworkImpairment {
+    ImpairmentScenario scenario;
+    std::mt19937 rng;
+    bool burst = false;
+    uint64_t startUs = 0, linkFreeUs = 0;
+    ImpairmentStats stats;
+};
+
+inline void InitNetworkImpairment(NetworkImpairment &impairment, const ImpairmentScenario &scenario) {
+    impairment.scenario = scenario;
+    impairment.rng.seed(scenario.seed);
+    impairment.burst = false;
+    impairment.startUs = impairment.linkFreeUs = 0;
+    impairment.stats = {};
+}
+
+inline const ImpairmentPhase &GetImpairmentPhase(const ImpairmentScenario &scenario, double elapsedS) {
+    double total = 0;
+    for (const auto &phase: scenario.phases) {
+        if (phase.durationS == 0) { break; }
+        total += phase.durationS;
+    }
+    if (scenario.loop && total > 0) {
+        elapsedS -= total * static_cast<uint64_t>(elapsedS / total);
+    }
+    for (const auto &phase: scenario.phases) {
+        if (phase.durationS == 0 || elapsedS < phase.durationS) { return phase; }
+        elapsedS -= phase.durationS;
+    }
+    return scenario.phases.back();
+}
+
+// Uniform in [0, 1), computed by hand, the std distributions differ between standard libraries
+inline double DrawUniform(std::mt19937 &rng) {
+    return rng() / 4294967296.0;
+}
+
+// Departure time in us of a packet of `size` bytes arriving at nowUs, -1 when it is dropped
+inline int64_t ScheduleImpairedPacket(NetworkImpairment &impairment, uint64_t nowUs, size_t size) {
+    auto &stats = impairment.stats;
+    if (stats.packets++ == 0) { impairment.startUs = nowUs; }
+    const ImpairmentPhase &phase = GetImpairmentPhase(impairment.scenario, (nowUs - impairment.startUs) / 1e6);
+
+    // Always the same draws, whatever happens to the packet
+    const double lossDraw = DrawUniform(impairment.rng);
+    const double burstDraw = DrawUniform(impairment.rng);
+    const double burstLossDraw = DrawUniform(impairment.rng);
+    const double jitterDraw = DrawUniform(impairment.rng);
+    const double reorderDraw = DrawUniform(impairment.rng);
+
+    impairment.burst = impairment.burst ? burstDraw >= phase.burstExit : burstDraw < phase.burstEnter;
+    if (impairment.burst && burstLossDraw < phase.burstLoss) {
+        stats.droppedBurst++;
+        return -1;
+    }
+    if (lossDraw < phase.loss) {
+        stats.droppedRandom++;
+        return -1;
+    }
+
+    // The capped link serializes the packets, a backlog beyond queueMs is tail dropped
+    uint64_t sentUs = nowUs;
+    if (phase.bandwidthKbps > 0) {
+        const uint64_t startSendUs = std::max(impairment.linkFreeUs, nowUs);
+        if (startSendUs - nowUs > phase.queueMs * 1000) {
+            stats.droppedQueue++;
+            return -1;
+        }
+        impairment.linkFreeUs = startSendUs + static_cast<uint64_t>(size * 8 * 1000 / phase.bandwidthKbps);
+        sentUs = impairment.linkFreeUs;
+    }
+
+    double delayMs = phase.delayMs + (2 * jitterDraw - 1) * phase.jitterMs;
+    if (reorderDraw < phase.reorder) {
+        delayMs += phase.reorderMs;
+        stats.reordered++;
+    }
+    stats.passed++;
+    return static_cast<int64_t>(sentUs + std::max(0.0, delayMs) * 1000);
+}
+
+inline uint64_t GetImpairmentClockUs() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct DelayedPacket {
+    int64_t departureUs;
+    uint64_t sequence; // keeps the arrival order among equal departure times
+    std::vector<uint8_t> data;
+
+    bool operator>(const DelayedPacket &other) const {
+        return departureUs != other.departureUs ? departureUs > other.departureUs : sequence > other.sequence;
+    }
+};
+
+// Receives on a local port and forwards to the destination through a NetworkImpairment, on its own thread
+struct ImpairmentProxy {
+    std::string name;
+    NetworkImpairment impairment; // owned by the worker while running
+    int inFd = -1, outFd = -1;
+    std::atomic<bool> running{false};
+    std::thread worker;
+    std::priority_queue<DelayedPacket, std::vector<DelayedPacket>, std::greater<> > delayed;
+};
+
+inline void RunImpairmentProxy(ImpairmentProxy &proxy) {
+    std::vector<uint8_t> buffer(IMPAIRMENT_MAX_PACKET);
+    uint64_t sequence = 0;
+
+    while (proxy.running.load()) {
+        int timeoutMs = IMPAIRMENT_POLL_MS;
+        if (!proxy.delayed.empty()) {
+            const int64_t untilUs = proxy.delayed.top().departureUs - static_cast<int64_t>(GetImpairmentClockUs());
+            timeoutMs = static_cast<int>(std::clamp<int64_t>(untilUs / 1000, 0, IMPAIRMENT_POLL_MS));
+        }
+
+        pollfd pfd{proxy.inFd, POLLIN, 0};
+        if (poll(&pfd, 1, timeoutMs) > 0) {
+            ssize_t size;
+            while ((size = recv(proxy.inFd, buffer.data(), buffer.size(), MSG_DONTWAIT)) >= 0) {
+                const int64_t departureUs = ScheduleImpairedPacket(proxy.impairment, GetImpairmentClockUs(), size);
+                if (departureUs >= 0) {
+                    proxy.delayed.push({departureUs, sequence++, {buffer.begin(), buffer.begin() + size}});
+                }
+            }
+        }
+
+        const auto now = static_cast<int64_t>(GetImpairmentClockUs());
+        while (!proxy.delayed.empty() && proxy.delayed.top().departureUs <= now) {
+            // Nobody listening is not an error, the packet is simply lost like on a real link
+            send(proxy.outFd, proxy.delayed.top().data.data(), proxy.delayed.top().data.size(), 0);
+            proxy.delayed.pop();
+        }
+    }
+}
+
+inline void CloseImpairmentProxySockets(ImpairmentProxy &proxy) {
+    if (proxy.inFd >= 0) { close(proxy.inFd); }
+    if (proxy.outFd >= 0) { close(proxy.outFd); }
+    proxy.inFd = proxy.outFd = -1;
+}
+
+inline bool StartImpairmentProxy(ImpairmentProxy &proxy, const ImpairmentScenario &scenario, int listenPort,
+                                 const std::string &host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *result = nullptr;
+    const int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+    if (rc != 0) {
+        std::cerr << proxy.name << ": cannot resolve " << host << ": " << gai_strerror(rc) << "\n";
+        return false;
+    }
+    for (addrinfo *ai = result; ai != nullptr && proxy.outFd < 0; ai = ai->ai_next) {
+        proxy.outFd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (proxy.outFd >= 0 && connect(proxy.outFd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(proxy.outFd);
+            proxy.outFd = -1;
+        }
+    }
+    freeaddrinfo(result);
+
+    proxy.inFd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(listenPort);
+    if (proxy.outFd < 0 || proxy.inFd < 0 || bind(proxy.inFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        std::cerr << proxy.name << ": cannot proxy " << listenPort << " to " << host << ":" << port << ": " <<
+                strerror(errno) << "\n";
+        CloseImpairmentProxySockets(proxy);
+        return false;
+    }
+
+    InitNetworkImpairment(proxy.impairment, scenario);
+    proxy.running.store(true);
+    proxy.worker = std::thread(RunImpairmentProxy, std::ref(proxy));
+    std::cout << proxy.name << ": impairing " << listenPort << " -> " << host << ":" << port << "\n";
+    return true;
+}
+
+// Packets still delayed are dropped, the stats are final afterwards
+inline void StopImpairmentProxy(ImpairmentProxy &proxy) {
+    proxy.running.store(false);
+    if (proxy.worker.joinable()) { proxy.worker.join(); }
+    CloseImpairmentProxySockets(proxy);
+    proxy.delayed = {};
+}
+
+inline void PrintImpairmentStats(const std::string &name, const ImpairmentStats &stats) {
+    std::cout << name << ": " << stats.packets << " packets, " << stats.passed << " passed, " << stats.droppedRandom <<
+            " random loss, " << stats.droppedBurst << " burst loss, " << stats.droppedQueue << " queue drops, " <<
+            stats.reordered << " reordered\n";
+}
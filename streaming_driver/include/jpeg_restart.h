@@ -0,0 +1,748 @@
+//
+// JPEG restart intervals on the sender and partial-frame decoding with concealment on the receiver
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <jpeglib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+
+constexpr unsigned int JPEG_CONCEALMENT_STATS_INTERVAL = 300; // frames
+
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+inline void OnJpegError(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<JpegErrorManager *>(cinfo->err)->jump, 1);
+}
+
+// Losslessly re-encodes the entropy coded data with a restart marker every `restartRows` MCU rows. Only the
+// Huffman coding is redone, the DCT coefficients are copied. Standard Huffman tables are used, RTP/JPEG
+// doesn't carry any others.
+inline bool AddJpegRestartMarkers(const uint8_t *data, size_t size, int restartRows, std::vector<uint8_t> &out) {
+    jpeg_decompress_struct src{};
+    jpeg_compress_struct dst{};
+    JpegErrorManager err{};
+    unsigned char *outBuffer = nullptr;
+    unsigned long outSize = 0;
+
+    src.err = jpeg_std_error(&err.pub);
+    dst.err = &err.pub;
+    err.pub.error_exit = OnJpegError;
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        free(outBuffer);
+        return false;
+    }
+
+    jpeg_mem_src(&src, const_cast<unsigned char *>(data), size);
+    jpeg_read_header(&src, TRUE);
+    jvirt_barray_ptr *coefficients = jpeg_read_coefficients(&src);
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.restart_in_rows = restartRows;
+    dst.optimize_coding = FALSE;
+    dst.write_JFIF_header = FALSE;
+    jpeg_mem_dest(&dst, &outBuffer, &outSize);
+    jpeg_write_coefficients(&dst, coefficients);
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+
+    out.assign(outBuffer, outBuffer + outSize);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    free(outBuffer);
+    return true;
+}
+
+// Standard tables from ITU T.81 Annex K, as RTP/JPEG (RFC 2435) assumes them
+namespace jpeg_tables {
+    constexpr uint8_t ZIGZAG[64] = {
+        0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+    };
+
+    constexpr uint8_t LUMA_QUANTIZER[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61,
+        12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,
+        14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77,
+        24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103, 99
+    };
+
+    constexpr uint8_t CHROMA_QUANTIZER[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99
+    };
+
+    constexpr uint8_t LUMA_DC_BITS[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+    constexpr uint8_t LUMA_DC_VALUES[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+    constexpr uint8_t CHROMA_DC_BITS[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+    constexpr uint8_t CHROMA_DC_VALUES[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+    constexpr uint8_t LUMA_AC_BITS[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+    constexpr uint8_t LUMA_AC_VALUES[162] = {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa
+    };
+
+    constexpr uint8_t CHROMA_AC_BITS[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+    constexpr uint8_t CHROMA_AC_VALUES[162] = {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa
+    };
+}
+
+// Canonical Huffman code of `symbol`, as {code, length}
+inline std::pair<uint16_t, int> GetHuffmanCode(const uint8_t *bits, const uint8_t *values, uint8_t symbol) {
+    uint16_t code = 0;
+    int index = 0;
+    for (int length = 1; length <= 16; length++) {
+        for (int i = 0; i < bits[length - 1]; i++, index++, code++) {
+            if (values[index] == symbol) { return {code, length}; }
+        }
+        code <<= 1;
+    }
+    return {0, 0};
+}
+
+// Quantization tables for RTP/JPEG Q < 128 (RFC 2435 Appendix A), in zigzag order
+inline std::vector<uint8_t> MakeRtpJpegQuantTables(int q) {
+    const int factor = std::clamp(q, 1, 99);
+    const int scale = q < 50 ? 5000 / factor : 200 - factor * 2;
+
+    std::vector<uint8_t> tables(128);
+    for (int i = 0; i < 64; i++) {
+        tables[i] = std::clamp((jpeg_tables::LUMA_QUANTIZER[jpeg_tables::ZIGZAG[i]] * scale + 50) / 100, 1, 255);
+        tables[64 + i] = std::clamp((jpeg_tables::CHROMA_QUANTIZER[jpeg_tables::ZIGZAG[i]] * scale + 50) / 100, 1, 255);
+    }
+    return tables;
+}
+
+inline void AppendJpegHuffmanTable(std::vector<uint8_t> &out, uint8_t tableClassId, const uint8_t *bits, const uint8_t *values) {
+    int count = 0;
+    for (int i = 0; i < 16; i++) { count += bits[i]; }
+    const int length = 3 + 16 + count;
+    out.insert(out.end(), {0xff, 0xc4, static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length), tableClassId});
+    out.insert(out.end(), bits, bits + 16);
+    out.insert(out.end(), values, values + count);
+}
+
+// JPEG headers for an RTP/JPEG frame (RFC 2435 Appendix B), type 0 is 4:2:2 and type 1 is 4:2:0
+inline void AppendJpegHeaders(std::vector<uint8_t> &out, int type, int width, int height, const std::vector<uint8_t> &qtables,
+                              uint16_t restartInterval) {
+    using namespace jpeg_tables;
+    out.insert(out.end(), {0xff, 0xd8});
+
+    const size_t chromaOffset = qtables.size() >= 128 ? 64 : 0;
+    for (uint8_t id = 0; id < 2; id++) {
+        out.insert(out.end(), {0xff, 0xdb, 0x00, 0x43, id});
+        out.insert(out.end(), qtables.begin() + id * chromaOffset, qtables.begin() + id * chromaOffset + 64);
+    }
+
+    if (restartInterval > 0) {
+        out.insert(out.end(), {0xff, 0xdd, 0x00, 0x04, static_cast<uint8_t>(restartInterval >> 8), static_cast<uint8_t>(restartInterval)});
+    }
+
+    out.insert(out.end(), {
+                   0xff, 0xc0, 0x00, 0x11, 0x08,
+                   static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height),
+                   static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width),
+                   0x03,
+                   0x01, static_cast<uint8_t>(type == 0 ? 0x21 : 0x22), 0x00,
+                   0x02, 0x11, 0x01,
+                   0x03, 0x11, 0x01
+               });
+
+    AppendJpegHuffmanTable(out, 0x00, LUMA_DC_BITS, LUMA_DC_VALUES);
+    AppendJpegHuffmanTable(out, 0x10, LUMA_AC_BITS, LUMA_AC_VALUES);
+    AppendJpegHuffmanTable(out, 0x01, CHROMA_DC_BITS, CHROMA_DC_VALUES);
+    AppendJpegHuffmanTable(out, 0x11, CHROMA_AC_BITS, CHROMA_AC_VALUES);
+
+    out.insert(out.end(), {0xff, 0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00});
+}
+
+// Entropy coded data of `mcus` flat mid-gray MCUs (every block has zero DC difference and an immediate EOB)
+inline void AppendFlatJpegMcus(std::vector<uint8_t> &out, int type, uint32_t mcus) {
+    using namespace jpeg_tables;
+    const auto lumaDc = GetHuffmanCode(LUMA_DC_BITS, LUMA_DC_VALUES, 0x00);
+    const auto lumaEob = GetHuffmanCode(LUMA_AC_BITS, LUMA_AC_VALUES, 0x00);
+    const auto chromaDc = GetHuffmanCode(CHROMA_DC_BITS, CHROMA_DC_VALUES, 0x00);
+    const auto chromaEob = GetHuffmanCode(CHROMA_AC_BITS, CHROMA_AC_VALUES, 0x00);
+    const int lumaBlocks = type == 0 ? 2 : 4;
+
+    uint32_t accumulator = 0;
+    int bitCount = 0;
+    auto put = [&](std::pair<uint16_t, int> code) {
+        accumulator = (accumulator << code.second) | code.first;
+        bitCount += code.second;
+        while (bitCount >= 8) {
+            const auto byte = static_cast<uint8_t>(accumulator >> (bitCount - 8));
+            out.push_back(byte);
+            if (byte == 0xff) { out.push_back(0x00); }
+            bitCount -= 8;
+        }
+    };
+
+    for (uint32_t mcu = 0; mcu < mcus; mcu++) {
+        for (int i = 0; i < lumaBlocks; i++) {
+            put(lumaDc);
+            put(lumaEob);
+        }
+        for (int i = 0; i < 2; i++) {
+            put(chromaDc);
+            put(chromaEob);
+        }
+    }
+
+    // Pad the last byte with ones
+    if (bitCount > 0) {
+        put({static_cast<uint16_t>((1 << (8 - bitCount)) - 1), 8 - bitCount});
+    }
+}
+
+// Range of MCUs [first, last) that couldn't be decoded and has to be concealed
+using McuRange = std::pair<uint32_t, uint32_t>;
+
+struct AssembledJpeg {
+    std::vector<uint8_t> data;
+    std::vector<McuRange> lostMcus;
+    int width = 0, height = 0;
+    int mcuWidth = 16, mcuHeight = 16;
+};
+
+struct RtpJpegAssembler {
+    bool active = false;
+    uint32_t rtpTimestamp = 0;
+    int type = -1, q = -1, width = 0, height = 0;
+    uint16_t restartInterval = 0;
+    bool lastSeen = false;
+    std::vector<uint8_t> qtables;
+    std::map<uint32_t, std::vector<uint8_t> > fragments; // fragment offset -> data
+
+    // In-band tables of the last frame, in case the first packet of a frame is lost
+    std::vector<uint8_t> cachedQTables;
+
+    uint64_t statFrames = 0, statConcealedFrames = 0, statConcealedSegments = 0, statDroppedFrames = 0;
+};
+
+// A run of contiguous scan bytes starting at `offset`
+struct ScanRun {
+    uint32_t offset;
+    std::vector<uint8_t> data;
+};
+
+inline bool IsRestartMarker(const std::vector<uint8_t> &data, size_t i) {
+    return i + 1 < data.size() && data[i] == 0xff && data[i + 1] >= 0xd0 && data[i + 1] <= 0xd7;
+}
+
+// Splits the received scan data into complete restart segments, keyed by segment index. Segments cut by a
+// loss are left out. After a gap the index of the next segment is recovered from the restart marker number
+// (modulo 8) combined with an estimate from the average segment size.
+inline std::map<uint32_t, std::pair<const uint8_t *, size_t> > FindIntactJpegSegments(const std::vector<ScanRun> &runs, bool lastSeen,
+                                                                                       uint32_t segmentCount) {
+    std::map<uint32_t, std::pair<const uint8_t *, size_t> > segments;
+    uint64_t knownBytes = 0, knownSegments = 0;
+    uint32_t index = 0; // index of the segment the scan is currently in
+    uint32_t previousEnd = 0;
+
+    for (size_t r = 0; r < runs.size(); r++) {
+        const auto &run = runs[r];
+        const bool lastRun = r + 1 == runs.size();
+        size_t segmentStart = 0;
+        bool startKnown = run.offset == 0;
+
+        for (size_t i = 0; i < run.data.size(); i++) {
+            if (!IsRestartMarker(run.data, i)) { continue; }
+            const uint32_t number = run.data[i + 1] - 0xd0;
+
+            if (!startKnown) {
+                // First marker after a gap ends segment k with k % 8 == number
+                const uint32_t base = index + ((number + 8 - index % 8) % 8);
+                const double average = knownSegments > 0 ? static_cast<double>(knownBytes) / knownSegments : 0;
+                uint32_t k = base;
+                if (average > 0) {
+                    const double estimate = index + (run.offset + i - previousEnd) / average;
+                    while (k + 8 <= estimate + 4) { k += 8; }
+                }
+                index = k;
+                startKnown = true;
+            } else {
+                segments[index] = {run.data.data() + segmentStart, i - segmentStart};
+                knownBytes += i - segmentStart;
+                knownSegments++;
+            }
+
+            index++;
+            segmentStart = i + 2;
+            i++;
+        }
+
+        // The tail of the last run is the last segment when nothing is missing after it
+        if (startKnown && lastRun && lastSeen) {
+            size_t end = run.data.size();
+            if (end >= segmentStart + 2 && run.data[end - 2] == 0xff && run.data[end - 1] == 0xd9) { end -= 2; }
+            segments[index] = {run.data.data() + segmentStart, end - segmentStart};
+        }
+        previousEnd = run.offset + run.data.size();
+    }
+
+    // Anything past the segment count is garbage from a misdetected index
+    segments.erase(segments.lower_bound(segmentCount), segments.end());
+    return segments;
+}
+
+inline bool FinishRtpJpegFrame(RtpJpegAssembler &assembler, AssembledJpeg &out) {
+    assembler.active = false;
+    assembler.statFrames++;
+
+    const int baseType = assembler.type >= 64 ? assembler.type - 64 : assembler.type;
+    if ((baseType != 0 && baseType != 1) || assembler.fragments.empty() || assembler.width == 0 || assembler.height == 0) {
+        assembler.statDroppedFrames++;
+        return false;
+    }
+
+    std::vector<uint8_t> qtables = assembler.q >= 128 ? assembler.qtables : MakeRtpJpegQuantTables(assembler.q);
+    if (qtables.empty()) {
+        qtables = assembler.cachedQTables;
+    } else if (assembler.q >= 128) {
+        assembler.cachedQTables = qtables;
+    }
+    if (qtables.size() < 64) {
+        assembler.statDroppedFrames++;
+        return false;
+    }
+
+    // Merge the fragments into contiguous runs
+    std::vector<ScanRun> runs;
+    for (auto &fragment: assembler.fragments) {
+        if (!runs.empty() && runs.back().offset + runs.back().data.size() == fragment.first) {
+            runs.back().data.insert(runs.back().data.end(), fragment.second.begin(), fragment.second.end());
+        } else if (runs.empty() || runs.back().offset + runs.back().data.size() < fragment.first) {
+            runs.push_back({fragment.first, std::move(fragment.second)});
+        }
+    }
+    assembler.fragments.clear();
+
+    out = AssembledJpeg{};
+    out.width = assembler.width;
+    out.height = assembler.height;
+    out.mcuHeight = baseType == 0 ? 8 : 16;
+    AppendJpegHeaders(out.data, baseType, assembler.width, assembler.height, qtables, assembler.restartInterval);
+
+    const bool complete = assembler.lastSeen && runs.size() == 1 && runs[0].offset == 0;
+    if (complete) {
+        out.data.insert(out.data.end(), runs[0].data.begin(), runs[0].data.end());
+        if (runs[0].data.size() < 2 || runs[0].data[runs[0].data.size() - 2] != 0xff || runs[0].data.back() != 0xd9) {
+            out.data.insert(out.data.end(), {0xff, 0xd9});
+        }
+        return true;
+    }
+
+    // Without restart markers nothing after the first loss can be decoded
+    if (assembler.restartInterval == 0) {
+        assembler.statDroppedFrames++;
+        return false;
+    }
+
+    const uint32_t mcusPerRow = (assembler.width + out.mcuWidth - 1) / out.mcuWidth;
+    const uint32_t mcuRows = (assembler.height + out.mcuHeight - 1) / out.mcuHeight;
+    const uint32_t totalMcus = mcusPerRow * mcuRows;
+    const uint32_t segmentCount = (totalMcus + assembler.restartInterval - 1) / assembler.restartInterval;
+
+    const auto segments = FindIntactJpegSegments(runs, assembler.lastSeen, segmentCount);
+    if (segments.empty()) {
+        assembler.statDroppedFrames++;
+        return false;
+    }
+
+    for (uint32_t k = 0; k < segmentCount; k++) {
+        const auto segment = segments.find(k);
+        if (segment != segments.end()) {
+            out.data.insert(out.data.end(), segment->second.first, segment->second.first + segment->second.second);
+        } else {
+            const uint32_t first = k * assembler.restartInterval;
+            const uint32_t last = std::min(first + assembler.restartInterval, totalMcus);
+            AppendFlatJpegMcus(out.data, baseType, last - first);
+            out.lostMcus.emplace_back(first, last);
+        }
+        if (k + 1 < segmentCount) {
+            out.data.insert(out.data.end(), {0xff, static_cast<uint8_t>(0xd0 + k % 8)});
+        }
+    }
+    out.data.insert(out.data.end(), {0xff, 0xd9});
+
+    assembler.statConcealedFrames++;
+    assembler.statConcealedSegments += out.lostMcus.size();
+    return true;
+}
+
+// Feeds one RTP/JPEG payload (RFC 2435). Returns true when a frame was finished into `out`, which happens on
+// the marker packet, or when a packet of the next frame shows up and the previous marker got lost.
+inline bool PushRtpJpegPayload(RtpJpegAssembler &assembler, uint32_t rtpTimestamp, bool marker, const uint8_t *payload, size_t size,
+                               AssembledJpeg &out) {
+    if (size < 8) { return false; }
+
+    bool finished = false;
+    if (assembler.active && assembler.rtpTimestamp != rtpTimestamp) {
+        finished = FinishRtpJpegFrame(assembler, out);
+    }
+
+    if (!assembler.active) {
+        assembler.active = true;
+        assembler.rtpTimestamp = rtpTimestamp;
+        assembler.lastSeen = false;
+        assembler.restartInterval = 0;
+        assembler.qtables.clear();
+        assembler.fragments.clear();
+    }
+
+    const uint32_t offset = payload[1] << 16 | payload[2] << 8 | payload[3];
+    assembler.type = payload[4];
+    assembler.q = payload[5];
+    assembler.width = payload[6] * 8;
+    assembler.height = payload[7] * 8;
+    size_t pos = 8;
+
+    if (assembler.type >= 64 && assembler.type <= 127) {
+        if (size < pos + 4) { return finished; }
+        assembler.restartInterval = payload[pos] << 8 | payload[pos + 1];
+        pos += 4;
+    }
+
+    if (assembler.q >= 128 && offset == 0) {
+        if (size < pos + 4) { return finished; }
+        const size_t length = payload[pos + 2] << 8 | payload[pos + 3];
+        pos += 4;
+        if (size < pos + length) { return finished; }
+        assembler.qtables.assign(payload + pos, payload + pos + length);
+        pos += length;
+    }
+
+    assembler.fragments[offset].assign(payload + pos, payload + size);
+
+    if (marker) {
+        assembler.lastSeen = true;
+        // A frame finished just above would be overwritten, the current one has to wait then
+        if (!finished) {
+            finished = FinishRtpJpegFrame(assembler, out);
+        }
+    }
+    return finished;
+}
+
+// One plane of a decoded frame in GStreamer's default layout. Sizes are in samples of the plane, xSub/ySub scale
+// the frame's pixels (and so the MCUs) down to them.
+struct DecodedPlane {
+    size_t offset;
+    int stride, width, height, pixelBytes, xSub, ySub;
+};
+
+// Packed RGB or I420 as jpegdec outputs them, no planes for any other format
+inline std::vector<DecodedPlane> GetDecodedPlanes(const std::string &format, int width, int height) {
+    if (format == "RGB") {
+        return {{0, GST_ROUND_UP_4(width * 3), width, height, 3, 1, 1}};
+    }
+    if (format == "I420") {
+        const int lumaStride = GST_ROUND_UP_4(width), chromaStride = GST_ROUND_UP_4(GST_ROUND_UP_2(width) / 2);
+        const int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+        const size_t u = static_cast<size_t>(lumaStride) * GST_ROUND_UP_2(height);
+        const size_t v = u + static_cast<size_t>(chromaStride) * (GST_ROUND_UP_2(height) / 2);
+        return {{0, lumaStride, width, height, 1, 1, 1}, {u, chromaStride, chromaWidth, chromaHeight, 1, 2, 2},
+                {v, chromaStride, chromaWidth, chromaHeight, 1, 2, 2}};
+    }
+    return {};
+}
+
+inline size_t GetDecodedFrameSize(const std::vector<DecodedPlane> &planes) {
+    return planes.empty() ? 0 : planes.back().offset + static_cast<size_t>(planes.back().stride) * planes.back().height;
+}
+
+// Copies the lost MCUs from the previous frame into the current one, in every plane
+inline void ConcealJpegMcus(uint8_t *frame, const uint8_t *previous, int width, int height,
+                            const std::vector<DecodedPlane> &planes, const AssembledJpeg &info) {
+    const uint32_t mcusPerRow = (width + info.mcuWidth - 1) / info.mcuWidth;
+
+    for (const auto &range: info.lostMcus) {
+        for (uint32_t mcu = range.first; mcu < range.second;) {
+            const uint32_t row = mcu / mcusPerRow;
+            const uint32_t rowEnd = std::min(range.second, (row + 1) * mcusPerRow);
+            const int x0 = (mcu % mcusPerRow) * info.mcuWidth;
+            const int x1 = std::min<int>(((rowEnd - 1) % mcusPerRow + 1) * info.mcuWidth, width);
+            const int y0 = row * info.mcuHeight;
+            const int y1 = std::min<int>(y0 + info.mcuHeight, height);
+
+            for (const auto &plane: planes) {
+                const int px0 = x0 / plane.xSub, px1 = std::min((x1 + plane.xSub - 1) / plane.xSub, plane.width);
+                const int py1 = std::min((y1 + plane.ySub - 1) / plane.ySub, plane.height);
+                for (int y = y0 / plane.ySub; y < py1; y++) {
+                    const size_t at = plane.offset + static_cast<size_t>(y) * plane.stride + px0 * plane.pixelBytes;
+                    memcpy(frame + at, previous + at, (px1 - px0) * plane.pixelBytes);
+                }
+            }
+            mcu = rowEnd;
+        }
+    }
+}
+
+// Packed 3 bytes per pixel
+inline void ConcealJpegMcus(uint8_t *frame, const uint8_t *previous, int width, int height, int stride, const AssembledJpeg &info) {
+    ConcealJpegMcus(frame, previous, width, height, {{0, stride, width, height, 3, 1, 1}}, info);
+}
+
+// Receiver side state, the RTP packets come in through an appsink and the rebuilt JPEGs leave through an
+// appsrc in front of jpegdec
+struct JpegConcealment {
+    std::string name;
+    GstElement *jpegsrc = nullptr;
+    RtpJpegAssembler assembler; // appsink thread only
+    std::mutex mutex; // guards pending, filled on the appsink thread and taken on the decoder's
+    std::map<GstClockTime, AssembledJpeg> pending; // by PTS, waiting for the decoder
+    std::vector<uint8_t> previous; // decoder thread only
+};
+
+inline void PushAssembledJpeg(JpegConcealment &state, AssembledJpeg &assembled, GstClockTime pts) {
+    GstBuffer *buffer = gst_buffer_new_allocate(nullptr, assembled.data.size(), nullptr);
+    gst_buffer_fill(buffer, 0, assembled.data.data(), assembled.data.size());
+    GST_BUFFER_PTS(buffer) = pts;
+
+    if (!assembled.lostMcus.empty()) {
+        assembled.data.clear();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.pending[pts] = std::move(assembled);
+        // The decoder may drop a frame, don't keep its entry forever
+        while (state.pending.size() > 8) {
+            state.pending.erase(state.pending.begin());
+        }
+    }
+    gst_app_src_push_buffer(GST_APP_SRC(state.jpegsrc), buffer);
+
+    if (state.assembler.statFrames >= JPEG_CONCEALMENT_STATS_INTERVAL) {
+        std::cout << state.name << " JPEG concealment: " << state.assembler.statConcealedFrames << " frames concealed (" <<
+                state.assembler.statConcealedSegments << " restart segments), " << state.assembler.statDroppedFrames <<
+                " frames dropped of " << state.assembler.statFrames << "\n";
+        state.assembler.statFrames = state.assembler.statConcealedFrames = 0;
+        state.assembler.statConcealedSegments = state.assembler.statDroppedFrames = 0;
+    }
+}
+
+inline GstFlowReturn OnRtpJpegNewSample(GstAppSink *appsink, gpointer data) {
+    auto &state = *static_cast<JpegConcealment *>(data);
+
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (sample == nullptr) { return GST_FLOW_EOS; }
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
+    if (buffer != nullptr && gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp_buf)) {
+        AssembledJpeg assembled;
+        const auto *payload = static_cast<const uint8_t *>(gst_rtp_buffer_get_payload(&rtp_buf));
+        if (PushRtpJpegPayload(state.assembler, gst_rtp_buffer_get_timestamp(&rtp_buf), gst_rtp_buffer_get_marker(&rtp_buf),
+                               payload, gst_rtp_buffer_get_payload_len(&rtp_buf), assembled)) {
+            PushAssembledJpeg(state, assembled, GST_BUFFER_PTS(buffer));
+        }
+        gst_rtp_buffer_unmap(&rtp_buf);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+// Probe on the decoder's src pad, fills the lost stripes of the decoded RGB or I420 frame from the previous one
+inline GstPadProbeReturn OnDecoderProbeJpegConcealment(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    auto &state = *static_cast<JpegConcealment *>(data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (caps == nullptr) { return GST_PAD_PROBE_OK; }
+    int width = 0, height = 0;
+    const GstStructure *structure = gst_caps_get_structure(caps, 0);
+    gst_structure_get_int(structure, "width", &width);
+    gst_structure_get_int(structure, "height", &height);
+    const char *format = gst_structure_get_string(structure, "format");
+    const std::vector<DecodedPlane> planes = GetDecodedPlanes(format != nullptr ? format : "", width, height);
+    gst_caps_unref(caps);
+
+    const size_t frameSize = GetDecodedFrameSize(planes);
+    if (frameSize == 0) { return GST_PAD_PROBE_OK; }
+
+    // Taken out under the lock, the concealment itself runs without it
+    AssembledJpeg lostInfo;
+    bool lost = false;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        const auto entry = state.pending.find(GST_BUFFER_PTS(buffer));
+        if (entry != state.pending.end()) {
+            lostInfo = std::move(entry->second);
+            lost = true;
+            state.pending.erase(state.pending.begin(), std::next(entry));
+        }
+    }
+
+    if (lost && state.previous.size() == frameSize) {
+        buffer = gst_buffer_make_writable(buffer);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+
+        GstMapInfo map;
+        if (gst_buffer_map(buffer, &map, GST_MAP_READWRITE)) {
+            if (map.size >= frameSize) {
+                ConcealJpegMcus(map.data, state.previous.data(), width, height, planes, lostInfo);
+            }
+            gst_buffer_unmap(buffer, &map);
+        }
+    }
+
+    GstMapInfo map;
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        if (map.size >= frameSize) {
+            state.previous.assign(map.data, map.data + frameSize);
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+inline void DestroyJpegConcealment(gpointer data) {
+    auto *state = static_cast<JpegConcealment *>(data);
+    if (state->jpegsrc != nullptr) {
+        gst_object_unref(state->jpegsrc);
+    }
+    delete state;
+}
+
+// Connects the rtpjpegsink appsink, rtpjpegsrc appsrc and the decoder of a receiving pipeline built with
+// restart interval support. Pipelines without them are left alone.
+inline void AttachJpegConcealment(GstElement *pipeline) {
+    GstElement *rtpjpegsink = gst_bin_get_by_name(GST_BIN(pipeline), "rtpjpegsink");
+    GstElement *rtpjpegsrc = gst_bin_get_by_name(GST_BIN(pipeline), "rtpjpegsrc");
+    GstElement *decoder = gst_bin_get_by_name(GST_BIN(pipeline), "decoder");
+
+    if (rtpjpegsink != nullptr && rtpjpegsrc != nullptr && decoder != nullptr) {
+        auto *state = new JpegConcealment();
+        state->name = GST_OBJECT_NAME(pipeline);
+        state->jpegsrc = GST_ELEMENT(gst_object_ref(rtpjpegsrc));
+
+        GstPad *decoder_src = gst_element_get_static_pad(decoder, "src");
+        gst_pad_add_probe(decoder_src, GST_PAD_PROBE_TYPE_BUFFER, OnDecoderProbeJpegConcealment, state, nullptr);
+        gst_object_unref(decoder_src);
+
+        GstAppSinkCallbacks callbacks{};
+        callbacks.new_sample = OnRtpJpegNewSample;
+        gst_app_sink_set_callbacks(GST_APP_SINK(rtpjpegsink), &callbacks, state, DestroyJpegConcealment);
+    }
+
+    if (rtpjpegsink != nullptr) { gst_object_unref(rtpjpegsink); }
+    if (rtpjpegsrc != nullptr) { gst_object_unref(rtpjpegsrc); }
+    if (decoder != nullptr) { gst_object_unref(decoder); }
+}
+
+// Sender side: the restart interval in MCU rows can be changed while streaming, 0 passes frames untouched
+struct JpegRestartInserter {
+    std::atomic<int> restartRows{0};
+    std::vector<uint8_t> scratch;
+};
+
+// Runs on the encoder's streaming thread. The transcode costs ~10 ms per 1080p q85 frame on one x86 core
+// (micro_bench), which adds to the latency of every frame and takes ~60 % of a core at 60 fps.
+inline GstPadProbeReturn OnEncoderProbeJpegRestart(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    auto &inserter = *static_cast<JpegRestartInserter *>(data);
+    const int restartRows = inserter.restartRows.load(std::memory_order_relaxed);
+    if (restartRows <= 0) { return GST_PAD_PROBE_OK; }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) { return GST_PAD_PROBE_OK; }
+    const bool transcoded = AddJpegRestartMarkers(map.data, map.size, restartRows, inserter.scratch);
+    gst_buffer_unmap(buffer, &map);
+
+    if (!transcoded) {
+        std::cerr << "Couldn't add JPEG restart markers, sending the frame as is\n";
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *restarted = gst_buffer_new_allocate(nullptr, inserter.scratch.size(), nullptr);
+    gst_buffer_fill(restarted, 0, inserter.scratch.data(), inserter.scratch.size());
+    gst_buffer_copy_into(restarted, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+    gst_buffer_unref(buffer);
+    GST_PAD_PROBE_INFO_DATA(info) = restarted;
+    return GST_PAD_PROBE_OK;
+}
+
+inline void DestroyJpegRestartInserter(gpointer data) {
+    delete static_cast<JpegRestartInserter *>(data);
+}
+
+inline void AttachJpegRestartInserter(GstElement *pipeline, int restartRows) {
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+    if (encoder == nullptr) { return; }
+
+    auto *inserter = new JpegRestartInserter();
+    inserter->restartRows = restartRows;
+    g_object_set_data_full(G_OBJECT(encoder), "restart-inserter", inserter, DestroyJpegRestartInserter);
+
+    GstPad *encoder_src = gst_element_get_static_pad(encoder, "src");
+    gst_pad_add_probe(encoder_src, GST_PAD_PROBE_TYPE_BUFFER, OnEncoderProbeJpegRestart, inserter, nullptr);
+    gst_object_unref(encoder_src);
+    gst_object_unref(encoder);
+}
+
+inline void UpdateJpegRestartInserter(GstElement *pipeline, int restartRows) {
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+    if (encoder == nullptr) { return; }
+
+    auto *inserter = static_cast<JpegRestartInserter *>(g_object_get_data(G_OBJECT(encoder), "restart-inserter"));
+    if (inserter != nullptr) {
+        inserter->restartRows = restartRows;
+    }
+    gst_object_unref(encoder);
+}
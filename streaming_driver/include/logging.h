@@ -2,8 +2,16 @@
 // Created by standa on 24.1.24.
 //
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <exception>
 #include <gst/rtp/gstrtpbuffer.h>
@@ -17,17 +25,111 @@ constexpr bool BENCHMARK = false;
 constexpr unsigned int SAMPLES = 1000;
 
 inline std::map<std::string, std::vector<long> > timestampsCamera;
-inline std::map<std::string, std::vector<long> > timestampsStreaming;
-inline std::map<std::string, std::vector<long> > timestampsStreamingFiltered;
-static inline uint16_t cameraLeftFrameId = 0, cameraRightFrameId = 0;
-inline bool cameraLeftFrameIdIncremented = false, cameraRightFrameIdIncremented = false;
-inline std::map<std::string, std::vector<long> > timestampsReceiving;
-inline std::map<std::string, std::vector<long> > timestampsReceivingFiltered;
 
-inline uint16_t latestNvvidconv = 0, latestJpegenc = 0, latestRtpjpegpay = 0;
-inline uint64_t latestRtpJpegpayTimestamp = 0;
+// Instrumentation state is kept per pipeline. Pipelines run concurrently and, with queues between the stages,
+// one pipeline runs on several streaming threads, so nothing in here is touched without its lock or as an atomic.
+// Entries are created on first use and kept for the process lifetime, so references stay valid across rebuilds
+// under the same name.
 
-inline bool finishing = false;
+// Per-frame stats of a streaming pipeline, written on the payloader's streaming thread and read by the reports
+struct StreamingStats {
+    std::atomic<double> payloadStageUs{0}; // running average from encoder output to payloader output
+    std::atomic<double> captureToPayloadUs{0}; // running average from capture to payloader output
+    std::atomic<uint64_t> framesPayloaded{0};
+    std::atomic<int64_t> lastRtpTimestamp{-1}; // of the last frame that got the metadata
+
+    std::mutex mutex;
+    std::deque<long> timestampsFiltered; // capture, convert, encode and payload time of the last frames
+};
+
+constexpr size_t STREAMING_TIMESTAMPS_HISTORY = 4 * SAMPLES; // four timestamps per frame
+
+inline std::mutex streamingStatsMutex;
+inline std::map<std::string, std::unique_ptr<StreamingStats> > streamingStats;
+
+inline StreamingStats &GetStreamingStats(const std::string &pipelineName) {
+    std::lock_guard<std::mutex> lock(streamingStatsMutex);
+    auto &stats = streamingStats[pipelineName];
+    if (stats == nullptr) {
+        stats = std::make_unique<StreamingStats>();
+    }
+    return *stats;
+}
+
+// Sender metadata of the last frame that arrived on a receiving pipeline, from its RTP header (see AddFrameMetadata)
+struct RtpFrameMetadata {
+    uint64_t convertUs, encodeUs, payloadUs;
+    uint64_t payloadTimestampUs;
+};
+
+// A receiving pipeline's identities run on the udpsrc, decoder and sink threads, all under the mutex
+struct ReceivingStats {
+    std::atomic<uint64_t> lostPackets{0}; // read by the reports without the lock
+
+    std::mutex mutex;
+    std::vector<long> timestamps; // stages of the frame in flight
+    std::deque<long> timestampsFiltered; // six stage timestamps of each of the last frames
+    uint16_t frameId = 0;
+    RtpFrameMetadata metadata{};
+    int32_t lastSeq = -1;
+};
+
+inline std::mutex receivingStatsMutex;
+inline std::map<std::string, std::unique_ptr<ReceivingStats> > receivingStats;
+
+inline ReceivingStats &GetReceivingStats(const std::string &pipelineName) {
+    std::lock_guard<std::mutex> lock(receivingStatsMutex);
+    auto &stats = receivingStats[pipelineName];
+    if (stats == nullptr) {
+        stats = std::make_unique<ReceivingStats>();
+    }
+    return *stats;
+}
+
+constexpr size_t RECEIVING_TIMESTAMPS_HISTORY = 6 * SAMPLES;
+
+inline std::vector<long> GetReceivingTimestamps(const std::string &pipelineName) {
+    ReceivingStats &stats = GetReceivingStats(pipelineName);
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    return {stats.timestampsFiltered.begin(), stats.timestampsFiltered.end()};
+}
+
+inline std::vector<long> GetStreamingTimestamps(const std::string &pipelineName) {
+    StreamingStats &stats = GetStreamingStats(pipelineName);
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    return {stats.timestampsFiltered.begin(), stats.timestampsFiltered.end()};
+}
+
+// Frames entering the streaming pipelines, so branches after the encoder can tell which capture a buffer belongs to.
+// Receiving pipelines record the frames leaving their depayloader, for the same lookup after the decoder.
+struct CapturedFrame {
+    GstClockTime pts;
+    uint16_t frameId;
+    uint64_t captureUs;
+    uint64_t convertUs, encodeUs; // when the frame left the converter and the encoder, 0 until then
+};
+
+constexpr size_t CAPTURED_FRAMES_HISTORY = 64;
+inline std::mutex capturedFramesMutex;
+inline std::map<std::string, std::deque<CapturedFrame> > capturedFrames;
+inline std::map<std::string, uint16_t> frameIds; // next frame id of each streaming pipeline, under capturedFramesMutex
+
+// One frame at the end of a receiving pipeline, stage latencies in us. The sender's stages come from the metadata
+// in the RTP header, the network stage runs from the sender's payloader to the last packet of the frame arriving.
+struct ReceivedFrame {
+    uint16_t frameId;
+    uint64_t convertUs, encodeUs, payloadUs;
+    int64_t networkUs; // sender and receiver clocks, only meaningful when they are synchronized
+    uint64_t depayUs, decodeUs, queueUs, videoconvertUs, videoflipUs;
+    int64_t totalUs; // capture to the end of the receiving pipeline
+    uint64_t lostPackets; // on this pipeline so far
+};
+
+// Replaces the per-frame log line of the receiving pipelines when set, e.g. by the loopback benchmark
+using ReceivedFrameCallback = void (*)(const std::string &pipelineName, const ReceivedFrame &frame);
+inline ReceivedFrameCallback receivedFrameCallback = nullptr;
+
+inline std::atomic<bool> finishing{false};
 
 inline uint64_t GetCurrentUs() {
     using namespace std::chrono;
@@ -42,48 +144,89 @@ inline uint64_t GetCurrentUs() {
     return static_cast<uint64_t>(res.tv_sec) * 1'000'000 + res.tv_nsec / 1000;
 }
 
-inline uint16_t GetFrameId(const std::string &pipelineName) {
-    return pipelineName == "pipeline_left" ? cameraLeftFrameId : cameraRightFrameId;
+inline uint64_t GetThreadCpuNs() {
+    struct timespec res{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &res);
+    return static_cast<uint64_t>(res.tv_sec) * 1'000'000'000 + res.tv_nsec;
 }
 
-inline uint16_t IncrementFrameId(const std::string &pipelineName) {
-    if (pipelineName == "pipeline_left") {
-        cameraLeftFrameIdIncremented = true;
-        return cameraLeftFrameId++;
-    } else {
-        cameraRightFrameIdIncremented = true;
-        return cameraRightFrameId++;
+// Assigns the frame id at capture time, keyed by the buffer PTS which the encoders and payloaders carry over
+inline void RecordCapturedFrame(const std::string &pipelineName, GstClockTime pts, uint64_t captureUs) {
+    std::lock_guard<std::mutex> lock(capturedFramesMutex);
+    auto &frames = capturedFrames[pipelineName];
+    frames.push_back({pts, frameIds[pipelineName]++, captureUs, 0, 0});
+    if (frames.size() > CAPTURED_FRAMES_HISTORY) {
+        frames.pop_front();
+    }
+}
+
+// Receiving side: the frame id and capture time come from the sender's metadata instead
+inline void RecordReceivedFrame(const std::string &pipelineName, GstClockTime pts, uint16_t frameId, uint64_t captureUs) {
+    std::lock_guard<std::mutex> lock(capturedFramesMutex);
+    auto &frames = capturedFrames[pipelineName];
+    frames.push_back({pts, frameId, captureUs, 0, 0});
+    if (frames.size() > CAPTURED_FRAMES_HISTORY) {
+        frames.pop_front();
     }
 }
 
-inline bool IsFrameIncremented(const std::string &pipelineName) {
-    return pipelineName == "pipeline_left" ? cameraLeftFrameIdIncremented : cameraRightFrameIdIncremented;
+// With queues between the stages several frames are in flight at once, so stage timestamps go to the frame's
+// own record instead of the order they arrive in
+inline void RecordFrameStage(const std::string &pipelineName, GstClockTime pts, const std::string &stage, uint64_t timeUs) {
+    std::lock_guard<std::mutex> lock(capturedFramesMutex);
+    auto &frames = capturedFrames[pipelineName];
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        if (it->pts != pts) { continue; }
+        (stage == "vidconv_ident" ? it->convertUs : it->encodeUs) = timeUs;
+        return;
+    }
 }
 
-inline void FrameSent(const std::string &pipelineName) {
-    pipelineName == "pipeline_left" ? cameraLeftFrameIdIncremented = false : cameraRightFrameIdIncremented = false;
+// PTS of the newest frame that entered the pipeline, GST_CLOCK_TIME_NONE before the first
+inline GstClockTime GetLatestCapturedPts(const std::string &pipelineName) {
+    std::lock_guard<std::mutex> lock(capturedFramesMutex);
+    const auto &frames = capturedFrames[pipelineName];
+    return frames.empty() ? GST_CLOCK_TIME_NONE : frames.back().pts;
+}
+
+// False when the PTS is unknown, e.g. a source without timestamps or a frame older than the history. Guessing a
+// frame instead would put the wrong frame id on it.
+inline bool LookupCapturedFrame(const std::string &pipelineName, GstClockTime pts, CapturedFrame &frame) {
+    std::lock_guard<std::mutex> lock(capturedFramesMutex);
+    const auto &frames = capturedFrames[pipelineName];
+    if (frames.empty()) { return false; }
+
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        if (it->pts == pts) {
+            frame = *it;
+            return true;
+        }
+    }
+    return false;
 }
 
 inline void SaveLogFilesStreaming() {
+    const std::vector<long> timestampsLeft = GetStreamingTimestamps("pipeline_left");
+    const std::vector<long> timestampsRight = GetStreamingTimestamps("pipeline_8556");
     std::ofstream cameraPipeline0File, cameraPipeline1File, streamingPipeline0File, streamingPipeline1File;
     cameraPipeline0File.open("cameraPipeline0Log.txt", std::ios::trunc);
     cameraPipeline1File.open("cameraPipeline1Log.txt", std::ios::trunc);
     streamingPipeline0File.open("streamingPipeline0Log.txt", std::ios::trunc);
     streamingPipeline1File.open("streamingPipeline1Log.txt", std::ios::trunc);
 
-    std::cout << "Will be writing log containing " << timestampsStreaming["pipeline_left"].size() << " records\n";
-    for (int i = 0; i < timestampsStreaming["pipeline_left"].size(); i = i + 3) {
+    std::cout << "Will be writing log containing " << timestampsLeft.size() << " records\n";
+    for (size_t i = 0; i + 2 < timestampsLeft.size(); i = i + 3) {
         streamingPipeline0File <<
-                timestampsStreamingFiltered["pipeline_left"][i] << "," <<
-                timestampsStreamingFiltered["pipeline_left"][i + 1] << "," <<
-                timestampsStreamingFiltered["pipeline_left"][i + 2] << "\n";
+                timestampsLeft[i] << "," <<
+                timestampsLeft[i + 1] << "," <<
+                timestampsLeft[i + 2] << "\n";
     }
 
-    for (int i = 0; i < timestampsStreaming["pipeline_8556"].size(); i = i + 3) {
+    for (size_t i = 0; i + 2 < timestampsRight.size(); i = i + 3) {
         streamingPipeline1File <<
-                timestampsStreamingFiltered["pipeline_8556"][i] << "," <<
-                timestampsStreamingFiltered["pipeline_8556"][i + 1] << "," <<
-                timestampsStreamingFiltered["pipeline_8556"][i + 2] << "\n";
+                timestampsRight[i] << "," <<
+                timestampsRight[i + 1] << "," <<
+                timestampsRight[i + 2] << "\n";
     }
 
     for (int i = 0; i < timestampsCamera["pipeline_left"].size(); i = i + 2) {
@@ -108,31 +251,31 @@ inline void SaveLogFilesStreaming() {
 }
 
 inline void SaveLogFilesReceiving() {
+    const std::vector<long> timestampsLeft = GetReceivingTimestamps("pipeline_left");
+    const std::vector<long> timestampsRight = GetReceivingTimestamps("pipeline_right");
     std::ofstream receivingPipeline0File, receivingPipeline1File;
     receivingPipeline0File.open("receivingPipeline0Log.txt", std::ios::trunc);
-    receivingPipeline1File.open("receivingPipeline0Log.txt", std::ios::trunc);
+    receivingPipeline1File.open("receivingPipeline1Log.txt", std::ios::trunc);
 
-    std::cout << "Will be writing log containing " << timestampsStreaming["pipeline_left"].size() << " records\n";
-    for (int i = 0; i < timestampsStreaming["pipeline_left"].size(); i = i + 6) {
+    std::cout << "Will be writing log containing " << timestampsLeft.size() << " records\n";
+    for (size_t i = 0; i + 5 < timestampsLeft.size(); i = i + 6) {
         receivingPipeline0File <<
-                timestampsReceiving["pipeline_left"][i] << "," <<
-                timestampsReceiving["pipeline_left"][i + 1] << "," <<
-                timestampsReceiving["pipeline_left"][i + 2] << "," <<
-                timestampsReceiving["pipeline_left"][i + 3] << "," <<
-                timestampsReceiving["pipeline_left"][i + 5] << "," <<
-                timestampsReceiving["pipeline_left"][i + 5] << "," <<
-                timestampsReceiving["pipeline_left"][i + 6] << "\n";
+                timestampsLeft[i] << "," <<
+                timestampsLeft[i + 1] << "," <<
+                timestampsLeft[i + 2] << "," <<
+                timestampsLeft[i + 3] << "," <<
+                timestampsLeft[i + 4] << "," <<
+                timestampsLeft[i + 5] << "\n";
     }
 
-    for (int i = 0; i < timestampsStreaming["pipeline_right"].size(); i = i + 6) {
+    for (size_t i = 0; i + 5 < timestampsRight.size(); i = i + 6) {
         receivingPipeline1File <<
-                timestampsReceiving["pipeline_right"][i] << "," <<
-                timestampsReceiving["pipeline_right"][i + 1] << "," <<
-                timestampsReceiving["pipeline_right"][i + 2] << "," <<
-                timestampsReceiving["pipeline_right"][i + 3] << "," <<
-                timestampsReceiving["pipeline_right"][i + 5] << "," <<
-                timestampsReceiving["pipeline_right"][i + 5] << "," <<
-                timestampsReceiving["pipeline_right"][i + 6] << "\n";
+                timestampsRight[i] << "," <<
+                timestampsRight[i + 1] << "," <<
+                timestampsRight[i + 2] << "," <<
+                timestampsRight[i + 3] << "," <<
+                timestampsRight[i + 4] << "," <<
+                timestampsRight[i + 5] << "\n";
     }
 
     receivingPipeline0File.close();
@@ -148,136 +291,261 @@ inline void OnIdentityHandoffCameraStreaming(const GstElement *identity, GstBuff
 
     const std::string pipelineName = identity->object.parent->name;
 
-
-    if (std::string(identity->object.name) == "camsrc_ident" && !timestampsStreaming[pipelineName].empty()) {
-        // Frame successfully sent, new one just got into the pipeline
-        timestampsStreaming[pipelineName].clear();
-        FrameSent(pipelineName);
+    if (std::string(identity->object.name) == "camsrc_ident") {
+        // New frame just got into the pipeline
+        RecordCapturedFrame(pipelineName, GST_BUFFER_PTS(buffer), timeMicro);
+    } else {
+        RecordFrameStage(pipelineName, GST_BUFFER_PTS(buffer), identity->object.name, timeMicro);
     }
+}
 
-    timestampsStreaming[pipelineName].emplace_back(timeMicro);
-
-    // Add metadata to the RTP header on the first call of rtpjpegpay
-    if (std::string(identity->object.name) == "rtppay_ident" && !IsFrameIncremented(pipelineName)) {
-        timestampsStreamingFiltered[pipelineName].emplace_back(timestampsStreaming[pipelineName][0]);
-        timestampsStreamingFiltered[pipelineName].emplace_back(timestampsStreaming[pipelineName][1]);
-        timestampsStreamingFiltered[pipelineName].emplace_back(timestampsStreaming[pipelineName][2]);
-        timestampsStreamingFiltered[pipelineName].emplace_back(timestampsStreaming[pipelineName][3]);
-
-        const unsigned long d = timestampsStreamingFiltered[pipelineName].size();
+// All packets of one frame share the RTP timestamp, the first packet carrying a new one starts the frame
+inline bool IsNewRtpFrame(const std::string &pipelineName, GstBuffer *buffer) {
+    GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp_buf)) { return false; }
+    const uint32_t rtpTimestamp = gst_rtp_buffer_get_timestamp(&rtp_buf);
+    gst_rtp_buffer_unmap(&rtp_buf);
 
-        uint64_t nvvidconv = timestampsStreamingFiltered[pipelineName][d - 3] - timestampsStreamingFiltered[pipelineName][d - 4];
-        uint64_t jpegenc = timestampsStreamingFiltered[pipelineName][d - 2] - timestampsStreamingFiltered[pipelineName][d - 3];
-        uint64_t rtpjpegpay = timestampsStreamingFiltered[pipelineName][d - 1] - timestampsStreamingFiltered[pipelineName][d - 2];
+    return GetStreamingStats(pipelineName).lastRtpTimestamp.exchange(rtpTimestamp) != rtpTimestamp;
+}
 
-        // std::cout << pipelineName << ": frame - " << GetFrameId(pipelineName) <<
-        //         ", nvvidconv: " << nvvidconv <<
-        //         ", jpegenc: " << jpegenc <<
-        //         ", rtpjpegpay: " << rtpjpegpay <<
-        //         "\n";
+inline void AddFrameMetadata(const std::string &pipelineName, GstBuffer *buffer, uint64_t timeMicro) {
+    CapturedFrame frame{};
+    if (!LookupCapturedFrame(pipelineName, GST_BUFFER_PTS(buffer), frame) || frame.convertUs == 0 || frame.encodeUs == 0) {
+        return;
+    }
 
-        GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
-        if (gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp_buf)) {
-            // Add FrameId
-            uint64_t frameId = IncrementFrameId(pipelineName);
-            uint64_t rtpjpegpayTimestamp = timestampsStreamingFiltered[pipelineName][d - 1];
-            if (
-                !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &frameId, sizeof(frameId)) ||
-                !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &nvvidconv, sizeof(nvvidconv)) ||
-                !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &jpegenc, sizeof(jpegenc)) ||
-                !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &rtpjpegpay, sizeof(rtpjpegpay)) ||
-                !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &rtpjpegpayTimestamp, sizeof(rtpjpegpayTimestamp))
-            ) {
-                std::cerr << "Couldn't add the RTP header with metadata! \n";
-            }
+    StreamingStats &stats = GetStreamingStats(pipelineName);
+    size_t recorded;
+    {
+        // Bounded, the history only serves the BENCHMARK log files
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        auto &history = stats.timestampsFiltered;
+        history.insert(history.end(), {static_cast<long>(frame.captureUs), static_cast<long>(frame.convertUs),
+                                       static_cast<long>(frame.encodeUs), static_cast<long>(timeMicro)});
+        while (history.size() > STREAMING_TIMESTAMPS_HISTORY) {
+            history.pop_front();
+        }
+        recorded = history.size();
+    }
 
-            gst_rtp_buffer_unmap(&rtp_buf);
+    uint64_t nvvidconv = frame.convertUs - frame.captureUs;
+    uint64_t jpegenc = frame.encodeUs - frame.convertUs;
+    uint64_t rtpjpegpay = timeMicro - frame.encodeUs;
+
+    // Everything hanging off the encoder tee shows up here, e.g. the recording branch
+    // Only the payloader's thread writes, the reports just load
+    const double payloadStage = stats.payloadStageUs.load(std::memory_order_relaxed);
+    stats.payloadStageUs.store(payloadStage == 0 ? rtpjpegpay : 0.95 * payloadStage + 0.05 * rtpjpegpay,
+                               std::memory_order_relaxed);
+    const double captureToPayload = stats.captureToPayloadUs.load(std::memory_order_relaxed);
+    const uint64_t total = timeMicro - frame.captureUs;
+    stats.captureToPayloadUs.store(captureToPayload == 0 ? total : 0.95 * captureToPayload + 0.05 * total,
+                                   std::memory_order_relaxed);
+    stats.framesPayloaded.fetch_add(1, std::memory_order_relaxed);
+
+    GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
+    if (gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp_buf)) {
+        // Add FrameId, the same one the shared-memory output publishes for this capture
+        uint64_t frameId = frame.frameId;
+        uint64_t rtpjpegpayTimestamp = timeMicro;
+        if (
+            !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &frameId, sizeof(frameId)) ||
+            !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &nvvidconv, sizeof(nvvidconv)) ||
+            !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &jpegenc, sizeof(jpegenc)) ||
+            !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &rtpjpegpay, sizeof(rtpjpegpay)) ||
+            !gst_rtp_buffer_add_extension_twobytes_header(&rtp_buf, 1, 1, &rtpjpegpayTimestamp, sizeof(rtpjpegpayTimestamp))
+        ) {
+            std::cerr << "Couldn't add the RTP header with metadata! \n";
         }
+
+        gst_rtp_buffer_unmap(&rtp_buf);
     }
 
-    if (timestampsStreamingFiltered[pipelineName].size() > SAMPLES && BENCHMARK) {
+    if (recorded > SAMPLES && BENCHMARK) {
         finishing = true;
         SaveLogFilesStreaming();
     }
 }
 
+// Probe on the payloader's src pad. Payloaders push the packets of a frame (or of a fragmented NAL unit) as
+// one buffer list, which then goes to the sink untouched. Only the first packet of a frame is made writable
+// and gets the metadata.
+inline GstPadProbeReturn OnPayloaderProbeCameraStreaming(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    if (finishing) { return GST_PAD_PROBE_OK; }
+    const auto timeMicro = GetCurrentUs();
+
+    const std::string pipelineName = GST_OBJECT_NAME(GST_OBJECT_PARENT(GST_OBJECT_PARENT(pad)));
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        if (gst_buffer_list_length(list) == 0 || !IsNewRtpFrame(pipelineName, gst_buffer_list_get(list, 0))) {
+            return GST_PAD_PROBE_OK;
+        }
+
+        list = gst_buffer_list_make_writable(list);
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+        AddFrameMetadata(pipelineName, gst_buffer_list_get_writable(list, 0), timeMicro);
+    } else {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        if (!IsNewRtpFrame(pipelineName, buffer)) { return GST_PAD_PROBE_OK; }
+
+        buffer = gst_buffer_make_writable(buffer);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+        AddFrameMetadata(pipelineName, buffer, timeMicro);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+// Metadata values are written as 8 bytes and may sit unaligned in the header
+inline uint64_t ReadRtpMetadata(gpointer data, guint size) {
+    uint64_t value = 0;
+    memcpy(&value, data, std::min<size_t>(size, sizeof(value)));
+    return value;
+}
+
 inline void OnIdentityHandoffReceiving(const GstElement *identity, GstBuffer *buffer, gpointer data) {
     if (finishing) { return; }
-    using namespace std::chrono;
-
-    const auto tp = std::chrono::time_point_cast<microseconds>(steady_clock::now());
-    const auto tmp = std::chrono::duration_cast<microseconds>(tp.time_since_epoch());
-    const auto timeMicro = tmp.count();
+    // Same clock as the sender's payload timestamp, so the network stage can be measured
+    const auto timeMicro = static_cast<long>(GetCurrentUs());
 
     const std::string pipelineName = identity->object.parent->name;
-    timestampsReceiving[pipelineName].emplace_back(timeMicro);
+    const std::string identityName = identity->object.name;
+    ReceivingStats &stats = GetReceivingStats(pipelineName);
+    std::unique_lock<std::mutex> lock(stats.mutex);
+    stats.timestamps.emplace_back(timeMicro);
+    RtpFrameMetadata &metadata = stats.metadata;
 
-    if (std::string(identity->object.name) == "udpsrc_ident") {
+    if (identityName == "udpsrc_ident") {
         GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
         gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp_buf);
+
+        // Count the packets lost on the way, so pacing and MTU choices can be compared
+        const uint16_t seq = gst_rtp_buffer_get_seq(&rtp_buf);
+        if (stats.lastSeq >= 0) {
+            const auto gap = static_cast<uint16_t>(seq - static_cast<uint16_t>(stats.lastSeq));
+            if (gap > 1 && gap < 0x8000) {
+                stats.lostPackets.fetch_add(gap - 1, std::memory_order_relaxed);
+            }
+        }
+        stats.lastSeq = seq;
+
         gpointer myInfoBuf = nullptr;
         guint size_64 = 8;
         guint8 appbits = 1;
         if (gst_rtp_buffer_get_extension_twobytes_header(&rtp_buf, &appbits, 1, 0, &myInfoBuf, &size_64)) {
-            if (pipelineName == "pipeline_left") {
-                cameraLeftFrameId = *(static_cast<uint16_t *>(myInfoBuf));
-            } else if (pipelineName == "pipeline_right") {
-                cameraRightFrameId = *(static_cast<uint16_t *>(myInfoBuf));
-            }
+            stats.frameId = static_cast<uint16_t>(ReadRtpMetadata(myInfoBuf, size_64));
         }
         if (gst_rtp_buffer_get_extension_twobytes_header(&rtp_buf, &appbits, 1, 1, &myInfoBuf, &size_64)) {
-            latestNvvidconv = *(static_cast<uint16_t *>(myInfoBuf));
+            metadata.convertUs = ReadRtpMetadata(myInfoBuf, size_64);
         }
         if (gst_rtp_buffer_get_extension_twobytes_header(&rtp_buf, &appbits, 1, 2, &myInfoBuf, &size_64)) {
-            latestJpegenc = *(static_cast<uint16_t *>(myInfoBuf));
+            metadata.encodeUs = ReadRtpMetadata(myInfoBuf, size_64);
         }
         if (gst_rtp_buffer_get_extension_twobytes_header(&rtp_buf, &appbits, 1, 3, &myInfoBuf, &size_64)) {
-            latestRtpjpegpay = *(static_cast<uint16_t *>(myInfoBuf));
+            metadata.payloadUs = ReadRtpMetadata(myInfoBuf, size_64);
         }
         if (gst_rtp_buffer_get_extension_twobytes_header(&rtp_buf, &appbits, 1, 4, &myInfoBuf, &size_64)) {
-            latestRtpJpegpayTimestamp = *(static_cast<uint64_t *>(myInfoBuf));
+            metadata.payloadTimestampUs = ReadRtpMetadata(myInfoBuf, size_64);
         }
         gst_rtp_buffer_unmap(&rtp_buf);
     }
 
-    if (std::string(identity->object.name) == "vidflip_ident") {
-        if (!timestampsReceiving[pipelineName].empty()) {
-            const unsigned long s = timestampsReceiving[pipelineName].size();
-
-            timestampsReceivingFiltered[pipelineName].emplace_back(timestampsReceiving[pipelineName][s - 6]);
-            timestampsReceivingFiltered[pipelineName].emplace_back(timestampsReceiving[pipelineName][s - 5]);
-            timestampsReceivingFiltered[pipelineName].emplace_back(timestampsReceiving[pipelineName][s - 4]);
-            timestampsReceivingFiltered[pipelineName].emplace_back(timestampsReceiving[pipelineName][s - 3]);
-            timestampsReceivingFiltered[pipelineName].emplace_back(timestampsReceiving[pipelineName][s - 2]);
-            timestampsReceivingFiltered[pipelineName].emplace_back(timestampsReceiving[pipelineName][s - 1]);
-
-            const unsigned long d = timestampsReceivingFiltered[pipelineName].size();
-
-            uint16_t udpstream = timestampsReceivingFiltered[pipelineName][d - 6] - latestRtpJpegpayTimestamp;
-            uint16_t rtpjpegdepay = timestampsReceivingFiltered[pipelineName][d - 5] - timestampsReceivingFiltered[pipelineName][d - 6];
-            uint16_t jpegdec = timestampsReceivingFiltered[pipelineName][d - 4] - timestampsReceivingFiltered[pipelineName][d - 5];
-            uint16_t queue = timestampsReceivingFiltered[pipelineName][d - 3] - timestampsReceivingFiltered[pipelineName][d - 4];
-            uint16_t videoconvert = timestampsReceivingFiltered[pipelineName][d - 2] - timestampsReceivingFiltered[pipelineName][d - 3];
-            uint16_t videoflip = timestampsReceivingFiltered[pipelineName][d - 1] - timestampsReceivingFiltered[pipelineName][d - 2];
-
-            std::cout << pipelineName <<
-                    ": frame - " << GetFrameId(pipelineName) <<
-                    ", nvvidconv: " << latestNvvidconv <<
-                    ", jpegenc: " << latestJpegenc <<
-                    ", rtpjpegpay: " << latestRtpjpegpay <<
-                    ", udpstream: " << udpstream <<
-                    ": rtpjpegdepay: " << rtpjpegdepay <<
-                    ", jpegdec: " << jpegdec <<
-                    ", queue: " << queue <<
-                    ", videoconvert: " << videoconvert <<
-                    ", videoflip: " << videoflip <<
-                        ", TOTAL: " << (latestNvvidconv + latestJpegenc + latestRtpjpegpay + udpstream + rtpjpegdepay + jpegdec + queue + videoconvert + videoflip) / 1000.0 << "ms \n";
-        }
-        timestampsReceiving[pipelineName].clear();
+    // The depayloader completes a frame with its last packet, the decoders carry its PTS over to the decoded frame
+    if (identityName == "rtpdepay_ident") {
+        RecordReceivedFrame(pipelineName, GST_BUFFER_PTS(buffer), stats.frameId,
+                            metadata.payloadTimestampUs - metadata.payloadUs - metadata.encodeUs - metadata.convertUs);
     }
 
-    if (timestampsReceivingFiltered[pipelineName].size() > SAMPLES && BENCHMARK) {
+    if (identityName != "vidflip_ident") { return; }
+
+    const std::vector<long> timestamps = std::move(stats.timestamps);
+    stats.timestamps.clear();
+    if (timestamps.size() < 6) { return; }
+
+    const size_t s = timestamps.size();
+    auto &history = stats.timestampsFiltered;
+    history.insert(history.end(), timestamps.end() - 6, timestamps.end());
+    while (history.size() > RECEIVING_TIMESTAMPS_HISTORY) {
+        history.pop_front();
+    }
+    const bool saveLogs = history.size() > SAMPLES && BENCHMARK;
+
+    const int64_t udpstream = timestamps[s - 6] - static_cast<int64_t>(metadata.payloadTimestampUs);
+    const uint64_t rtpjpegdepay = timestamps[s - 5] - timestamps[s - 6];
+    const uint64_t jpegdec = timestamps[s - 4] - timestamps[s - 5];
+    const uint64_t queue = timestamps[s - 3] - timestamps[s - 4];
+    const uint64_t videoconvert = timestamps[s - 2] - timestamps[s - 3];
+    const uint64_t videoflip = timestamps[s - 1] - timestamps[s - 2];
+    const int64_t total = static_cast<int64_t>(metadata.convertUs + metadata.encodeUs + metadata.payloadUs) + udpstream +
+                          static_cast<int64_t>(rtpjpegdepay + jpegdec + queue + videoconvert + videoflip);
+    const ReceivedFrame frame{stats.frameId, metadata.convertUs, metadata.encodeUs, metadata.payloadUs, udpstream, rtpjpegdepay,
+                              jpegdec, queue, videoconvert, videoflip, total, stats.lostPackets.load()};
+    lock.unlock();
+
+    if (receivedFrameCallback != nullptr) {
+        receivedFrameCallback(pipelineName, frame);
+    } else {
+        std::cout << pipelineName <<
+                ": frame - " << frame.frameId <<
+                ", nvvidconv: " << frame.convertUs <<
+                ", jpegenc: " << frame.encodeUs <<
+                ", rtpjpegpay: " << frame.payloadUs <<
+                ", udpstream: " << udpstream <<
+                ": rtpjpegdepay: " << rtpjpegdepay <<
+                ", jpegdec: " << jpegdec <<
+                ", queue: " << queue <<
+                ", videoconvert: " << videoconvert <<
+                ", videoflip: " << videoflip <<
+                ", lost packets: " << frame.lostPackets <<
+                ", TOTAL: " << total / 1000.0 << "ms \n";
+    }
+
+    if (saveLogs) {
         finishing = true;
         SaveLogFilesReceiving();
     }
 }
+
+// Creates the pipeline's entries while it is built, so the first frames of cameras starting at the same time find
+// them in place instead of inserting into the shared registries from their streaming threads
+inline void PrepareStreamingStats(const std::string &pipelineName) {
+    GetStreamingStats(pipelineName);
+    std::lock_guard<std::mutex> lock(capturedFramesMutex);
+    capturedFrames[pipelineName];
+    frameIds[pipelineName];
+}
+
+// Frame ids and stage timestamps of a streaming pipeline, carried to the receiver in the RTP header
+inline void AttachStreamingMetadata(GstElement *pipeline) {
+    PrepareStreamingStats(GST_OBJECT_NAME(pipeline));
+    for (const char *name: {"camsrc_ident", "vidconv_ident", "enc_ident"}) {
+        GstElement *identity = gst_bin_get_by_name(GST_BIN(pipeline), name);
+        g_signal_connect(identity, "handoff", G_CALLBACK(OnIdentityHandoffCameraStreaming), nullptr);
+        gst_object_unref(identity);
+    }
+
+    // Probe instead of an identity after the payloader, so its buffer lists reach the sink in one push
+    GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), "payloader");
+    GstPad *payloader_src = gst_element_get_static_pad(payloader, "src");
+    gst_pad_add_probe(payloader_src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      OnPayloaderProbeCameraStreaming, nullptr, nullptr);
+    gst_object_unref(payloader_src);
+    gst_object_unref(payloader);
+}
+
+// The stage identities of a receiving pipeline, see GetJpegReceivingPipeline and GetH264ReceivingPipeline
+inline void AttachReceivingMetadata(GstElement *pipeline) {
+    GetReceivingStats(GST_OBJECT_NAME(pipeline));
+    {
+        std::lock_guard<std::mutex> lock(capturedFramesMutex);
+        capturedFrames[GST_OBJECT_NAME(pipeline)];
+    }
+    for (const char *name: {"udpsrc_ident", "rtpdepay_ident", "dec_ident", "queue_ident", "vidconv_ident", "vidflip_ident"}) {
+        GstElement *identity = gst_bin_get_by_name(GST_BIN(pipeline), name);
+        if (identity == nullptr) { continue; }
+        g_signal_connect(identity, "handoff", G_CALLBACK(OnIdentityHandoffReceiving), nullptr);
+        gst_object_unref(identity);
+    }
+}
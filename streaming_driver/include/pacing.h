@@ -0,0 +1,111 @@
+//
+// Per-frame RTP packet pacing
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+
+constexpr unsigned int PACING_STATS_INTERVAL = 300; // frames
+
+// Spreads the packets of a single frame over a fraction of the frame interval instead of sending them as one
+// line-rate burst. The packet count of the upcoming frame is unknown up front, so it is estimated from the
+// previous frames. The sleeps run on the thread of the pacing queue (see GetPacingStage in pipelines.h).
+struct PacketPacer {
+    std::atomic<double> fraction{0.0};
+    std::atomic<int> fps{30};
+
+    // Touched only from the pacing queue's thread
+    bool frameStart = true;
+    std::chrono::steady_clock::time_point frameBegin{};
+    unsigned int packetIndex = 0;
+    double expectedPackets = 1.0;
+
+    uint64_t statFrames = 0, statPackets = 0, statDelayUs = 0;
+};
+
+inline void DestroyPacketPacer(gpointer data) {
+    delete static_cast<PacketPacer *>(data);
+}
+
+inline void OnIdentityHandoffPacing(const GstElement *identity, GstBuffer *buffer, gpointer data) {
+    auto *pacer = static_cast<PacketPacer *>(data);
+    const auto now = std::chrono::steady_clock::now();
+
+    const double fraction = pacer->fraction.load(std::memory_order_relaxed);
+    const int fps = std::max(1, pacer->fps.load(std::memory_order_relaxed));
+
+    if (pacer->frameStart) {
+        pacer->frameStart = false;
+        pacer->frameBegin = now;
+        pacer->packetIndex = 0;
+    }
+
+    if (fraction > 0) {
+        const double windowUs = 1'000'000.0 / fps * std::min(fraction, 1.0);
+        const auto target = pacer->frameBegin + std::chrono::microseconds(
+                                static_cast<long>(windowUs * pacer->packetIndex / pacer->expectedPackets));
+
+        // Never wait past the pacing window, a frame larger than estimated is flushed at line rate
+        const auto deadline = pacer->frameBegin + std::chrono::microseconds(static_cast<long>(windowUs));
+        const auto wakeup = std::min(target, deadline);
+        if (wakeup > now) {
+            std::this_thread::sleep_until(wakeup);
+            pacer->statDelayUs += std::chrono::duration_cast<std::chrono::microseconds>(wakeup - now).count();
+        }
+    }
+    pacer->packetIndex++;
+
+    bool marker = false;
+    GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
+    if (gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp_buf)) {
+        marker = gst_rtp_buffer_get_marker(&rtp_buf);
+        gst_rtp_buffer_unmap(&rtp_buf);
+    }
+
+    if (!marker) { return; }
+
+    // Last packet of the frame, refine the estimate for the next one
+    pacer->expectedPackets = 0.8 * pacer->expectedPackets + 0.2 * pacer->packetIndex;
+    pacer->frameStart = true;
+    pacer->statFrames++;
+    pacer->statPackets += pacer->packetIndex;
+
+    if (pacer->statFrames >= PACING_STATS_INTERVAL) {
+        std::cout << identity->object.parent->name << " pacing: " <<
+                static_cast<double>(pacer->statPackets) / pacer->statFrames << " packets/frame, " <<
+                pacer->statDelayUs / pacer->statFrames << " us/frame added delay\n";
+        pacer->statFrames = pacer->statPackets = pacer->statDelayUs = 0;
+    }
+}
+
+inline void AttachPacketPacer(GstElement *pipeline, double fraction, int fps) {
+    GstElement *pacer_ident = gst_bin_get_by_name(GST_BIN(pipeline), "pacer_ident");
+    if (pacer_ident == nullptr) { return; }
+
+    auto *pacer = new PacketPacer();
+    pacer->fraction = fraction;
+    pacer->fps = fps;
+    g_object_set_data_full(G_OBJECT(pacer_ident), "pacer", pacer, DestroyPacketPacer);
+    g_signal_connect(pacer_ident, "handoff", G_CALLBACK(OnIdentityHandoffPacing), pacer);
+    gst_object_unref(pacer_ident);
+}
+
+inline bool UpdatePacketPacer(GstElement *pipeline, double fraction, int fps) {
+    GstElement *pacer_ident = gst_bin_get_by_name(GST_BIN(pipeline), "pacer_ident");
+    if (pacer_ident == nullptr) { return fraction <= 0; }
+
+    auto *pacer = static_cast<PacketPacer *>(g_object_get_data(G_OBJECT(pacer_ident), "pacer"));
+    if (pacer != nullptr) {
+        pacer->fraction = fraction;
+        pacer->fps = fps;
+    }
+    gst_object_unref(pacer_ident);
+    return pacer != nullptr;
+}
@@ -3,7 +3,12 @@
 //
 #pragma once
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
 
 enum Codec {
     JPEG, VP8, VP9, H264, H265
@@ -13,6 +18,17 @@ enum VideoMode {
     STEREO, MONO
 };
 
+// Thread boundaries that can be put between the stages, named after the stage in front of the queue
+enum StageQueue : unsigned int {
+    STAGE_QUEUE_CAPTURE = 1 << 0, // capture | convert
+    STAGE_QUEUE_CONVERT = 1 << 1, // convert | encode
+    STAGE_QUEUE_ENCODE = 1 << 2 // encode | payload and send
+};
+
+enum ShmOutputMode {
+    SHM_NONE, SHM_RAW, SHM_ENCODED, SHM_BOTH
+};
+
 struct StreamingConfig {
     std::string ip{};
     int portLeft{};
@@ -23,26 +39,184 @@ struct StreamingConfig {
     int horizontalResolution{}, verticalResolution{};
     VideoMode videoMode{};
     int fps{};
+    int mtu{1300};
+    double pacing{}; // Fraction of the frame interval to spread each frame's packets over, 0 disables pacing
+    bool batchSend{}; // Send each frame's packets in one batched syscall instead of udpsink
+    int slices{}; // H.264/H.265 slices per frame, 0 encodes whole frames as a single slice
+    int restartInterval{}; // JPEG restart marker every N MCU rows, 0 disables restart markers
+    ShmOutputMode shmOutput{}; // Frames published to shared memory for on-robot consumers (see shm_output.h)
+    int shmSlots{4};
+    unsigned int stageQueues{}; // StageQueue bits, 0 runs the whole chain on the camera's streaming thread
+    int stageQueueMs{50}; // Frames older than this are dropped from a stage queue instead of being delivered late
+};
+
+// The binding names every field, so it stops compiling when StreamingConfig gains or loses one
+inline auto TieConfig(const StreamingConfig &c) {
+    const auto &[ip, portLeft, portRight, codec, encodingQuality, bitrate, horizontalResolution, verticalResolution, videoMode,
+                 fps, mtu, pacing, batchSend, slices, restartInterval, shmOutput, shmSlots, stageQueues, stageQueueMs] = c;
+    return std::tie(ip, portLeft, portRight, codec, encodingQuality, bitrate, horizontalResolution, verticalResolution,
+                    videoMode, fps, mtu, pacing, batchSend, slices, restartInterval, shmOutput, shmSlots, stageQueues,
+                    stageQueueMs);
+}
+
+inline bool operator==(const StreamingConfig &a, const StreamingConfig &b) { return TieConfig(a) == TieConfig(b); }
+inline bool operator!=(const StreamingConfig &a, const StreamingConfig &b) { return !(a == b); }
+
+// One entry of the camera map (see --cameras), fixed for the lifetime of the driver
+struct CameraDescriptor {
+    int sensorId{};
+    std::string name{}; // role of the camera, names its pipeline, shared-memory rings and recordings
+    int port{}; // 0 falls back to portLeft/portRight of the streaming config for the first two cameras
+    std::string orientation{"vertical-flip"}; // flip-method of the converter, e.g. none, rotate-180, clockwise
 };
 
+// The legacy stereo head, used when no camera map is given
+inline std::vector<CameraDescriptor> GetDefaultCameraMap() {
+    return {{0, "left", 0, "vertical-flip"}, {1, "right", 0, "vertical-flip"}};
+}
+
+inline bool IsValidOrientation(const std::string &orientation) {
+    for (const char *method: {"none", "clockwise", "rotate-180", "counterclockwise", "horizontal-flip",
+                              "vertical-flip", "upper-left-diagonal", "upper-right-diagonal"}) {
+        if (orientation == method) { return true; }
+    }
+    return false;
+}
+
+inline int GetCameraPort(const StreamingConfig &streamingConfig, const CameraDescriptor &camera, int index) {
+    if (camera.port > 0) { return camera.port; }
+    return index == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
+}
+
+inline int GetMacroblocksPerSlice(const StreamingConfig &streamingConfig) {
+    const int macroblocks = ((streamingConfig.horizontalResolution + 15) / 16) * ((streamingConfig.verticalResolution + 15) / 16);
+    return (macroblocks + streamingConfig.slices - 1) / streamingConfig.slices;
+}
+
+// The config is in bit/s, the encoders of this build take it as is except for x265enc
+inline unsigned int GetEncoderBitrate(const StreamingConfig &streamingConfig) {
+#ifndef JETSON
+    if (streamingConfig.codec == H265) { return streamingConfig.bitrate / 1000; }
+#endif
+    return streamingConfig.bitrate;
+}
+
+// Where a receiving pipeline delivers its decoded frames
+enum ReceiverSink {
+    RECEIVER_DISPLAY, // fpsdisplaysink window
+    RECEIVER_HEADLESS, // discarded, e.g. by the loopback benchmark which only needs the frames to arrive
+    RECEIVER_APPSINK, // RGBA frames handed to the application (see receiver.h)
+    RECEIVER_APPSINK_I420 // I420 frames handed to the application, e.g. for the quality measurement (see quality.h)
+};
+
+inline std::string GetReceiverSink(ReceiverSink sink) {
+    switch (sink) {
+        case RECEIVER_HEADLESS: return "fakesink sync=false";
+        case RECEIVER_APPSINK: return "appsink name=framesink caps=video/x-raw,format=RGBA sync=false max-buffers=1 drop=true";
+        case RECEIVER_APPSINK_I420: return "appsink name=framesink caps=video/x-raw,format=I420 sync=false max-buffers=1 drop=true";
+        default: return "fpsdisplaysink sync=false";
+    }
+}
+
+// Either a plain udpsink or the appsink feeding the batched UDP sender (see udp_batch.h)
+inline std::string GetSinkStage(const StreamingConfig &streamingConfig, int port) {
+    std::ostringstream oss;
+    if (streamingConfig.batchSend) {
+        oss << " ! appsink name=batchsink sync=false emit-signals=false buffer-list=true";
+    } else {
+        oss << " ! udpsink name=udpsink host=" << streamingConfig.ip << " sync=false port=" << port;
+    }
+    return oss.str();
+}
+
+// Pacing stage between the payloader and the sink, only present when pacing is enabled. Being an identity it
+// splits the payloader's buffer lists, pacing needs one send per packet anyway. The queue gives the pacer a sender
+// thread of its own, so its sleeps don't hold up capture and encoding of the next frame. It never drops, a lost
+// packet would cost the whole frame; two frames of packets block the encoder instead.
+inline std::string GetPacingStage(const StreamingConfig &streamingConfig) {
+    if (streamingConfig.pacing <= 0) { return ""; }
+
+    std::ostringstream oss;
+    oss << " ! queue name=pacing_queue max-size-buffers=0 max-size-bytes=0 max-size-time="
+        << 2 * 1'000'000'000ULL / std::max(1, streamingConfig.fps) << " ! identity name=pacer_ident";
+    return oss.str();
+}
+
+
+// Leaky queue starting a new streaming thread. It is bounded by time only, under overload the oldest frame is
+// dropped. On Jetson the queued buffers come from the camera's small NVMM pool, so keep the bound to a few frames.
+inline std::string GetStageQueue(const StreamingConfig &streamingConfig, StageQueue stage, const char *name) {
+    if (!(streamingConfig.stageQueues & stage)) { return ""; }
+
+    std::ostringstream oss;
+    oss << " ! queue name=" << name << " leaky=downstream max-size-buffers=0 max-size-bytes=0 max-size-time="
+        << static_cast<uint64_t>(streamingConfig.stageQueueMs) * 1'000'000;
+    return oss.str();
+}
+
+inline bool HasShmRawOutput(const StreamingConfig &streamingConfig) {
+    return streamingConfig.shmOutput == SHM_RAW || streamingConfig.shmOutput == SHM_BOTH;
+}
+
+inline bool HasShmEncodedOutput(const StreamingConfig &streamingConfig) {
+    return streamingConfig.shmOutput == SHM_ENCODED || streamingConfig.shmOutput == SHM_BOTH;
+}
+
+// Tee splitting off the raw shared-memory branch, right after the raw frame is ready
+inline std::string GetShmRawTee(const StreamingConfig &streamingConfig) {
+    return HasShmRawOutput(streamingConfig) ? " ! tee name=shm_raw_tee" : "";
+}
+
+// Tee after the encoder, always present since the recording branch (see recording.h) is linked to it at runtime
+inline std::string GetEncodedTee() {
+    return " ! tee name=enc_tee";
+}
+
+// The branches themselves, appended after the main chain. A leaky single-buffer queue in front of each appsink
+// means a slow branch drops frames instead of holding back the UDP stream.
+inline std::string GetShmBranches(const StreamingConfig &streamingConfig) {
+    std::ostringstream oss;
+    if (HasShmRawOutput(streamingConfig)) {
+        oss << " shm_raw_tee. ! queue leaky=downstream max-size-buffers=1 max-size-bytes=0 max-size-time=0"
+#ifdef JETSON
+            << " ! nvvidconv ! video/x-raw,format=NV12" // out of NVMM into system memory
+#else
+            << " ! videoconvert ! video/x-raw,format=NV12"
+#endif
+            << " ! appsink name=shm_raw_sink sync=false async=false drop=true max-buffers=1";
+    }
+    if (HasShmEncodedOutput(streamingConfig)) {
+        oss << " enc_tee. ! queue leaky=downstream max-size-buffers=1 max-size-bytes=0 max-size-time=0"
+            << " ! appsink name=shm_encoded_sink sync=false async=false drop=true max-buffers=1";
+    }
+    return oss.str();
+}
+
 
 #ifdef JETSON
 
-inline std::ostringstream GetJpegStreamingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
+// Slices are packetized as separate NAL units, a lost packet only damages its own stripe of the frame
+inline std::string GetSliceOptions(const StreamingConfig &streamingConfig) {
+    if (streamingConfig.slices <= 0) { return ""; }
+    return " slice-header-spacing=" + std::to_string(GetMacroblocksPerSlice(streamingConfig)) + " bit-packetization=0";
+}
 
+inline std::ostringstream GetJpegStreamingPipeline(const StreamingConfig &streamingConfig, const CameraDescriptor &camera) {
     std::ostringstream oss;
-    oss << "nvarguscamerasrc aeantibanding=AeAntibandingMode_Off ee-mode=EdgeEnhancement_Off tnr-mode=NoiseReduction_Off saturation=1.2 sensor-id=" << sensorId
+    oss << "nvarguscamerasrc aeantibanding=AeAntibandingMode_Off ee-mode=EdgeEnhancement_Off tnr-mode=NoiseReduction_Off saturation=1.2 sensor-id=" << camera.sensorId
         << " ! " << "video/x-raw(memory:NVMM),width=(int)" << streamingConfig.horizontalResolution << ",height=(int)" << streamingConfig.verticalResolution
         << ",framerate=(fraction)" << streamingConfig.fps << "/1,format=(string)NV12"
-        << " ! identity name=camsrc_ident"
-        << " ! nvvidconv flip-method=vertical-flip"
-        << " ! identity name=vidconv_ident"
+        << " ! identity name=camsrc_ident" << GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue")
+        << " ! nvvidconv flip-method=" << camera.orientation
+        << " ! identity name=vidconv_ident" << GetShmRawTee(streamingConfig)
+        << GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue")
         << " ! nvjpegenc name=encoder quality=" << streamingConfig.encodingQuality << " idct-method=ifast"
-        << " ! identity name=enc_ident"
-        << " ! rtpjpegpay mtu=1300"
-        << " ! identity name=rtppay_ident"
-        << " ! udpsink host=" << streamingConfig.ip << " sync=false port=" << port;
+        << " ! identity name=enc_ident" << GetEncodedTee()
+        << GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue")
+        << " ! rtpjpegpay name=payloader mtu=" << streamingConfig.mtu
+        << GetPacingStage(streamingConfig)
+        << GetSinkStage(streamingConfig, camera.port)
+        << GetShmBranches(streamingConfig);
     return oss;
 }
 
@@ -52,14 +226,17 @@ inline std::ostringstream GetCombinedJpegStreamingPipeline(const StreamingConfig
     oss << "nvcompositor name=comp sink_0::ypos=0 sink_1::ypos=" << streamingConfig.verticalResolution
     	<< " ! video/x-raw(memory:NVMM), format=RGBA, width=" << streamingConfig.horizontalResolution << ", height=" << streamingConfig.verticalResolution * 2
     	<< " ! nvvidconv flip-method=vertical-flip ! video/x-raw(memory:NVMM), format=NV12, width=" << streamingConfig.horizontalResolution << ", height=" << streamingConfig.verticalResolution * 2
-    	<< " ! identity name=vidconv_ident"
+    	<< " ! identity name=vidconv_ident" << GetShmRawTee(streamingConfig)
+    	<< GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue")
     	<< " ! nvjpegenc quality=" << streamingConfig.encodingQuality
-    	<< " ! identity name=enc_ident"
-    	<< " ! rtpjpegpay mtu=1300"
-    	<< " ! identity name=rtppay_ident"
-    	<< " ! udpsink host=" << streamingConfig.ip << " sync=false port=" << streamingConfig.portLeft
+    	<< " ! identity name=enc_ident" << GetEncodedTee()
+    	<< GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue")
+    	<< " ! rtpjpegpay name=payloader mtu=" << streamingConfig.mtu
+    	<< GetPacingStage(streamingConfig)
+    	<< GetSinkStage(streamingConfig, streamingConfig.portLeft)
+    	<< GetShmBranches(streamingConfig)
     	<< " nvarguscamerasrc sensor-id=1 ! video/x-raw(memory:NVMM), width=" << streamingConfig.horizontalResolution << ", height=" << streamingConfig.verticalResolution << ", format=NV12, framerate=" << streamingConfig.fps << "/1"
-    	<< " ! identity name=camsrc_ident"
+    	<< " ! identity name=camsrc_ident" << GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue")
     	<< " ! comp.sink_0"
     	<< " nvarguscamerasrc sensor-id=0 ! video/x-raw(memory:NVMM), width=" << streamingConfig.horizontalResolution << ", height=" << streamingConfig.verticalResolution << ", format=NV12, framerate=" << streamingConfig.fps << "/1"
     	<< " ! comp.sink_1";
@@ -67,114 +244,184 @@ inline std::ostringstream GetCombinedJpegStreamingPipeline(const StreamingConfig
     return oss;
 }
 
-inline std::ostringstream GetH264StreamingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
-
+inline std::ostringstream GetH264StreamingPipeline(const StreamingConfig &streamingConfig, const CameraDescriptor &camera) {
     std::ostringstream oss;
-    oss << "nvarguscamerasrc aeantibanding=AeAntibandingMode_Off ee-mode=EdgeEnhancement_Off tnr-mode=NoiseReduction_Off saturation=1.2 sensor-id=" << sensorId
+    oss << "nvarguscamerasrc aeantibanding=AeAntibandingMode_Off ee-mode=EdgeEnhancement_Off tnr-mode=NoiseReduction_Off saturation=1.2 sensor-id=" << camera.sensorId
         << " ! " << "video/x-raw(memory:NVMM),width=(int)" << streamingConfig.horizontalResolution << ",height=(int)" << streamingConfig.verticalResolution
         << ",framerate=(fraction)" << streamingConfig.fps << "/1,format=(string)NV12"
-	    << " ! identity name=camsrc_ident"
-	    << " ! nvvidconv flip-method=vertical-flip"
-        << " ! identity name=vidconv_ident"
-        << " ! nvv4l2h264enc name=encoder insert-sps-pps=1 bitrate=" << streamingConfig.bitrate << " preset-level=1"
-        << " ! identity name=enc_ident"
-        << " ! rtph264pay mtu=1300 config-interval=1 pt=96"
-        << " ! identity name=rtppay_ident"
-        << " ! udpsink host=" << streamingConfig.ip << " sync=false port=" << port;
+	    << " ! identity name=camsrc_ident" << GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue")
+	    << " ! nvvidconv flip-method=" << camera.orientation
+        << " ! identity name=vidconv_ident" << GetShmRawTee(streamingConfig)
+        << GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue")
+        << " ! nvv4l2h264enc name=encoder insert-sps-pps=1 bitrate=" << streamingConfig.bitrate << " preset-level=1" << GetSliceOptions(streamingConfig)
+        << " ! identity name=enc_ident" << GetEncodedTee()
+        << GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue")
+        << " ! rtph264pay name=payloader mtu=" << streamingConfig.mtu << " config-interval=1 pt=96"
+        << GetPacingStage(streamingConfig)
+        << GetSinkStage(streamingConfig, camera.port)
+        << GetShmBranches(streamingConfig);
     return oss;
 }
 
-inline std::ostringstream GetH265StreamingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
-
+inline std::ostringstream GetH265StreamingPipeline(const StreamingConfig &streamingConfig, const CameraDescriptor &camera) {
     std::ostringstream oss;
-    oss << "nvarguscamerasrc aeantibanding=AeAntibandingMode_Off ee-mode=EdgeEnhancement_Off tnr-mode=NoiseReduction_Off saturation=1.2 sensor-id=" << sensorId
+    oss << "nvarguscamerasrc aeantibanding=AeAntibandingMode_Off ee-mode=EdgeEnhancement_Off tnr-mode=NoiseReduction_Off saturation=1.2 sensor-id=" << camera.sensorId
         << " ! " << "video/x-raw(memory:NVMM),width=(int)" << streamingConfig.horizontalResolution << ",height=(int)" << streamingConfig.verticalResolution
         << ",framerate=(fraction)" << streamingConfig.fps << "/1,format=(string)NV12"
-	<< " ! identity name=camsrc_ident"
-	<< " ! nvvidconv flip-method=vertical-flip"
-        << " ! identity name=vidconv_ident"
-        << " ! nvv4l2h265enc name=encoder insert-sps-pps=1 bitrate=" << streamingConfig.bitrate << " preset-level=1"
-        << " ! identity name=enc_ident"
-        << " ! rtph265pay mtu=1300 config-interval=1 pt=96"
-        << " ! identity name=rtppay_ident"
-        << " ! udpsink host=" << streamingConfig.ip << " sync=false port=" << port;
+	<< " ! identity name=camsrc_ident" << GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue")
+	<< " ! nvvidconv flip-method=" << camera.orientation
+        << " ! identity name=vidconv_ident" << GetShmRawTee(streamingConfig)
+        << GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue")
+        << " ! nvv4l2h265enc name=encoder insert-sps-pps=1 bitrate=" << streamingConfig.bitrate << " preset-level=1" << GetSliceOptions(streamingConfig)
+        << " ! identity name=enc_ident" << GetEncodedTee()
+        << GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue")
+        << " ! rtph265pay name=payloader mtu=" << streamingConfig.mtu << " config-interval=1 pt=96"
+        << GetPacingStage(streamingConfig)
+        << GetSinkStage(streamingConfig, camera.port)
+        << GetShmBranches(streamingConfig);
     return oss;
 }
 
-inline std::ostringstream GetJpegReceivingPipeline(const StreamingConfig &streamingConfig, int sensorId) { return std::ostringstream{}; }
+// No receiving pipelines on the Jetson, main.cpp rejects --receive up front on this build
+inline std::ostringstream GetJpegReceivingPipeline(const StreamingConfig &streamingConfig, int port, ReceiverSink sink = RECEIVER_DISPLAY) { return std::ostringstream{}; }
+
+inline std::ostringstream GetH264ReceivingPipeline(const StreamingConfig &streamingConfig, int port, ReceiverSink sink = RECEIVER_DISPLAY) { return std::ostringstream{}; }
 
-inline std::ostringstream GetH264ReceivingPipeline(const StreamingConfig &streamingConfig, int sensorId) { return std::ostringstream{}; }
+inline std::ostringstream GetH265ReceivingPipeline(const StreamingConfig &streamingConfig, int port, ReceiverSink sink = RECEIVER_DISPLAY) { return std::ostringstream{}; }
 
 #else
 
-inline std::ostringstream GetJpegStreamingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
+// openh264 encodes the slices of a frame in parallel, one thread per slice
+inline std::string GetSliceOptions(const StreamingConfig &streamingConfig) {
+    if (streamingConfig.slices <= 0) { return ""; }
+    return " slice-mode=n-slices num-slices=" + std::to_string(streamingConfig.slices) +
+           " multi-thread=" + std::to_string(streamingConfig.slices);
+}
 
+inline std::ostringstream GetJpegStreamingPipeline(const StreamingConfig &streamingConfig, const CameraDescriptor &camera) {
     std::ostringstream oss;
     oss << "videotestsrc pattern=" << 0 <<
             " ! " << "video/x-raw,width=(int)" << streamingConfig.horizontalResolution << ",height=(int)" << streamingConfig.verticalResolution << ",framerate=(fraction)"
             << streamingConfig.fps << "/1,format=(string)NV12" <<
-            " ! identity name=camsrc_ident"
+            " ! identity name=camsrc_ident" <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue") <<
             " ! clockoverlay"
-            " ! videoflip method=vertical-flip"
-            " ! identity name=vidconv_ident"
-            " ! jpegenc quality=" << streamingConfig.encodingQuality <<
-            " ! identity name=enc_ident"
-            " ! rtpjpegpay"
-            " ! identity name=rtppay_ident"
-            " ! udpsink host=" << streamingConfig.ip << " sync=false port=" << port;
+            " ! videoflip method=" << camera.orientation <<
+            " ! identity name=vidconv_ident" <<
+            GetShmRawTee(streamingConfig) <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue") <<
+            " ! jpegenc name=encoder quality=" << streamingConfig.encodingQuality <<
+            " ! identity name=enc_ident" <<
+            GetEncodedTee() <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue") <<
+            " ! rtpjpegpay name=payloader mtu=" << streamingConfig.mtu <<
+            GetPacingStage(streamingConfig) <<
+            GetSinkStage(streamingConfig, camera.port) <<
+            GetShmBranches(streamingConfig);
 
     return oss;
 }
 
-inline std::ostringstream GetJpegReceivingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
-
+inline std::ostringstream GetJpegReceivingPipeline(const StreamingConfig &streamingConfig, int port, ReceiverSink sink = RECEIVER_DISPLAY) {
     std::ostringstream oss;
     oss << "udpsrc port=" << port << " "
-            "! application/x-rtp,encoding-name=JPEG,payload=26 ! identity name=udpsrc_ident "
-            "! rtpjpegdepay ! identity name=rtpdepay_ident "
-            "! jpegdec ! video/x-raw,format=RGB ! identity name=dec_ident "
+            "! application/x-rtp,encoding-name=JPEG,payload=26 ! identity name=udpsrc_ident ";
+
+    if (streamingConfig.restartInterval > 0) {
+        // Frames with lost packets are rebuilt and concealed in code, rtpjpegdepay would drop them (see jpeg_restart.h)
+        oss << "! appsink name=rtpjpegsink sync=false emit-signals=false "
+                "appsrc name=rtpjpegsrc is-live=true format=time caps=image/jpeg,parsed=(boolean)true ";
+    } else {
+        oss << "! rtpjpegdepay ";
+    }
+
+    // jpegdec outputs I420 for the 4:2:0 frames of the sender, forcing RGB would only be converted back for that sink
+    oss << "! identity name=rtpdepay_ident "
+            "! jpegdec name=decoder " << (sink == RECEIVER_APPSINK_I420 ? "" : "! video/x-raw,format=RGB ") <<
+            "! identity name=dec_ident "
             "! identity ! identity name=queue_ident "
             "! videoconvert ! identity name=vidconv_ident "
             "! identity ! identity name=vidflip_ident "
-            "! fpsdisplaysink sync=false";
+            "! " << GetReceiverSink(sink);
     return oss;
 }
 
-inline std::ostringstream GetH264StreamingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
-
+inline std::ostringstream GetH264StreamingPipeline(const StreamingConfig &streamingConfig, const CameraDescriptor &camera) {
     std::ostringstream oss;
     oss << "videotestsrc pattern=" << 0 <<
             " ! " << "video/x-raw,width=(int)" << streamingConfig.horizontalResolution << ",height=(int)" << streamingConfig.verticalResolution << ",framerate=(fraction)"
             << streamingConfig.fps << "/1" <<
-            " ! identity name=camsrc_ident"
+            " ! identity name=camsrc_ident" <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue") <<
             " ! clockoverlay"
-            " ! videoflip method=vertical-flip"
-            " ! identity name=vidconv_ident"
-            " ! openh264enc gop-size=1 bitrate=20000 ! h264parse config-interval=-1"
-            " ! identity name=enc_ident"
-            " ! rtph264pay aggregate-mode=none config-interval=-1"
-            " ! identity name=rtppay_ident"
-            " ! udpsink host=" << streamingConfig.ip << " sync=false port=" << port;
+            " ! videoflip method=" << camera.orientation <<
+            " ! identity name=vidconv_ident" <<
+            GetShmRawTee(streamingConfig) <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue") <<
+            " ! openh264enc name=encoder gop-size=1 bitrate=" << streamingConfig.bitrate << GetSliceOptions(streamingConfig) << " ! h264parse config-interval=-1"
+            " ! identity name=enc_ident" <<
+            GetEncodedTee() <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue") <<
+            " ! rtph264pay name=payloader aggregate-mode=none config-interval=-1 mtu=" << streamingConfig.mtu <<
+            GetPacingStage(streamingConfig) <<
+            GetSinkStage(streamingConfig, camera.port) <<
+            GetShmBranches(streamingConfig);
     return oss;
 }
 
-inline std::ostringstream GetH264ReceivingPipeline(const StreamingConfig &streamingConfig, int sensorId) {
-    int port = sensorId == 0 ? streamingConfig.portLeft : streamingConfig.portRight;
-
+inline std::ostringstream GetH264ReceivingPipeline(const StreamingConfig &streamingConfig, int port, ReceiverSink sink = RECEIVER_DISPLAY) {
     std::ostringstream oss;
     oss << "udpsrc port=" << port << " " <<
-            "! application/x-rtp, media=video, clock-rate=90000, payload=96 ! identity name=udpsrc_ident "
+            "! application/x-rtp, media=video, clock-rate=90000, encoding-name=H264, payload=96 ! identity name=udpsrc_ident "
             "! rtph264depay ! identity name=rtpdepay_ident "
             "! avdec_h264 ! identity name=dec_ident "
             "! queue ! identity name=queue_ident "
             "! videoconvert ! identity name=vidconv_ident "
             "! identity ! identity name=vidflip_ident "
-            "! fpsdisplaysink sync=false";
+            "! " << GetReceiverSink(sink);
+    return oss;
+}
+
+// x265 has no slice property of its own, the slices go through its option string
+inline std::string GetH265SliceOptions(const StreamingConfig &streamingConfig) {
+    if (streamingConfig.slices <= 0) { return ""; }
+    return " option-string=slices=" + std::to_string(streamingConfig.slices);
+}
+
+inline std::ostringstream GetH265StreamingPipeline(const StreamingConfig &streamingConfig, const CameraDescriptor &camera) {
+    std::ostringstream oss;
+    oss << "videotestsrc pattern=" << 0 <<
+            " ! " << "video/x-raw,width=(int)" << streamingConfig.horizontalResolution << ",height=(int)" << streamingConfig.verticalResolution << ",framerate=(fraction)"
+            << streamingConfig.fps << "/1" <<
+            " ! identity name=camsrc_ident" <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_CAPTURE, "capture_queue") <<
+            " ! clockoverlay"
+            " ! videoflip method=" << camera.orientation <<
+            " ! identity name=vidconv_ident" <<
+            GetShmRawTee(streamingConfig) <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_CONVERT, "convert_queue") <<
+            " ! x265enc name=encoder tune=zerolatency speed-preset=ultrafast key-int-max=1 bitrate=" << GetEncoderBitrate(streamingConfig) <<
+            GetH265SliceOptions(streamingConfig) << " ! h265parse config-interval=-1"
+            " ! identity name=enc_ident" <<
+            GetEncodedTee() <<
+            GetStageQueue(streamingConfig, STAGE_QUEUE_ENCODE, "encode_queue") <<
+            " ! rtph265pay name=payloader config-interval=-1 mtu=" << streamingConfig.mtu <<
+            GetPacingStage(streamingConfig) <<
+            GetSinkStage(streamingConfig, camera.port) <<
+            GetShmBranches(streamingConfig);
+    return oss;
+}
+
+inline std::ostringstream GetH265ReceivingPipeline(const StreamingConfig &streamingConfig, int port, ReceiverSink sink = RECEIVER_DISPLAY) {
+    std::ostringstream oss;
+    oss << "udpsrc port=" << port << " " <<
+            "! application/x-rtp, media=video, clock-rate=90000, encoding-name=H265, payload=96 ! identity name=udpsrc_ident "
+            "! rtph265depay ! identity name=rtpdepay_ident "
+            "! avdec_h265 ! identity name=dec_ident "
+            "! queue ! identity name=queue_ident "
+            "! videoconvert ! identity name=vidconv_ident "
+            "! identity ! identity name=vidflip_ident "
+            "! " << GetReceiverSink(sink);
     return oss;
 }
 
@@ -0,0 +1,293 @@
+//
+// Objective quality (PSNR and SSIM of the luma plane) of decoded frames against the sender's reference frames
+//
+// The sender keeps the luma of every frame leaving its converter, keyed by the frame id it embeds in the RTP header
+// (see AddFrameMetadata). The receiver decodes into I420 (RECEIVER_APPSINK_I420) and compares each frame against
+// the reference with the same id, so the frames stay aligned through loss, drops and reordering. Sender and
+// receiver have to share the process, e.g. in the loopback benchmark.
+//
+// The kernels use SSE2 on x86-64 and NEON on aarch64 (the Jetson), with a scalar fallback. SSIM follows x264:
+// sums of 4x4 blocks, combined into 8x8 windows every 4 pixels.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <gst/gst.h>
+#include "logging.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+constexpr double PSNR_IDENTICAL = 100.0; // dB reported for identical frames instead of infinity
+constexpr size_t REFERENCE_FRAMES_HISTORY = 120; // frames, covers the frames in flight between sender and receiver
+
+inline uint64_t SumSquaredDifferences(const uint8_t *a, const uint8_t *b, int width) {
+    uint64_t sum = 0;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+        const __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        const __m128i lo = _mm_unpacklo_epi8(diff, zero), hi = _mm_unpackhi_epi8(diff, zero);
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    sum = static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__aarch64__)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16_t diff = vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x));
+        acc = vpadalq_u16(acc, vmull_u8(vget_low_u8(diff), vget_low_u8(diff)));
+        acc = vpadalq_u16(acc, vmull_u8(vget_high_u8(diff), vget_high_u8(diff)));
+    }
+    sum = vaddlvq_u32(acc);
+#endif
+    for (; x < width; x++) {
+        const int d = a[x] - b[x];
+        sum += d * d;
+    }
+    return sum;
+}
+
+inline double ComputePsnr(const uint8_t *frame, int frameStride, const uint8_t *reference, int referenceStride,
+                          int width, int height) {
+    uint64_t squaredError = 0;
+    for (int y = 0; y < height; y++) {
+        squaredError += SumSquaredDifferences(frame + static_cast<size_t>(y) * frameStride,
+                                              reference + static_cast<size_t>(y) * referenceStride, width);
+    }
+    if (squaredError == 0) { return PSNR_IDENTICAL; }
+    const double mse = static_cast<double>(squaredError) / (static_cast<double>(width) * height);
+    return std::min(PSNR_IDENTICAL, 10 * std::log10(255.0 * 255.0 / mse));
+}
+
+struct BlockSums {
+    uint32_t a, b, aa, bb, ab;
+};
+
+// Sums of the 4x4 blocks of one 4 row strip
+inline void SumBlocks4x4(const uint8_t *a, int strideA, const uint8_t *b, int strideB, int blocks, BlockSums *out) {
+    int block = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+    for (; block + 2 <= blocks; block += 2) {
+        __m128i sumA = zero, sumB = zero, sumAA = zero, sumBB = zero, sumAB = zero;
+        for (int row = 0; row < 4; row++) {
+            const __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + row * strideA + block * 4)), zero);
+            const __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + row * strideB + block * 4)), zero);
+            sumA = _mm_add_epi16(sumA, va);
+            sumB = _mm_add_epi16(sumB, vb);
+            sumAA = _mm_add_epi32(sumAA, _mm_madd_epi16(va, va));
+            sumBB = _mm_add_epi32(sumBB, _mm_madd_epi16(vb, vb));
+            sumAB = _mm_add_epi32(sumAB, _mm_madd_epi16(va, vb));
+        }
+        // Lanes hold pairs of columns, lanes 0-1 belong to the first block and 2-3 to the second
+        uint32_t s[5][4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(s[0]), _mm_madd_epi16(sumA, ones));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(s[1]), _mm_madd_epi16(sumB, ones));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(s[2]), sumAA);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(s[3]), sumBB);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(s[4]), sumAB);
+        for (int i = 0; i < 2; i++) {
+            out[block + i] = {s[0][2 * i] + s[0][2 * i + 1], s[1][2 * i] + s[1][2 * i + 1], s[2][2 * i] + s[2][2 * i + 1],
+                              s[3][2 * i] + s[3][2 * i + 1], s[4][2 * i] + s[4][2 * i + 1]};
+        }
+    }
+#elif defined(__aarch64__)
+    for (; block + 2 <= blocks; block += 2) {
+        uint16x8_t sumA = vdupq_n_u16(0), sumB = vdupq_n_u16(0);
+        uint32x4_t sumAA = vdupq_n_u32(0), sumBB = vdupq_n_u32(0), sumAB = vdupq_n_u32(0);
+        for (int row = 0; row < 4; row++) {
+            const uint8x8_t va = vld1_u8(a + row * strideA + block * 4);
+            const uint8x8_t vb = vld1_u8(b + row * strideB + block * 4);
+            sumA = vaddw_u8(sumA, va);
+            sumB = vaddw_u8(sumB, vb);
+            sumAA = vpadalq_u16(sumAA, vmull_u8(va, va));
+            sumBB = vpadalq_u16(sumBB, vmull_u8(vb, vb));
+            sumAB = vpadalq_u16(sumAB, vmull_u8(va, vb));
+        }
+        // Lanes hold pairs of columns, lanes 0-1 belong to the first block and 2-3 to the second
+        uint32_t s[5][4];
+        vst1q_u32(s[0], vpaddlq_u16(sumA));
+        vst1q_u32(s[1], vpaddlq_u16(sumB));
+        vst1q_u32(s[2], sumAA);
+        vst1q_u32(s[3], sumBB);
+        vst1q_u32(s[4], sumAB);
+        for (int i = 0; i < 2; i++) {
+            out[block + i] = {s[0][2 * i] + s[0][2 * i + 1], s[1][2 * i] + s[1][2 * i + 1], s[2][2 * i] + s[2][2 * i + 1],
+                              s[3][2 * i] + s[3][2 * i + 1], s[4][2 * i] + s[4][2 * i + 1]};
+        }
+    }
+#endif
+    for (; block < blocks; block++) {
+        BlockSums sums{};
+        for (int row = 0; row < 4; row++) {
+            for (int x = block * 4; x < block * 4 + 4; x++) {
+                const uint32_t pa = a[row * strideA + x], pb = b[row * strideB + x];
+                sums.a += pa;
+                sums.b += pb;
+                sums.aa += pa * pa;
+                sums.bb += pb * pb;
+                sums.ab += pa * pb;
+            }
+        }
+        out[block] = sums;
+    }
+}
+
+// SSIM of one 8x8 window from the sums of its 64 pixels
+inline double GetWindowSsim(uint32_t a, uint32_t b, uint32_t aa, uint32_t bb, uint32_t ab) {
+    constexpr double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+    const double meanA = a / 64.0, meanB = b / 64.0;
+    const double varA = aa / 64.0 - meanA * meanA, varB = bb / 64.0 - meanB * meanB;
+    const double covariance = ab / 64.0 - meanA * meanB;
+    return (2 * meanA * meanB + c1) * (2 * covariance + c2) / ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+}
+
+inline double ComputeSsim(const uint8_t *frame, int frameStride, const uint8_t *reference, int referenceStride,
+                          int width, int height) {
+    const int blocksX = width / 4, blocksY = height / 4;
+    if (blocksX < 2 || blocksY < 2) { return 1.0; }
+
+    std::vector<BlockSums> previous(blocksX), current(blocksX);
+    double total = 0;
+    uint64_t windows = 0;
+    for (int by = 0; by < blocksY; by++) {
+        SumBlocks4x4(frame + static_cast<size_t>(by) * 4 * frameStride, frameStride,
+                     reference + static_cast<size_t>(by) * 4 * referenceStride, referenceStride, blocksX, current.data());
+        if (by > 0) {
+            for (int bx = 0; bx + 1 < blocksX; bx++) {
+                const BlockSums &p0 = previous[bx], &p1 = previous[bx + 1], &c0 = current[bx], &c1 = current[bx + 1];
+                total += GetWindowSsim(p0.a + p1.a + c0.a + c1.a, p0.b + p1.b + c0.b + c1.b,
+                                       p0.aa + p1.aa + c0.aa + c1.aa, p0.bb + p1.bb + c0.bb + c1.bb,
+                                       p0.ab + p1.ab + c0.ab + c1.ab);
+                windows++;
+            }
+        }
+        std::swap(previous, current);
+    }
+    return total / windows;
+}
+
+// Luma planes of the frames leaving the sender's converter, by frame id
+struct ReferenceFrames {
+    std::mutex mutex;
+    int width = 0, height = 0;
+    // Shared with the measurement, which runs without holding the mutex
+    std::map<uint16_t, std::shared_ptr<const std::vector<uint8_t> > > frames;
+    std::deque<uint16_t> order;
+    std::atomic<uint64_t> unmatched{0}; // frames without a captured frame to take the id from, not kept
+};
+
+struct ReferenceCapture {
+    std::string pipelineName;
+    ReferenceFrames *references;
+};
+
+inline void DestroyReferenceCapture(gpointer data) {
+    delete static_cast<ReferenceCapture *>(data);
+}
+
+// Planar 4:2:0 (I420, NV12) with the default layout, the luma plane comes first with its rows 4 byte aligned
+inline GstPadProbeReturn OnReferenceFrame(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    auto &capture = *static_cast<ReferenceCapture *>(data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    int width = 0, height = 0;
+    if (GstCaps *caps = gst_pad_get_current_caps(pad)) {
+        const GstStructure *structure = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(structure, "width", &width);
+        gst_structure_get_int(structure, "height", &height);
+        gst_caps_unref(caps);
+    }
+    const int stride = GST_ROUND_UP_4(width);
+
+    CapturedFrame frame{};
+    if (!LookupCapturedFrame(capture.pipelineName, GST_BUFFER_PTS(buffer), frame)) {
+        capture.references->unmatched++;
+        return GST_PAD_PROBE_OK;
+    }
+    GstMapInfo map;
+    if (width == 0 || !gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        return GST_PAD_PROBE_OK;
+    }
+    if (map.size < static_cast<size_t>(stride) * height) {
+        gst_buffer_unmap(buffer, &map);
+        return GST_PAD_PROBE_OK;
+    }
+
+    auto plane = std::make_shared<std::vector<uint8_t> >(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; y++) {
+        memcpy(plane->data() + static_cast<size_t>(y) * width, map.data + static_cast<size_t>(y) * stride, width);
+    }
+    gst_buffer_unmap(buffer, &map);
+
+    auto &references = *capture.references;
+    std::lock_guard<std::mutex> lock(references.mutex);
+    references.width = width;
+    references.height = height;
+    if (references.order.size() >= REFERENCE_FRAMES_HISTORY) {
+        references.frames.erase(references.order.front());
+        references.order.pop_front();
+    }
+    // A frame id wrapping around replaces its stale entry
+    references.frames[frame.frameId] = std::move(plane);
+    references.order.push_back(frame.frameId);
+    return GST_PAD_PROBE_OK;
+}
+
+// Keeps the reference frames of a streaming pipeline, taken after the converter so they are the encoder's input
+inline void AttachReferenceCapture(GstElement *pipeline, ReferenceFrames *references) {
+    GstElement *vidconvIdent = gst_bin_get_by_name(GST_BIN(pipeline), "vidconv_ident");
+    if (vidconvIdent == nullptr) { return; }
+    GstPad *src = gst_element_get_static_pad(vidconvIdent, "src");
+    gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, OnReferenceFrame,
+                      new ReferenceCapture{GST_OBJECT_NAME(pipeline), references}, DestroyReferenceCapture);
+    gst_object_unref(src);
+    gst_object_unref(vidconvIdent);
+}
+
+struct FrameQuality {
+    uint16_t frameId;
+    double psnr, ssim;
+    double latencyMs; // capture on the sender to the decoded frame
+    double measureUs; // time spent on PSNR and SSIM
+};
+
+// False when the reference is gone or the frame doesn't match it, e.g. the frame id is unknown
+inline bool MeasureFrameQuality(ReferenceFrames &references, uint16_t frameId, const uint8_t *luma, int stride,
+                                int width, int height, FrameQuality &quality) {
+    const uint64_t beginUs = GetCurrentUs();
+    std::shared_ptr<const std::vector<uint8_t> > reference;
+    {
+        std::lock_guard<std::mutex> lock(references.mutex);
+        const auto it = references.frames.find(frameId);
+        if (it == references.frames.end() || width != references.width || height != references.height) {
+            return false;
+        }
+        reference = it->second;
+    }
+
+    quality.frameId = frameId;
+    quality.psnr = ComputePsnr(luma, stride, reference->data(), width, width, height);
+    quality.ssim = ComputeSsim(luma, stride, reference->data(), width, width, height);
+    quality.measureUs = static_cast<double>(GetCurrentUs() - beginUs);
+    return true;
+}
@@ -0,0 +1,121 @@
+//
+// Receiving side: depayloads and decodes a camera stream and hands the decoded frames to the application
+//
+// Frames are delivered straight from the appsink buffer, mapped for the duration of the callback and not copied.
+// Frame id and capture time come from the sender's metadata in the RTP header (see AddFrameMetadata).
+//
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include "jpeg_restart.h"
+#include "logging.h"
+#include "pipelines.h"
+
+struct DecodedFrame {
+    const std::string &camera;
+    bool matched; // frameId and captureUs come from the sender's metadata, both are 0 for a frame that has none
+    uint16_t frameId;
+    uint64_t captureUs; // on the sender's clock
+    uint64_t decodedUs; // when the frame reached the appsink
+    int width, height, stride;
+    bool planar; // I420 starting with the luma plane of `stride` bytes per row, RGBA otherwise
+    const uint8_t *data; // only valid during the callback
+    size_t size;
+};
+
+// Called on the pipeline's streaming thread, a slow callback makes the appsink drop frames rather than queue them
+using DecodedFrameCallback = void (*)(const DecodedFrame &frame, void *userData);
+
+struct FrameDelivery {
+    std::string camera;
+    std::string pipelineName;
+    DecodedFrameCallback callback;
+    void *userData;
+};
+
+inline void DestroyFrameDelivery(gpointer data) {
+    delete static_cast<FrameDelivery *>(data);
+}
+
+inline GstFlowReturn OnFrameSinkNewSample(GstAppSink *appsink, gpointer data) {
+    const auto &delivery = *static_cast<FrameDelivery *>(data);
+
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (sample == nullptr) { return GST_FLOW_EOS; }
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstCaps *caps = gst_sample_get_caps(sample);
+
+    int width = 0, height = 0;
+    bool planar = false;
+    if (caps != nullptr) {
+        const GstStructure *structure = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(structure, "width", &width);
+        gst_structure_get_int(structure, "height", &height);
+        const gchar *format = gst_structure_get_string(structure, "format");
+        planar = format != nullptr && std::string(format) == "I420";
+    }
+
+    GstMapInfo map;
+    if (buffer != nullptr && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        CapturedFrame frame{};
+        const bool matched = LookupCapturedFrame(delivery.pipelineName, GST_BUFFER_PTS(buffer), frame);
+        delivery.callback({delivery.camera, matched, frame.frameId, frame.captureUs, GetCurrentUs(), width, height,
+                           planar ? GST_ROUND_UP_4(width) : width * 4, planar, map.data, map.size}, delivery.userData);
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+// Connects the framesink appsink of a pipeline built with RECEIVER_APPSINK or RECEIVER_APPSINK_I420
+inline bool AttachFrameDelivery(GstElement *pipeline, const std::string &camera, DecodedFrameCallback callback, void *userData) {
+    GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "framesink");
+    if (appsink == nullptr) { return false; }
+
+    GstAppSinkCallbacks callbacks{};
+    callbacks.new_sample = OnFrameSinkNewSample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks,
+                               new FrameDelivery{camera, GST_OBJECT_NAME(pipeline), callback, userData}, DestroyFrameDelivery);
+    gst_object_unref(appsink);
+    return true;
+}
+
+// Receiving pipeline for one camera stream on `port`, named "receiver_<camera>", with the latency instrumentation
+// and, for JPEG with restart markers, the concealment of lost stripes
+inline GstElement *BuildReceivingPipeline(const StreamingConfig &streamingConfig, int port, const std::string &camera,
+                                          ReceiverSink sink) {
+    std::ostringstream oss;
+    switch (streamingConfig.codec) {
+        case JPEG: oss = GetJpegReceivingPipeline(streamingConfig, port, sink);
+            break;
+        case H264: oss = GetH264ReceivingPipeline(streamingConfig, port, sink);
+            break;
+        case H265: oss = GetH265ReceivingPipeline(streamingConfig, port, sink);
+            break;
+        default:
+            break;
+    }
+    const std::string pipelineStr = oss.str();
+    if (pipelineStr.empty()) {
+        throw std::runtime_error("Unsupported codec in this build");
+    }
+
+    GError *error = nullptr;
+    GstElement *pipeline = gst_parse_launch(pipelineStr.c_str(), &error);
+    if (error != nullptr) {
+        const std::string message = error->message;
+        g_clear_error(&error);
+        if (pipeline != nullptr) { gst_object_unref(pipeline); }
+        throw std::runtime_error("Cannot build the receiving pipeline: " + message);
+    }
+    gst_element_set_name(pipeline, ("receiver_" + camera).c_str());
+
+    AttachReceivingMetadata(pipeline);
+    AttachJpegConcealment(pipeline);
+    return pipeline;
+}
@@ -0,0 +1,290 @@
+//
+// On-robot recording branch, linked to the encoder tee of a running streaming pipeline
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include "logging.h"
+#include "pipelines.h"
+
+struct RecordingConfig {
+    std::string directory{"recordings"};
+    int segmentSeconds{60};
+    int maxDiskMb{4096}; // oldest segments are deleted once the recordings of a camera exceed this
+};
+
+// Segments are Matroska, a segment cut short by a crash or power loss stays playable
+struct Recording {
+    std::string pipelineName;
+    std::string prefix; // <directory>/<pipeline name>/, the segments are <prefix><timestamp>_<fragment>.mkv
+    uint64_t maxDiskBytes = 0;
+
+    GstElement *queue = nullptr, *parser = nullptr, *splitmux = nullptr;
+    GstPad *teePad = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable eosCondition;
+    bool eosReached = false;
+    std::atomic<bool> pipelineEos{false}; // the whole pipeline is being drained, the EOS has to reach the bus
+
+    std::atomic<uint64_t> queued{0}, frames{0}; // into the queue and out of it into the parser
+    double baselinePayloadStageUs = 0;
+};
+
+inline const char *GetRecordingParser(Codec codec) {
+    switch (codec) {
+        case JPEG: return "jpegparse";
+        case H264: return "h264parse";
+        case H265: return "h265parse";
+        default: return nullptr;
+    }
+}
+
+// Every camera records into its own subdirectory, no camera's budget can reach another camera's segments
+inline std::string GetRecordingPrefix(const std::string &directory, const std::string &pipelineName) {
+    return directory + "/" + pipelineName + "/";
+}
+
+// Only <name prefix><timestamp>_<fragment>.mkv, a camera named "front" must not match "front_wide_..."
+inline bool IsRecordingSegment(const std::string &name, const std::string &namePrefix) {
+    return name.size() > namePrefix.size() + 4 && name.compare(0, namePrefix.size(), namePrefix) == 0 &&
+           isdigit(static_cast<unsigned char>(name[namePrefix.size()])) && name.substr(name.size() - 4) == ".mkv";
+}
+
+// Keeps the recordings of one camera within the disk budget, the oldest segments go first. The timestamp in
+// the file names makes name order equal to age order.
+inline void PruneRecordings(const std::string &prefix, uint64_t maxDiskBytes) {
+    const auto slash = prefix.rfind('/');
+    const std::string directory = prefix.substr(0, slash);
+    const std::string namePrefix = prefix.substr(slash + 1);
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) { return; }
+
+    std::vector<std::pair<std::string, uint64_t> > segments;
+    uint64_t total = 0;
+    while (const dirent *entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (!IsRecordingSegment(name, namePrefix)) { continue; }
+
+        struct stat st{};
+        const std::string path = directory + "/" + name;
+        if (stat(path.c_str(), &st) == 0) {
+            segments.emplace_back(path, st.st_size);
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+
+    std::sort(segments.begin(), segments.end());
+    for (const auto &[path, size]: segments) {
+        if (total <= maxDiskBytes) { break; }
+        if (unlink(path.c_str()) == 0) {
+            std::cout << "Recording budget exceeded, deleted " << path << "\n";
+            total -= size;
+        }
+    }
+}
+
+// One overrun of the leaky queue can drop several frames, the drops are what went in and neither came out nor waits
+inline uint64_t GetRecordingDrops(Recording &recording) {
+    const uint64_t queued = recording.queued.load();
+    guint buffers = 0;
+    g_object_get(recording.queue, "current-level-buffers", &buffers, nullptr);
+    const uint64_t left = recording.frames.load() + buffers;
+    return queued > left ? queued - left : 0;
+}
+
+// Called by splitmuxsink on its own streaming thread whenever a new segment starts
+inline gchar *OnRecordingFormatLocation(GstElement *splitmux, guint fragmentId, GstSample *firstSample, gpointer data) {
+    auto &recording = *static_cast<Recording *>(data);
+
+    char timestamp[32];
+    const time_t now = time(nullptr);
+    struct tm local{};
+    localtime_r(&now, &local);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", &local);
+
+    const std::string location = recording.prefix + timestamp + "_" + std::to_string(fragmentId) + ".mkv";
+
+    // The budget leaves room for the segment about to be written, roughly the size of the previous one
+    PruneRecordings(recording.prefix, recording.maxDiskBytes);
+
+    std::cout << recording.pipelineName << " recording to " << location << ": " <<
+            recording.frames.load() << " frames, " << GetRecordingDrops(recording) << " dropped by the queue, " <<
+            "encoder to payloader " << GetStreamingStats(recording.pipelineName).payloadStageUs.load() << " us (" <<
+            recording.baselinePayloadStageUs << " us before recording)\n";
+    return g_strdup(location.c_str());
+}
+
+inline GstPadProbeReturn OnRecordingQueueProbe(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    static_cast<Recording *>(data)->queued++;
+    return GST_PAD_PROBE_OK;
+}
+
+inline GstPadProbeReturn OnRecordingParserProbe(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    static_cast<Recording *>(data)->frames++;
+    return GST_PAD_PROBE_OK;
+}
+
+// EOS leaving the muxer means the last segment is finalized
+inline GstPadProbeReturn OnRecordingEosProbe(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_EOS) { return GST_PAD_PROBE_OK; }
+
+    auto &recording = *static_cast<Recording *>(data);
+    {
+        std::lock_guard<std::mutex> lock(recording.mutex);
+        recording.eosReached = true;
+    }
+    recording.eosCondition.notify_all();
+    // Keep the EOS from reaching the pipeline, the live stream goes on. Unless the pipeline itself is draining.
+    return recording.pipelineEos.load() ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+}
+
+inline void DestroyRecording(gpointer data) {
+    delete static_cast<Recording *>(data);
+}
+
+inline bool IsRecording(GstElement *pipeline) {
+    return pipeline != nullptr && g_object_get_data(G_OBJECT(pipeline), "recording") != nullptr;
+}
+
+inline bool StartRecording(GstElement *pipeline, Codec codec, const RecordingConfig &recordingConfig) {
+    if (pipeline == nullptr || IsRecording(pipeline)) { return pipeline != nullptr; }
+
+    const char *parserName = GetRecordingParser(codec);
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), "enc_tee");
+    if (parserName == nullptr || tee == nullptr) {
+        std::cerr << "Cannot record this pipeline\n";
+        if (tee != nullptr) { gst_object_unref(tee); }
+        return false;
+    }
+
+    const std::string pipelineName = GST_OBJECT_NAME(pipeline);
+    const std::string prefix = GetRecordingPrefix(recordingConfig.directory, pipelineName);
+    if (g_mkdir_with_parents(prefix.c_str(), 0755) != 0) {
+        std::cerr << "Cannot create recording directory " << prefix << "\n";
+        gst_object_unref(tee);
+        return false;
+    }
+
+    auto *recording = new Recording();
+    recording->pipelineName = pipelineName;
+    recording->prefix = prefix;
+    recording->maxDiskBytes = static_cast<uint64_t>(recordingConfig.maxDiskMb) * 1024 * 1024;
+    recording->baselinePayloadStageUs = GetStreamingStats(recording->pipelineName).payloadStageUs.load();
+
+    // Up to two seconds of slow storage are absorbed, beyond that the branch drops frames instead of
+    // blocking the tee
+    recording->queue = gst_element_factory_make("queue", nullptr);
+    recording->parser = gst_element_factory_make(parserName, nullptr);
+    recording->splitmux = gst_element_factory_make("splitmuxsink", nullptr);
+    GstElement *muxer = gst_element_factory_make("matroskamux", nullptr);
+    GstElement *filesink = gst_element_factory_make("filesink", nullptr);
+    if (recording->queue == nullptr || recording->parser == nullptr || recording->splitmux == nullptr ||
+        muxer == nullptr || filesink == nullptr) {
+        std::cerr << "Missing GStreamer elements for recording\n";
+        for (auto element: {recording->queue, recording->parser, recording->splitmux, muxer, filesink}) {
+            if (element != nullptr) { gst_object_unref(element); }
+        }
+        delete recording;
+        gst_object_unref(tee);
+        return false;
+    }
+
+    g_object_set(recording->queue, "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0,
+                 "max-size-time", static_cast<guint64>(2 * GST_SECOND), nullptr);
+    g_object_set(filesink, "sync", FALSE, "async", FALSE, nullptr);
+    g_object_set(recording->splitmux, "max-size-time", static_cast<guint64>(recordingConfig.segmentSeconds) * GST_SECOND,
+                 "muxer", muxer, "sink", filesink, "async-handling", TRUE, nullptr);
+
+    g_signal_connect(recording->splitmux, "format-location-full", G_CALLBACK(OnRecordingFormatLocation), recording);
+
+    GstPad *parserSink = gst_element_get_static_pad(recording->parser, "sink");
+    gst_pad_add_probe(parserSink, GST_PAD_PROBE_TYPE_BUFFER, OnRecordingParserProbe, recording, nullptr);
+    gst_object_unref(parserSink);
+
+    GstPad *filesinkSink = gst_element_get_static_pad(filesink, "sink");
+    gst_pad_add_probe(filesinkSink, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, OnRecordingEosProbe, recording, nullptr);
+    gst_object_unref(filesinkSink);
+
+    gst_bin_add_many(GST_BIN(pipeline), recording->queue, recording->parser, recording->splitmux, nullptr);
+    gst_element_link_many(recording->queue, recording->parser, recording->splitmux, nullptr);
+    gst_element_sync_state_with_parent(recording->splitmux);
+    gst_element_sync_state_with_parent(recording->parser);
+    gst_element_sync_state_with_parent(recording->queue);
+
+    recording->teePad = gst_element_get_request_pad(tee, "src_%u");
+    GstPad *queueSink = gst_element_get_static_pad(recording->queue, "sink");
+    gst_pad_add_probe(queueSink, GST_PAD_PROBE_TYPE_BUFFER, OnRecordingQueueProbe, recording, nullptr);
+    gst_pad_link(recording->teePad, queueSink);
+    gst_object_unref(queueSink);
+    gst_object_unref(tee);
+
+    g_object_set_data_full(G_OBJECT(pipeline), "recording", recording, DestroyRecording);
+    std::cout << recording->pipelineName << " recording started in " << recording->prefix << "\n";
+    return true;
+}
+
+// Runs once the tee pad is idle, so no buffer is in flight while unlinking
+inline GstPadProbeReturn OnRecordingTeePadIdle(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    auto &recording = *static_cast<Recording *>(data);
+
+    GstPad *queueSink = gst_element_get_static_pad(recording.queue, "sink");
+    gst_pad_unlink(recording.teePad, queueSink);
+    gst_pad_send_event(queueSink, gst_event_new_eos());
+    gst_object_unref(queueSink);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// Call before sending EOS to the whole pipeline, the branch then finalizes its segment along with the rest
+inline void DrainRecordingWithPipeline(GstElement *pipeline) {
+    if (!IsRecording(pipeline)) { return; }
+    static_cast<Recording *>(g_object_get_data(G_OBJECT(pipeline), "recording"))->pipelineEos.store(true);
+}
+
+// Finalizes the current segment and removes the branch, the rest of the pipeline keeps streaming. The branch is
+// taken off the pipeline first, so a concurrent stop of the same pipeline finds nothing left to do.
+inline void StopRecording(GstElement *pipeline) {
+    if (pipeline == nullptr) { return; }
+    auto *stolen = static_cast<Recording *>(g_object_steal_data(G_OBJECT(pipeline), "recording"));
+    if (stolen == nullptr) { return; }
+    auto &recording = *stolen;
+
+    gst_pad_add_probe(recording.teePad, GST_PAD_PROBE_TYPE_IDLE, OnRecordingTeePadIdle, &recording, nullptr);
+
+    {
+        std::unique_lock<std::mutex> lock(recording.mutex);
+        if (!recording.eosCondition.wait_for(lock, std::chrono::seconds(5), [&recording] { return recording.eosReached; })) {
+            std::cerr << recording.pipelineName << " recording did not drain, last segment may be incomplete\n";
+        }
+    }
+
+    const uint64_t drops = GetRecordingDrops(recording);
+    for (auto element: {recording.queue, recording.parser, recording.splitmux}) {
+        gst_element_set_state(element, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), element);
+    }
+
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), "enc_tee");
+    gst_element_release_request_pad(tee, recording.teePad);
+    gst_object_unref(recording.teePad);
+    gst_object_unref(tee);
+
+    std::cout << recording.pipelineName << " recording stopped: " << recording.frames.load() << " frames, " <<
+            drops << " dropped by the queue\n";
+    DestroyRecording(stolen);
+}
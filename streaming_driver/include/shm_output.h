@@ -0,0 +1,139 @@
+//
+// Shared-memory output branches of the camera pipelines (see shm_ring.h for the ring itself). Every frame reaching
+// an appsink is copied into the ring once, the copy time is in the periodic stats line.
+//
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include "logging.h"
+#include "shm_ring.h"
+
+constexpr unsigned int SHM_STATS_INTERVAL = 300; // frames
+
+// Rings outlive the pipelines, so readers keep their mapping across config changes that rebuild a pipeline.
+// A ring is only recreated when its geometry has to change.
+inline std::mutex shmRingsMutex;
+inline std::map<std::string, std::shared_ptr<ShmRing> > shmRings;
+
+inline std::shared_ptr<ShmRing> GetShmRing(const std::string &name, uint32_t slotCount, uint32_t slotSize) {
+    std::lock_guard<std::mutex> lock(shmRingsMutex);
+    auto &ring = shmRings[name];
+    if (ring != nullptr && ring->header()->slotCount == slotCount && ring->header()->slotSize == slotSize) {
+        return ring;
+    }
+    if (ring != nullptr) {
+        DestroyShmRing(*ring);
+    }
+
+    ring = std::make_shared<ShmRing>();
+    if (!CreateShmRing(*ring, name, slotCount, slotSize)) {
+        std::cerr << "Cannot create shared-memory ring " << name << ": " << strerror(errno) << "\n";
+        ring = nullptr;
+    }
+    return ring;
+}
+
+inline void DestroyShmRings() {
+    std::lock_guard<std::mutex> lock(shmRingsMutex);
+    for (auto &[name, ring]: shmRings) {
+        if (ring != nullptr) {
+            DestroyShmRing(*ring);
+        }
+    }
+    shmRings.clear();
+}
+
+struct ShmOutput {
+    std::shared_ptr<ShmRing> ring;
+    ShmFrameKind kind = SHM_FRAME_RAW;
+    std::string pipelineName;
+
+    uint64_t statFrames = 0, statBytes = 0, statCopyUs = 0;
+};
+
+inline GstFlowReturn OnShmNewSample(GstAppSink *appsink, gpointer data) {
+    auto &output = *static_cast<ShmOutput *>(data);
+
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (sample == nullptr) { return GST_FLOW_EOS; }
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstCaps *caps = gst_sample_get_caps(sample);
+
+    int width = 0, height = 0;
+    std::string format;
+    if (caps != nullptr) {
+        const GstStructure *structure = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(structure, "width", &width);
+        gst_structure_get_int(structure, "height", &height);
+        const gchar *rawFormat = gst_structure_get_string(structure, "format");
+        format = output.kind == SHM_FRAME_RAW && rawFormat != nullptr ? rawFormat : gst_structure_get_name(structure);
+    }
+
+    GstMapInfo map;
+    if (buffer != nullptr && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        // Published with frame id and capture time 0 when the buffer cannot be matched to its capture
+        CapturedFrame frame{};
+        LookupCapturedFrame(output.pipelineName, GST_BUFFER_PTS(buffer), frame);
+
+        const auto copyBegin = GetCurrentUs();
+        WriteShmRing(*output.ring, map.data, static_cast<uint32_t>(map.size), frame.frameId, frame.captureUs,
+                     output.kind, width, height, format.c_str());
+        output.statCopyUs += GetCurrentUs() - copyBegin;
+        output.statBytes += map.size;
+        output.statFrames++;
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+
+    if (output.statFrames >= SHM_STATS_INTERVAL) {
+        std::cout << output.ring->name << ": " << output.statBytes / output.statFrames << " bytes/frame, " <<
+                static_cast<double>(output.statCopyUs) / output.statFrames << " us/frame copy\n";
+        output.statFrames = output.statBytes = output.statCopyUs = 0;
+    }
+    return GST_FLOW_OK;
+}
+
+inline void DestroyShmOutput(gpointer data) {
+    delete static_cast<ShmOutput *>(data);
+}
+
+inline bool AttachShmOutput(GstElement *pipeline, const char *sinkName, const std::string &ringName,
+                            ShmFrameKind kind, uint32_t slotCount, uint32_t slotSize) {
+    GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), sinkName);
+    if (appsink == nullptr) { return true; }
+
+    auto ring = GetShmRing(ringName, slotCount, slotSize);
+    if (ring == nullptr) {
+        gst_object_unref(appsink);
+        return false;
+    }
+
+    auto *output = new ShmOutput();
+    output->ring = ring;
+    output->kind = kind;
+    output->pipelineName = GST_OBJECT_NAME(pipeline);
+
+    GstAppSinkCallbacks callbacks{};
+    callbacks.new_sample = OnShmNewSample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, output, DestroyShmOutput);
+    gst_object_unref(appsink);
+
+    std::cout << "Publishing " << (kind == SHM_FRAME_RAW ? "raw" : "encoded") << " frames to " << ringName << "\n";
+    return true;
+}
+
+// Rings are named /telepresence_<camera>_raw and /telepresence_<camera>_encoded. A slot holds one NV12 frame,
+// encoded frames are far smaller than that.
+inline bool AttachShmOutputs(GstElement *pipeline, const std::string &camera, int width, int height, int slotCount) {
+    const auto slotSize = static_cast<uint32_t>(width * height * 3 / 2);
+    return AttachShmOutput(pipeline, "shm_raw_sink", "/telepresence_" + camera + "_raw", SHM_FRAME_RAW, slotCount, slotSize) &&
+           AttachShmOutput(pipeline, "shm_encoded_sink", "/telepresence_" + camera + "_encoded", SHM_FRAME_ENCODED, slotCount, slotSize);
+}
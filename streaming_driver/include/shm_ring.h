@@ -0,0 +1,231 @@
+//
+// Shared-memory frame ring for on-robot consumers (local recording, obstacle detection, diagnostics)
+//
+// The driver is the only writer. Readers map the ring read-only and never block it: every slot is guarded by a
+// sequence counter which is odd while the slot is being written, so a reader can tell whether the data it looked
+// at was overwritten in the meantime. This header has no GStreamer dependency, consumers can include it alone.
+//
+// Not zero-copy: the driver copies every frame from its GStreamer buffer into a slot, ~1 ms for a 1080p NV12 frame
+// (see shm_ring_bench). Readers can work on the slot in place (PeekLatestShmFrame) instead of copying it again.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr uint32_t SHM_RING_MAGIC = 0x54535352; // "TSSR"
+constexpr uint32_t SHM_RING_VERSION = 1;
+constexpr size_t SHM_RING_ALIGNMENT = 4096;
+
+enum ShmFrameKind : uint32_t {
+    SHM_FRAME_RAW = 0, SHM_FRAME_ENCODED = 1
+};
+
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotSize; // payload bytes per slot
+    std::atomic<uint64_t> writeCount; // frames written so far, the latest one is in slot (writeCount - 1) % slotCount
+};
+
+struct alignas(64) ShmSlotHeader {
+    std::atomic<uint64_t> sequence; // odd while the writer is inside the slot
+    uint64_t frameId;
+    uint64_t captureUs; // CLOCK_REALTIME, same clock as GetCurrentUs()
+    uint32_t size;
+    uint32_t kind;
+    int32_t width, height;
+    char format[16]; // "NV12", "I420", "image/jpeg", "video/x-h264", ...
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory ring needs lock-free 64-bit atomics");
+
+inline size_t GetShmSlotStride(uint32_t slotSize) {
+    const size_t stride = sizeof(ShmSlotHeader) + slotSize;
+    return (stride + SHM_RING_ALIGNMENT - 1) / SHM_RING_ALIGNMENT * SHM_RING_ALIGNMENT;
+}
+
+inline size_t GetShmRingSize(uint32_t slotCount, uint32_t slotSize) {
+    return SHM_RING_ALIGNMENT + slotCount * GetShmSlotStride(slotSize);
+}
+
+struct ShmRing {
+    std::string name;
+    int fd = -1;
+    uint8_t *base = nullptr;
+    size_t size = 0;
+
+    ShmRingHeader *header() const { return reinterpret_cast<ShmRingHeader *>(base); }
+
+    ShmSlotHeader *slot(uint64_t index) const {
+        return reinterpret_cast<ShmSlotHeader *>(base + SHM_RING_ALIGNMENT + index % header()->slotCount * GetShmSlotStride(header()->slotSize));
+    }
+
+    uint8_t *payload(ShmSlotHeader *slot) const { return reinterpret_cast<uint8_t *>(slot) + sizeof(ShmSlotHeader); }
+};
+
+inline void CloseShmRing(ShmRing &ring) {
+    if (ring.base != nullptr) {
+        munmap(ring.base, ring.size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    ring.base = nullptr;
+    ring.fd = -1;
+}
+
+// Writer side. Recreates the ring when it already exists, readers have to reopen it after a driver restart.
+inline bool CreateShmRing(ShmRing &ring, const std::string &name, uint32_t slotCount, uint32_t slotSize) {
+    ring.name = name;
+    ring.size = GetShmRingSize(slotCount, slotSize);
+
+    shm_unlink(name.c_str());
+    ring.fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (ring.fd < 0) { return false; }
+
+    if (ftruncate(ring.fd, static_cast<off_t>(ring.size)) != 0) {
+        CloseShmRing(ring);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void *base = mmap(nullptr, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+    if (base == MAP_FAILED) {
+        CloseShmRing(ring);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    ring.base = static_cast<uint8_t *>(base);
+
+    // ftruncate zero-fills, so the atomics start out as 0
+    auto *header = ring.header();
+    header->slotCount = slotCount;
+    header->slotSize = slotSize;
+    header->version = SHM_RING_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SHM_RING_MAGIC;
+    return true;
+}
+
+inline void DestroyShmRing(ShmRing &ring) {
+    CloseShmRing(ring);
+    shm_unlink(ring.name.c_str());
+}
+
+// Frames larger than a slot are truncated to the slot size (size in the slot header reflects the copied bytes)
+inline void WriteShmRing(ShmRing &ring, const uint8_t *data, uint32_t size, uint64_t frameId, uint64_t captureUs,
+                         ShmFrameKind kind, int width, int height, const char *format) {
+    auto *header = ring.header();
+    const uint64_t index = header->writeCount.load(std::memory_order_relaxed);
+    ShmSlotHeader *slot = ring.slot(index);
+
+    const uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->size = std::min(size, header->slotSize);
+    memcpy(ring.payload(slot), data, slot->size);
+    slot->frameId = frameId;
+    slot->captureUs = captureUs;
+    slot->kind = kind;
+    slot->width = width;
+    slot->height = height;
+    strncpy(slot->format, format, sizeof(slot->format) - 1);
+    slot->format[sizeof(slot->format) - 1] = '\0';
+
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+    header->writeCount.store(index + 1, std::memory_order_release);
+}
+
+// Reader side
+inline bool OpenShmRing(ShmRing &ring, const std::string &name) {
+    ring.name = name;
+    ring.fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (ring.fd < 0) { return false; }
+
+    struct stat st{};
+    if (fstat(ring.fd, &st) != 0 || st.st_size < static_cast<off_t>(SHM_RING_ALIGNMENT)) {
+        CloseShmRing(ring);
+        return false;
+    }
+    ring.size = st.st_size;
+
+    void *base = mmap(nullptr, ring.size, PROT_READ, MAP_SHARED, ring.fd, 0);
+    if (base == MAP_FAILED) {
+        CloseShmRing(ring);
+        return false;
+    }
+    ring.base = static_cast<uint8_t *>(base);
+
+    const auto *header = ring.header();
+    if (header->magic != SHM_RING_MAGIC || header->version != SHM_RING_VERSION ||
+        GetShmRingSize(header->slotCount, header->slotSize) > ring.size) {
+        CloseShmRing(ring);
+        return false;
+    }
+    return true;
+}
+
+// A frame as seen in place in the ring. `data` points into shared memory and is only valid for as long as
+// IsShmFrameValid() says so, i.e. check it again after processing.
+struct ShmFrameView {
+    const ShmSlotHeader *slot = nullptr;
+    uint64_t sequence = 0;
+    uint64_t index = 0; // position in the write order, for spotting skipped frames
+    const uint8_t *data = nullptr;
+    uint32_t size = 0;
+    uint64_t frameId = 0, captureUs = 0;
+    uint32_t kind = 0;
+    int width = 0, height = 0;
+    std::string format;
+};
+
+inline bool IsShmFrameValid(const ShmFrameView &view) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return view.slot != nullptr && view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
+
+// Maps the newest frame without copying it. Returns false when nothing was written yet, the newest frame is
+// being overwritten right now, or it is the one `lastIndex` already returned.
+inline bool PeekLatestShmFrame(const ShmRing &ring, ShmFrameView &view, uint64_t lastIndex = UINT64_MAX) {
+    const uint64_t count = ring.header()->writeCount.load(std::memory_order_acquire);
+    if (count == 0 || count - 1 == lastIndex) { return false; }
+
+    view.index = count - 1;
+    view.slot = ring.slot(view.index);
+    view.sequence = view.slot->sequence.load(std::memory_order_acquire);
+    if (view.sequence & 1) { return false; }
+
+    view.data = ring.payload(const_cast<ShmSlotHeader *>(view.slot));
+    view.size = view.slot->size;
+    view.frameId = view.slot->frameId;
+    view.captureUs = view.slot->captureUs;
+    view.kind = view.slot->kind;
+    view.width = view.slot->width;
+    view.height = view.slot->height;
+    view.format.assign(view.slot->format, strnlen(view.slot->format, sizeof(view.slot->format)));
+    return IsShmFrameValid(view);
+}
+
+// Copies the newest frame out of the ring, retrying when the writer laps the reader during the copy
+inline bool ReadLatestShmFrame(const ShmRing &ring, ShmFrameView &view, std::string &buffer, uint64_t lastIndex = UINT64_MAX) {
+    for (int attempt = 0; attempt < 4; attempt++) {
+        if (!PeekLatestShmFrame(ring, view, lastIndex)) { continue; }
+        buffer.assign(reinterpret_cast<const char *>(view.data), view.size);
+        if (IsShmFrameValid(view)) {
+            view.data = reinterpret_cast<const uint8_t *>(buffer.data());
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,273 @@
+//
+// Soak mode: churns the cameras with thousands of seeded, mixed live and structural updates and watches the
+// process for drift. Rebuild times, RSS, threads, open fds and live GstObjects are sampled over the run, the
+// samples after the warmup are compared with the ones at the end and any growth past its threshold fails the run.
+//
+// Live GstObjects are counted by the leaks tracer, which needs GStreamer 1.18 and EnableObjectTracking() before
+// gst_init. Without it the object check is skipped.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include "config.h"
+#include "json.hpp"
+
+constexpr int SOAK_SAMPLE_MS = 1000;
+
+// Starting point of the churn, streaming to the loopback interface
+inline const nlohmann::json SOAK_INITIAL_CONFIG = {
+    {"ip", "127.0.0.1"}, {"portLeft", DEFAULT_STREAMING_CONFIG.portLeft}, {"portRight", DEFAULT_STREAMING_CONFIG.portRight},
+    {"codec", "JPEG"}, {"encodingQuality", 85}, {"bitrate", 4'000'000}, {"horizontalResolution", 1280},
+    {"verticalResolution", 720}, {"videoMode", "stereo"}, {"fps", 30}
+};
+
+struct SoakThresholds {
+    double rssGrowthMb = 64;
+    int threadGrowth = 4;
+    int fdGrowth = 16;
+    int objectGrowth = 200;
+    double rebuildP95Ratio = 1.5; // the last third of the rebuilds against the first
+    double rebuildSlackMs = 20; // absolute margin on top of the ratio, short rebuilds are noisy
+};
+
+inline SoakThresholds SoakThresholdsFromJson(const nlohmann::json &c) {
+    SoakThresholds out{};
+    out.rssGrowthMb = c.value("rss_growth_mb", out.rssGrowthMb);
+    out.threadGrowth = c.value("thread_growth", out.threadGrowth);
+    out.fdGrowth = c.value("fd_growth", out.fdGrowth);
+    out.objectGrowth = c.value("object_growth", out.objectGrowth);
+    out.rebuildP95Ratio = c.value("rebuild_p95_ratio", out.rebuildP95Ratio);
+    out.rebuildSlackMs = c.value("rebuild_slack_ms", out.rebuildSlackMs);
+    if (out.rssGrowthMb <= 0 || out.threadGrowth < 0 || out.fdGrowth < 0 || out.objectGrowth < 0 ||
+        out.rebuildP95Ratio < 1 || out.rebuildSlackMs < 0) {
+        throw std::invalid_argument("Invalid soak threshold passed!");
+    }
+    return out;
+}
+
+struct SoakSample {
+    double elapsedS;
+    uint64_t updates, rebuilds;
+    long rssKb;
+    int threads, fds;
+    long liveObjects; // -1 without the leaks tracer
+};
+
+// Filled by the soak loop and, for the rebuilds, by the camera workers
+struct SoakRecorder {
+    std::mutex mutex;
+    std::vector<double> rebuildMs; // in the order the pipelines reached PLAYING
+    std::vector<SoakSample> samples;
+};
+
+inline void RecordSoakRebuild(SoakRecorder &recorder, double ms) {
+    std::lock_guard<std::mutex> lock(recorder.mutex);
+    recorder.rebuildMs.push_back(ms);
+}
+
+// Field of /proc/self/status such as "VmRSS:" or "Threads:", -1 when missing
+inline long GetProcStatusValue(const std::string &field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, field.size(), field) == 0) {
+            return std::strtol(line.c_str() + field.size(), nullptr, 10);
+        }
+    }
+    return -1;
+}
+
+inline int GetOpenFdCount() {
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == nullptr) { return -1; }
+    int count = 0;
+    while (readdir(dir) != nullptr) {
+        count++;
+    }
+    closedir(dir);
+    return count - 3; // ".", ".." and the one of opendir itself
+}
+
+// Has to run before gst_init, a GST_TRACERS set by the user wins
+inline void EnableObjectTracking() {
+    setenv("GST_TRACERS", "leaks(filters=GstObject)", 0);
+}
+
+inline long GetLiveObjectCount() {
+#if GST_CHECK_VERSION(1, 18, 0)
+    long count = -1;
+    GList *tracers = gst_tracing_get_active_tracers();
+    for (GList *tracer = tracers; tracer != nullptr; tracer = tracer->next) {
+        if (std::string(G_OBJECT_TYPE_NAME(tracer->data)) != "GstLeaksTracer") { continue; }
+        GstStructure *info = nullptr;
+        g_signal_emit_by_name(tracer->data, "get-live-objects", &info);
+        if (info != nullptr) {
+            count = static_cast<long>(gst_value_list_get_size(gst_structure_get_value(info, "live-objects-list")));
+            gst_structure_free(info);
+        }
+        break;
+    }
+    g_list_free_full(tracers, gst_object_unref);
+    return count;
+#else
+    return -1;
+#endif
+}
+
+inline SoakSample TakeSoakSample(SoakRecorder &recorder, double elapsedS, uint64_t updates) {
+    SoakSample sample{elapsedS, updates, 0, GetProcStatusValue("VmRSS:"), static_cast<int>(GetProcStatusValue("Threads:")),
+                      GetOpenFdCount(), GetLiveObjectCount()};
+    std::lock_guard<std::mutex> lock(recorder.mutex);
+    sample.rebuilds = recorder.rebuildMs.size();
+    recorder.samples.push_back(sample);
+    return sample;
+}
+
+// In [0, count), computed by hand like DrawUniform in impairment.h, the std distributions differ between standard
+// libraries and a seed has to replay the same churn everywhere
+inline size_t DrawSoakIndex(std::mt19937 &rng, size_t count) {
+    return static_cast<size_t>(rng() / 4294967296.0 * count);
+}
+
+// The next update of the churn, applied onto `config`. Most change a live-settable field, about a third need a
+// rebuild. Some target a single camera so that the cameras drift apart. Only the software codecs are drawn.
+inline nlohmann::json GetSoakUpdate(std::mt19937 &rng, nlohmann::json &config, int cameraCount) {
+    const auto pick = [&rng](const auto &values) {
+        return values[DrawSoakIndex(rng, values.size())];
+    };
+    const std::vector<int> bitrates{1'000'000, 2'000'000, 4'000'000, 8'000'000}, mtus{1000, 1200, 1400}, portOffsets{0, 10};
+    const std::vector<std::string> codecs{"JPEG", "H264", "H265"};
+    const std::vector<std::pair<int, int> > resolutions{{640, 480}, {1280, 720}, {1920, 1080}};
+    const std::vector<int> fps{15, 30, 60};
+
+    const bool structural = DrawSoakIndex(rng, 3) == 0;
+    const size_t field = DrawSoakIndex(rng, 4);
+    if (!structural) {
+        switch (field) {
+            case 0: config["bitrate"] = pick(bitrates);
+                break;
+            case 1: config["encodingQuality"] = 50 + static_cast<int>(DrawSoakIndex(rng, 46));
+                break;
+            case 2: config["mtu"] = pick(mtus);
+                break;
+            default: {
+                const int offset = pick(portOffsets);
+                config["portLeft"] = DEFAULT_STREAMING_CONFIG.portLeft + offset;
+                config["portRight"] = DEFAULT_STREAMING_CONFIG.portRight + offset;
+                break;
+            }
+        }
+    } else {
+        switch (field) {
+            case 0: config["codec"] = pick(codecs);
+                break;
+            case 1: {
+                const auto [width, height] = pick(resolutions);
+                config["horizontalResolution"] = width;
+                config["verticalResolution"] = height;
+                break;
+            }
+            case 2: config["fps"] = pick(fps);
+                break;
+            default: config["stageQueues"] = config.value("stageQueues", nlohmann::json::array()).empty()
+                                                 ? nlohmann::json::array({"encode"})
+                                                 : nlohmann::json::array();
+                break;
+        }
+    }
+
+    nlohmann::json msg = {{"cmd", "update"}, {"config", config}};
+    if (cameraCount > 1 && DrawSoakIndex(rng, 4) == 0) {
+        msg["camera"] = static_cast<int>(DrawSoakIndex(rng, cameraCount));
+    }
+    return msg;
+}
+
+inline double GetMedian(std::vector<double> values) {
+    if (values.empty()) { return 0; }
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+inline double GetP95(std::vector<double> values) {
+    if (values.empty()) { return 0; }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, values.size() * 95 / 100)];
+}
+
+// Compares the median of the samples right after the warmup (10-30 % of the run) with the last 20 %, and the p95
+// of the first and last third of the rebuilds. Too short a run skips the checks instead of passing them.
+inline nlohmann::json CheckSoakDrift(SoakRecorder &recorder, const SoakThresholds &thresholds, bool &passed) {
+    std::lock_guard<std::mutex> lock(recorder.mutex);
+    const auto &samples = recorder.samples;
+    nlohmann::json checks = nlohmann::json::array();
+    passed = true;
+
+    const auto addCheck = [&](const std::string &metric, double baseline, double final, double limit) {
+        const bool ok = final <= limit;
+        passed = passed && ok;
+        checks.push_back({{"metric", metric}, {"baseline", baseline}, {"final", final}, {"limit", limit}, {"ok", ok}});
+        std::cout << "Soak " << metric << ": " << baseline << " -> " << final << " (limit " << limit << ") " <<
+                (ok ? "ok" : "DRIFTED") << "\n";
+    };
+
+    if (samples.size() >= 10) {
+        const size_t n = samples.size();
+        const auto medianOf = [&](size_t from, size_t to, auto value) {
+            std::vector<double> values;
+            for (size_t i = from; i < to; i++) {
+                values.push_back(value(samples[i]));
+            }
+            return GetMedian(values);
+        };
+        const auto check = [&](const std::string &metric, auto value, double growth) {
+            const double baseline = medianOf(n / 10, std::max(n * 3 / 10, n / 10 + 1), value);
+            addCheck(metric, baseline, medianOf(n - n / 5, n, value), baseline + growth);
+        };
+        check("rss_mb", [](const SoakSample &s) { return s.rssKb / 1024.0; }, thresholds.rssGrowthMb);
+        check("threads", [](const SoakSample &s) { return s.threads; }, thresholds.threadGrowth);
+        check("fds", [](const SoakSample &s) { return s.fds; }, thresholds.fdGrowth);
+        if (samples.back().liveObjects >= 0) {
+            check("live_objects", [](const SoakSample &s) { return s.liveObjects; }, thresholds.objectGrowth);
+        } else {
+            std::cout << "Soak live_objects: not available, needs GStreamer 1.18 with the leaks tracer\n";
+        }
+    } else {
+        std::cout << "Soak too short for the memory checks, " << samples.size() << " samples\n";
+    }
+
+    const auto &rebuilds = recorder.rebuildMs;
+    if (rebuilds.size() >= 30) {
+        const size_t third = rebuilds.size() / 3;
+        const double first = GetP95({rebuilds.begin(), rebuilds.begin() + third});
+        addCheck("rebuild_p95_ms", first, GetP95({rebuilds.end() - third, rebuilds.end()}),
+                 first * thresholds.rebuildP95Ratio + thresholds.rebuildSlackMs);
+    } else {
+        std::cout << "Soak too short for the rebuild check, " << rebuilds.size() << " rebuilds\n";
+    }
+    return checks;
+}
+
+inline nlohmann::json GetSoakReport(SoakRecorder &recorder, const nlohmann::json &checks, bool passed, uint32_t seed) {
+    std::lock_guard<std::mutex> lock(recorder.mutex);
+    nlohmann::json samples = nlohmann::json::array();
+    for (const auto &s: recorder.samples) {
+        samples.push_back({{"elapsed_s", s.elapsedS}, {"updates", s.updates}, {"rebuilds", s.rebuilds},
+                           {"rss_kb", s.rssKb}, {"threads", s.threads}, {"fds", s.fds}, {"live_objects", s.liveObjects}});
+    }
+    const auto &rebuilds = recorder.rebuildMs;
+    return {{"seed", seed}, {"passed", passed}, {"checks", checks}, {"samples", samples},
+            {"rebuilds", {{"count", rebuilds.size()}, {"p50_ms", GetMedian(rebuilds)}, {"p95_ms", GetP95(rebuilds)},
+                          {"max_ms", rebuilds.empty() ? 0 : *std::max_element(rebuilds.begin(), rebuilds.end())},
+                          {"ms", rebuilds}}}};
+}
@@ -0,0 +1,138 @@
+//
+// Depth and drop counters of the queues between the streaming stages (see GetStageQueue in pipelines.h)
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <gst/gst.h>
+#include "events.h"
+#include "logging.h"
+
+constexpr std::chrono::seconds STAGE_REPORT_INTERVAL{5};
+inline const char *STAGE_QUEUE_NAMES[] = {"capture_queue", "convert_queue", "encode_queue"};
+
+// Frames entering and leaving a stage queue, the difference not queued any more was dropped
+struct StageQueueCounters {
+    std::atomic<uint64_t> in{0}, out{0};
+};
+
+struct StageReport {
+    uint64_t frames = 0;
+    std::chrono::steady_clock::time_point at = std::chrono::steady_clock::now();
+};
+
+inline void DestroyStageQueueCounters(gpointer data) {
+    delete static_cast<StageQueueCounters *>(data);
+}
+
+inline void DestroyStageReport(gpointer data) {
+    delete static_cast<StageReport *>(data);
+}
+
+inline GstPadProbeReturn OnStageQueueIn(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    static_cast<StageQueueCounters *>(data)->in++;
+    return GST_PAD_PROBE_OK;
+}
+
+inline GstPadProbeReturn OnStageQueueOut(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    static_cast<StageQueueCounters *>(data)->out++;
+    return GST_PAD_PROBE_OK;
+}
+
+// A leaky queue leaks until it is below its bound again, one overrun can drop several frames, e.g. after a
+// stalled stage resumes or a lowered max-size-time. So the drops are counted from the frames in and out instead.
+// A frame just being handed in or out may put a single report off by one, it does not accumulate.
+inline uint64_t GetStageQueueDrops(GstElement *queue, const StageQueueCounters &counters, guint &buffers, guint64 &time) {
+    const uint64_t in = counters.in.load();
+    g_object_get(queue, "current-level-buffers", &buffers, "current-level-time", &time, nullptr);
+    const uint64_t left = counters.out.load() + buffers;
+    return in > left ? in - left : 0;
+}
+
+inline void AttachStageQueueCounters(GstElement *pipeline) {
+    for (const char *name: STAGE_QUEUE_NAMES) {
+        GstElement *queue = gst_bin_get_by_name(GST_BIN(pipeline), name);
+        if (queue == nullptr) { continue; }
+
+        auto *counters = new StageQueueCounters();
+        g_object_set_data_full(G_OBJECT(queue), "counters", counters, DestroyStageQueueCounters);
+        GstPad *sink = gst_element_get_static_pad(queue, "sink");
+        gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, OnStageQueueIn, counters, nullptr);
+        gst_object_unref(sink);
+        GstPad *src = gst_element_get_static_pad(queue, "src");
+        gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, OnStageQueueOut, counters, nullptr);
+        gst_object_unref(src);
+        gst_object_unref(queue);
+    }
+}
+
+// One line per camera with throughput and capture to payload latency, so single-threaded and pipelined runs
+// can be compared, followed by the state of every stage queue
+inline void ReportStageQueues(GstElement *pipeline) {
+    auto *report = static_cast<StageReport *>(g_object_get_data(G_OBJECT(pipeline), "stage-report"));
+    if (report == nullptr) { return; }
+
+    const std::string pipelineName = GST_OBJECT_NAME(pipeline);
+    const auto now = std::chrono::steady_clock::now();
+    const StreamingStats &frameStats = GetStreamingStats(pipelineName);
+    const uint64_t frames = frameStats.framesPayloaded.load();
+    const double captureToPayloadUs = frameStats.captureToPayloadUs.load();
+    const double seconds = std::chrono::duration<double>(now - report->at).count();
+    const double fps = (frames - report->frames) / seconds;
+
+    std::ostringstream oss;
+    oss << pipelineName << " stages: " << fps << " frames/s, " << captureToPayloadUs << " us capture to payload";
+    nlohmann::json stats = {{"fps", fps}, {"capture_to_payload_us", captureToPayloadUs},
+                            {"frames", frames}, {"queues", nlohmann::json::object()}};
+    report->frames = frames;
+    report->at = now;
+
+    for (const char *name: STAGE_QUEUE_NAMES) {
+        GstElement *queue = gst_bin_get_by_name(GST_BIN(pipeline), name);
+        if (queue == nullptr) { continue; }
+
+        guint buffers = 0;
+        guint64 time = 0;
+        const auto *counters = static_cast<StageQueueCounters *>(g_object_get_data(G_OBJECT(queue), "counters"));
+        uint64_t drops = 0;
+        if (counters != nullptr) {
+            drops = GetStageQueueDrops(queue, *counters, buffers, time);
+        } else {
+            g_object_get(queue, "current-level-buffers", &buffers, "current-level-time", &time, nullptr);
+        }
+        oss << ", " << name << ": " << buffers << " frames / " << time / 1'000'000 << " ms queued, " << drops << " dropped";
+        stats["queues"][name] = {{"frames", buffers}, {"ms", time / 1'000'000}, {"dropped", drops}};
+        gst_object_unref(queue);
+    }
+
+    std::cout << oss.str() << "\n";
+    EmitEvent("stats", GetCameraFromPipelineName(pipelineName), stats);
+}
+
+// Reports from the payloader's streaming thread, an idle camera thread stays asleep
+inline GstPadProbeReturn OnPayloaderProbeStageReport(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    auto *pipeline = static_cast<GstElement *>(data);
+    const auto *report = static_cast<StageReport *>(g_object_get_data(G_OBJECT(pipeline), "stage-report"));
+    if (report != nullptr && std::chrono::steady_clock::now() >= report->at + STAGE_REPORT_INTERVAL) {
+        ReportStageQueues(pipeline);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+inline void AttachStageReport(GstElement *pipeline) {
+    auto *report = new StageReport();
+    report->frames = GetStreamingStats(GST_OBJECT_NAME(pipeline)).framesPayloaded.load();
+    g_object_set_data_full(G_OBJECT(pipeline), "stage-report", report, DestroyStageReport);
+
+    GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), "payloader");
+    if (payloader == nullptr) { return; }
+    GstPad *payloader_src = gst_element_get_static_pad(payloader, "src");
+    gst_pad_add_probe(payloader_src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      OnPayloaderProbeStageReport, pipeline, nullptr);
+    gst_object_unref(payloader_src);
+    gst_object_unref(payloader);
+}
@@ -0,0 +1,97 @@
+//
+// Standby of the cameras: CPU used while waiting for a config, cold-start time to the first packet, and the
+// first-packet signal confirming a config change
+//
+#pragma once
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <gst/gst.h>
+#include "events.h"
+#include "logging.h"
+#include "wakeup.h"
+
+// A camera in standby has no thread of its own, its CPU is what the workers spend servicing it (cpuNs)
+struct StandbyMeter {
+    uint64_t beginUs = GetCurrentUs();
+    uint64_t cpuNs = 0;
+};
+
+inline void ReportStandby(const StandbyMeter &meter, const std::string &camera) {
+    const uint64_t wallUs = GetCurrentUs() - meter.beginUs;
+    const uint64_t cpuUs = meter.cpuNs / 1000;
+    const double corePercent = wallUs ? 100.0 * cpuUs / wallUs : 0.0;
+    std::cout << "Camera " << camera << " left standby after " << wallUs / 1000 << " ms, " << cpuUs <<
+            " us CPU (" << corePercent << " % of a core)\n";
+    EmitEvent("standby_left", camera, {{"standby_ms", wallUs / 1000}, {"cpu_us", cpuUs}, {"core_percent", corePercent}});
+}
+
+struct FirstPacketReport {
+    uint64_t startUs;
+    std::string since;
+};
+
+inline void DestroyFirstPacketReport(gpointer data) {
+    delete static_cast<FirstPacketReport *>(data);
+}
+
+inline GstPadProbeReturn OnPayloaderProbeFirstPacket(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    const auto &report = *static_cast<FirstPacketReport *>(data);
+    const std::string pipelineName = GST_OBJECT_NAME(GST_OBJECT_PARENT(GST_OBJECT_PARENT(pad)));
+    const double ms = (GetCurrentUs() - report.startUs) / 1000.0;
+    std::cout << pipelineName << ": first packet " << ms << " ms after " << report.since << "\n";
+    EmitEvent("first_frame", GetCameraFromPipelineName(pipelineName), {{"ms", ms}, {"since", report.since}});
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// Logs once, when the payloader pushes its first packet
+inline void AttachFirstPacketReport(GstElement *pipeline, uint64_t startUs, const std::string &since) {
+    GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), "payloader");
+    if (payloader == nullptr) { return; }
+
+    GstPad *payloader_src = gst_element_get_static_pad(payloader, "src");
+    gst_pad_add_probe(payloader_src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      OnPayloaderProbeFirstPacket, new FirstPacketReport{startUs, since}, DestroyFirstPacketReport);
+    gst_object_unref(payloader_src);
+    gst_object_unref(payloader);
+}
+
+struct FirstPacketSignal {
+    std::atomic<uint64_t> *packetUs;
+    int wakeup;
+    GstClockTime afterPts; // packets of frames up to this PTS are still from before the change, NONE takes any
+};
+
+inline void DestroyFirstPacketSignal(gpointer data) {
+    delete static_cast<FirstPacketSignal *>(data);
+}
+
+inline GstPadProbeReturn OnPayloaderProbeFirstPacketSignal(GstPad *, GstPadProbeInfo *info, gpointer data) {
+    const auto &signal = *static_cast<FirstPacketSignal *>(data);
+    if (GST_CLOCK_TIME_IS_VALID(signal.afterPts)) {
+        GstBuffer *buffer = (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+                                ? gst_buffer_list_get(GST_PAD_PROBE_INFO_BUFFER_LIST(info), 0)
+                                : GST_PAD_PROBE_INFO_BUFFER(info);
+        if (buffer == nullptr || !GST_BUFFER_PTS_IS_VALID(buffer) || GST_BUFFER_PTS(buffer) <= signal.afterPts) {
+            return GST_PAD_PROBE_OK;
+        }
+    }
+    signal.packetUs->store(GetCurrentUs());
+    Wake(signal.wakeup);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// Stores the time of the next packet the payloader pushes and wakes the camera, for confirming a config change.
+// With `afterPts` only a frame captured after it counts, packets already in flight are skipped.
+inline void AttachFirstPacketSignal(GstElement *pipeline, std::atomic<uint64_t> *packetUs, int wakeup,
+                                    GstClockTime afterPts = GST_CLOCK_TIME_NONE) {
+    GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), "payloader");
+    if (payloader == nullptr) { return; }
+
+    GstPad *payloader_src = gst_element_get_static_pad(payloader, "src");
+    gst_pad_add_probe(payloader_src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      OnPayloaderProbeFirstPacketSignal, new FirstPacketSignal{packetUs, wakeup, afterPts}, DestroyFirstPacketSignal);
+    gst_object_unref(payloader_src);
+    gst_object_unref(payloader);
+}
@@ -0,0 +1,113 @@
+//
+// Startup timeline from process start to the first packet of each camera, and plugin preloading to shorten it
+//
+// Every stage is marked once per process (and camera), rebuilds later on are not part of the startup.
+//
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <gst/gst.h>
+#include "events.h"
+#include "logging.h"
+
+inline uint64_t startupBeginUs = 0;
+inline std::mutex startupMutex;
+inline std::set<std::string> startupMarked; // "<camera>/<stage>"
+
+inline void BeginStartupTimeline() {
+    startupBeginUs = GetCurrentUs();
+}
+
+inline bool IsStartupMarked(const std::string &stage, const std::string &camera) {
+    std::lock_guard<std::mutex> lock(startupMutex);
+    return startupMarked.count(camera + "/" + stage) != 0;
+}
+
+inline void MarkStartup(const std::string &stage, const std::string &camera = "") {
+    {
+        std::lock_guard<std::mutex> lock(startupMutex);
+        if (!startupMarked.insert(camera + "/" + stage).second) { return; }
+    }
+    const double ms = (GetCurrentUs() - startupBeginUs) / 1000.0;
+    std::cout << "Startup +" << ms << " ms: " << stage << (camera.empty() ? "" : " (" + camera + ")") << "\n";
+    EmitEvent("startup", camera, {{"stage", stage}, {"ms", ms}});
+}
+
+struct StartupProbe {
+    std::string stage;
+    std::string camera;
+};
+
+inline void DestroyStartupProbe(gpointer data) {
+    delete static_cast<StartupProbe *>(data);
+}
+
+inline GstPadProbeReturn OnStartupProbe(GstPad *, GstPadProbeInfo *, gpointer data) {
+    const auto &probe = *static_cast<StartupProbe *>(data);
+    MarkStartup(probe.stage, probe.camera);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// The stage identities and the payloader, in the order a frame passes them
+inline const std::pair<const char *, const char *> STARTUP_STAGES[] = {
+    {"camsrc_ident", "first captured frame"},
+    {"vidconv_ident", "first converted frame"},
+    {"enc_ident", "first encoded frame"},
+    {"payloader", "first packet"},
+};
+
+// Marks the first buffer leaving each stage, only for a camera that has not streamed yet
+inline void AttachStartupProbes(GstElement *pipeline, const std::string &camera) {
+    if (IsStartupMarked("first packet", camera)) { return; }
+
+    for (const auto &[elementName, stage]: STARTUP_STAGES) {
+        GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), elementName);
+        if (element == nullptr) { continue; }
+        GstPad *src = gst_element_get_static_pad(element, "src");
+        gst_pad_add_probe(src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          OnStartupProbe, new StartupProbe{stage, camera}, DestroyStartupProbe);
+        gst_object_unref(src);
+        gst_object_unref(element);
+    }
+}
+
+// Every element the streaming pipelines can contain, see pipelines.h
+inline const char *STREAMING_ELEMENTS[] = {
+#ifdef JETSON
+    "nvarguscamerasrc", "nvvidconv", "nvjpegenc", "nvv4l2h264enc", "nvv4l2h265enc",
+#else
+    "videotestsrc", "clockoverlay", "videoflip", "videoconvert", "jpegenc", "openh264enc", "h264parse", "x265enc",
+    "h265parse",
+#endif
+    "capsfilter", "identity", "queue", "tee", "rtpjpegpay", "rtph264pay", "rtph265pay", "udpsink", "appsink",
+};
+
+// Loads the plugins before the first config arrives, the first gst_parse_launch otherwise pays for opening the
+// plugin libraries (and on the Jetson the Argus and multimedia libraries behind them)
+inline void PreloadStreamingPlugins() {
+    for (const char *name: STREAMING_ELEMENTS) {
+        GstElementFactory *factory = gst_element_factory_find(name);
+        if (factory == nullptr) {
+            std::cerr << "Cannot preload " << name << ", element not found\n";
+            continue;
+        }
+        GstPluginFeature *loaded = gst_plugin_feature_load(GST_PLUGIN_FEATURE(factory));
+        if (loaded != nullptr) {
+            gst_object_unref(loaded);
+        }
+        gst_object_unref(factory);
+    }
+    MarkStartup("plugins preloaded");
+}
+
+// With a registry cache present, GStreamer otherwise stats every plugin file on each start to see whether it changed.
+// Installing plugins needs one run with --registry-update (or any other GStreamer tool, e.g. gst-inspect-1.0) to be
+// picked up. Has to be called before gst_init().
+inline void DisableRegistryRescan() {
+    setenv("GST_REGISTRY_UPDATE", "no", 0);
+}
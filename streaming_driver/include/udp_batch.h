@@ -0,0 +1,325 @@
+//
+// Batched UDP sending for the streaming pipelines (alternative to udpsink)
+//
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include "logging.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+constexpr unsigned int UDP_BATCH_MAX_PACKETS = 1024;
+constexpr unsigned int UDP_GSO_MAX_SEGMENTS = 64;
+constexpr size_t UDP_GSO_MAX_BYTES = 65000;
+constexpr unsigned int UDP_BATCH_STATS_INTERVAL = 300; // frames
+
+// Collects the RTP packets of one frame (or one buffer list) and sends them with a single sendmmsg() call.
+// Runs of equally sized packets are additionally merged into one UDP GSO message when the kernel supports
+// UDP_SEGMENT. Falls back to sendmmsg() without GSO, and to one send() per packet without sendmmsg().
+struct UdpBatchSender {
+    std::string name;
+    int fd = -1;
+    int family = AF_UNSPEC;
+    bool gsoSupported = false;
+    bool mmsgSupported = true;
+    bool gatherFrames = true; // false when the packets are paced, they must leave as soon as they arrive
+
+    std::vector<GstBuffer *> pending;
+
+    uint64_t statFrames = 0, statPackets = 0, statSyscalls = 0, statCpuNs = 0, statErrors = 0;
+};
+
+inline bool OpenUdpBatchSender(UdpBatchSender &sender, const std::string &host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *result = nullptr;
+
+    const int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+    if (rc != 0) {
+        std::cerr << "Cannot resolve " << host << ": " << gai_strerror(rc) << "\n";
+        return false;
+    }
+
+    for (addrinfo *ai = result; ai != nullptr; ai = ai->ai_next) {
+        const int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) { continue; }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            sender.fd = fd;
+            sender.family = ai->ai_family;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(result);
+
+    if (sender.fd < 0) {
+        std::cerr << "Cannot open UDP socket to " << host << ":" << port << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    // Reading UDP_SEGMENT back fails on kernels without UDP GSO (< 4.18)
+    int segment = 0;
+    socklen_t len = sizeof(segment);
+    sender.gsoSupported = getsockopt(sender.fd, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+
+    std::cout << sender.name << " batch sender: GSO " << (sender.gsoSupported ? "supported" : "unavailable") << "\n";
+    return true;
+}
+
+inline bool IsRtpMarkerSet(GstBuffer *buffer) {
+    bool marker = false;
+    GstRTPBuffer rtp_buf = GST_RTP_BUFFER_INIT;
+    if (gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp_buf)) {
+        marker = gst_rtp_buffer_get_marker(&rtp_buf);
+        gst_rtp_buffer_unmap(&rtp_buf);
+    }
+    return marker;
+}
+
+// Sends the messages one by one, used when sendmmsg() isn't available
+inline unsigned int SendMessagesSequentially(UdpBatchSender &sender, mmsghdr *msgs, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        sender.statSyscalls++;
+        if (sendmsg(sender.fd, &msgs[i].msg_hdr, 0) < 0) {
+            if (sender.gsoSupported && (errno == EIO || errno == EINVAL)) { return i; }
+            if (errno != ECONNREFUSED) { sender.statErrors++; }
+        }
+    }
+    return count;
+}
+
+// Returns the index of the first message refused because of GSO, count when everything went out
+inline unsigned int SendMessages(UdpBatchSender &sender, mmsghdr *msgs, unsigned int count) {
+    unsigned int sent = 0;
+    while (sender.mmsgSupported && sent < count) {
+        sender.statSyscalls++;
+        const int rc = sendmmsg(sender.fd, msgs + sent, count - sent, 0);
+        if (rc > 0) {
+            sent += rc;
+            continue;
+        }
+        if (errno == ENOSYS) {
+            std::cerr << sender.name << " batch sender: sendmmsg unavailable, sending packet by packet\n";
+            sender.mmsgSupported = false;
+            break;
+        }
+        if (sender.gsoSupported && (errno == EIO || errno == EINVAL)) { return sent; }
+        // Nobody listening (ICMP port unreachable) or a transient error, drop the message like udpsink does
+        if (errno != ECONNREFUSED) { sender.statErrors++; }
+        sent++;
+    }
+
+    if (sent < count) {
+        return sent + SendMessagesSequentially(sender, msgs + sent, count - sent);
+    }
+    return count;
+}
+
+inline void FlushUdpBatchSender(UdpBatchSender &sender) {
+    if (sender.pending.empty()) { return; }
+    const uint64_t cpuStart = GetThreadCpuNs();
+    const size_t packets = sender.pending.size();
+
+    std::vector<GstMapInfo> maps(packets);
+    std::vector<iovec> iovs(packets);
+    for (size_t i = 0; i < packets; i++) {
+        if (!gst_buffer_map(sender.pending[i], &maps[i], GST_MAP_READ)) {
+            maps[i].data = nullptr;
+            maps[i].size = 0;
+        }
+        iovs[i].iov_base = maps[i].data;
+        iovs[i].iov_len = maps[i].size;
+    }
+
+    // One message per run of equally sized packets (GSO) or per packet (plain sendmmsg)
+    std::vector<mmsghdr> msgs;
+    std::vector<size_t> firstPacket;
+    msgs.reserve(packets);
+    firstPacket.reserve(packets);
+    std::vector<char> control(packets * CMSG_SPACE(sizeof(uint16_t)));
+
+    for (size_t i = 0; i < packets;) {
+        size_t end = i + 1;
+        size_t bytes = iovs[i].iov_len;
+        if (sender.gsoSupported) {
+            // All segments but the last one have to be exactly the segment size
+            while (end < packets && end - i < UDP_GSO_MAX_SEGMENTS && bytes + iovs[end].iov_len <= UDP_GSO_MAX_BYTES &&
+                   iovs[end].iov_len <= iovs[i].iov_len) {
+                bytes += iovs[end].iov_len;
+                end++;
+                if (iovs[end - 1].iov_len != iovs[i].iov_len) { break; }
+            }
+        }
+
+        mmsghdr msg{};
+        msg.msg_hdr.msg_iov = &iovs[i];
+        msg.msg_hdr.msg_iovlen = end - i;
+        if (end - i > 1) {
+            char *buf = control.data() + msgs.size() * CMSG_SPACE(sizeof(uint16_t));
+            msg.msg_hdr.msg_control = buf;
+            msg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsghdr *cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            const auto segment = static_cast<uint16_t>(iovs[i].iov_len);
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+        msgs.push_back(msg);
+        firstPacket.push_back(i);
+        i = end;
+    }
+
+    const unsigned int refused = SendMessages(sender, msgs.data(), msgs.size());
+
+    // GSO may still be refused by the device (e.g. no checksum offload), resend the rest without it
+    if (refused < msgs.size()) {
+        std::cerr << sender.name << " batch sender: GSO send failed (" << strerror(errno) << "), disabling GSO\n";
+        sender.gsoSupported = false;
+        std::vector<mmsghdr> single;
+        for (size_t i = firstPacket[refused]; i < packets; i++) {
+            mmsghdr msg{};
+            msg.msg_hdr.msg_iov = &iovs[i];
+            msg.msg_hdr.msg_iovlen = 1;
+            single.push_back(msg);
+        }
+        SendMessages(sender, single.data(), single.size());
+    }
+
+    for (size_t i = 0; i < packets; i++) {
+        if (maps[i].data != nullptr) {
+            gst_buffer_unmap(sender.pending[i], &maps[i]);
+        }
+        gst_buffer_unref(sender.pending[i]);
+    }
+    sender.pending.clear();
+
+    sender.statPackets += packets;
+    sender.statCpuNs += GetThreadCpuNs() - cpuStart;
+}
+
+inline void OnUdpBatchFrameSent(UdpBatchSender &sender) {
+    sender.statFrames++;
+    if (sender.statFrames < UDP_BATCH_STATS_INTERVAL) { return; }
+
+    std::cout << sender.name << " batch sender: " <<
+            static_cast<double>(sender.statPackets) / sender.statFrames << " packets/frame, " <<
+            static_cast<double>(sender.statSyscalls) / sender.statFrames << " syscalls/frame, " <<
+            sender.statCpuNs / 1000.0 / sender.statFrames << " us CPU/frame, " <<
+            sender.statErrors << " send errors\n";
+    sender.statFrames = sender.statPackets = sender.statSyscalls = sender.statCpuNs = sender.statErrors = 0;
+}
+
+inline GstFlowReturn OnUdpBatchNewSample(GstAppSink *appsink, gpointer data) {
+    auto &sender = *static_cast<UdpBatchSender *>(data);
+
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (sample == nullptr) { return GST_FLOW_EOS; }
+
+    bool frameEnd = false;
+    if (GstBufferList *list = gst_sample_get_buffer_list(sample)) {
+        const guint length = gst_buffer_list_length(list);
+        for (guint i = 0; i < length; i++) {
+            sender.pending.push_back(gst_buffer_ref(gst_buffer_list_get(list, i)));
+        }
+        frameEnd = length > 0 && IsRtpMarkerSet(sender.pending.back());
+    } else if (GstBuffer *buffer = gst_sample_get_buffer(sample)) {
+        sender.pending.push_back(gst_buffer_ref(buffer));
+        frameEnd = IsRtpMarkerSet(buffer);
+    }
+    gst_sample_unref(sample);
+
+    if (!sender.gatherFrames || frameEnd || sender.pending.size() >= UDP_BATCH_MAX_PACKETS) {
+        FlushUdpBatchSender(sender);
+    }
+    if (frameEnd) {
+        OnUdpBatchFrameSent(sender);
+    }
+    return GST_FLOW_OK;
+}
+
+inline void OnUdpBatchEos(GstAppSink *appsink, gpointer data) {
+    FlushUdpBatchSender(*static_cast<UdpBatchSender *>(data));
+}
+
+inline void DestroyUdpBatchSender(gpointer data) {
+    auto *sender = static_cast<UdpBatchSender *>(data);
+    for (auto buffer: sender->pending) {
+        gst_buffer_unref(buffer);
+    }
+    if (sender->fd >= 0) {
+        close(sender->fd);
+    }
+    delete sender;
+}
+
+inline bool AttachUdpBatchSender(GstElement *pipeline, const std::string &host, int port, bool gatherFrames) {
+    GstElement *batchsink = gst_bin_get_by_name(GST_BIN(pipeline), "batchsink");
+    if (batchsink == nullptr) { return true; }
+
+    auto *sender = new UdpBatchSender();
+    sender->name = GST_OBJECT_NAME(pipeline);
+    sender->gatherFrames = gatherFrames;
+    if (!OpenUdpBatchSender(*sender, host, port)) {
+        DestroyUdpBatchSender(sender);
+        gst_object_unref(batchsink);
+        return false;
+    }
+
+    GstAppSinkCallbacks callbacks{};
+    callbacks.eos = OnUdpBatchEos;
+    callbacks.new_sample = OnUdpBatchNewSample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(batchsink), &callbacks, sender, DestroyUdpBatchSender);
+    g_object_set_data(G_OBJECT(pipeline), "udp-batch-sender", sender);
+    gst_object_unref(batchsink);
+    return true;
+}
+
+// Reconnects the socket to a new destination of the same address family. The streaming thread keeps sending on
+// the same fd, packets after the connect() go to the new destination.
+inline bool UpdateUdpBatchSender(GstElement *pipeline, const std::string &host, int port) {
+    auto *sender = static_cast<UdpBatchSender *>(g_object_get_data(G_OBJECT(pipeline), "udp-batch-sender"));
+    if (sender == nullptr) { return false; }
+
+    addrinfo hints{};
+    hints.ai_family = sender->family;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *result = nullptr;
+
+    const int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+    if (rc != 0) {
+        std::cerr << "Cannot resolve " << host << ": " << gai_strerror(rc) << "\n";
+        return false;
+    }
+
+    bool connected = false;
+    for (addrinfo *ai = result; ai != nullptr && !connected; ai = ai->ai_next) {
+        connected = connect(sender->fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    }
+    freeaddrinfo(result);
+
+    if (!connected) {
+        std::cerr << "Cannot reconnect UDP socket to " << host << ":" << port << ": " << strerror(errno) << "\n";
+    }
+    return connected;
+}
@@ -0,0 +1,58 @@
+//
+// eventfd based wakeups and timerfd delays for the camera workers, watched together with the GStreamer bus
+//
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+inline int CreateWakeup() {
+    return eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+// Only write(2) on an eventfd, so this is also safe to call from a signal handler
+inline void Wake(int fd) {
+    if (fd < 0) { return; }
+    const uint64_t one = 1;
+    [[maybe_unused]] const auto written = write(fd, &one, sizeof(one));
+}
+
+inline int CreateTimer() {
+    return timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+}
+
+// One-shot, replaces a pending expiry. Reading the timer with DrainWakeup() clears it.
+inline void ArmTimer(int fd, int delayMs) {
+    itimerspec spec{};
+    spec.it_value.tv_sec = delayMs / 1000;
+    spec.it_value.tv_nsec = delayMs % 1000 * 1'000'000L;
+    if (delayMs <= 0) {
+        spec.it_value.tv_sec = 0;
+        spec.it_value.tv_nsec = 1; // an all-zero value would disarm the timer
+    }
+    timerfd_settime(fd, 0, &spec, nullptr);
+}
+
+inline void DrainWakeup(int fd) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) == sizeof(count)) {}
+}
+
+// Blocks until woken or until the timeout (ms, -1 waits forever) passes. Returns true when woken.
+inline bool WaitForWakeup(int fd, int timeoutMs) {
+    pollfd pfd{fd, POLLIN, 0};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeoutMs);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret > 0) {
+        DrainWakeup(fd);
+        return true;
+    }
+    return false;
+}
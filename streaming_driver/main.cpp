@@ -1,29 +1,108 @@
+#include <algorithm>
 #include <atomic>
 #include <iostream>
 #include <csignal>
 #include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <gst/gst.h>
+#include <sys/epoll.h>
 #include <thread>
+#include <memory>
 #include <mutex>
 #include "json.hpp"
+#include "events.h"
+#include "config.h"
+#include "hot_update.h"
+#include "jpeg_restart.h"
 #include "logging.h"
+#include "pacing.h"
 #include "pipelines.h"
+#include "receiver.h"
+#include "recording.h"
+#include "shm_output.h"
+#include "soak.h"
+#include "stage_queues.h"
+#include "standby.h"
+#include "startup.h"
+#include "udp_batch.h"
+#include "wakeup.h"
 
 using json = nlohmann::json;
 
-StreamingConfig DEFAULT_STREAMING_CONFIG = {
-    "192.168.1.100", 8554, 8556, Codec::JPEG, 85, 400000, 1920, 1080, VideoMode::STEREO, 60
-};
-std::vector<GstElement *> pipelines = {nullptr, nullptr};
+std::vector<GstElement *> pipelines; // one per camera of the map
 std::mutex pipelines_mutex;
 
+const int MAX_CONSECUTIVE_FAILURES = 5; // After this, a camera waits for a config change instead of retrying
+const int CAMERA_RELEASE_MS = 500; // Time the camera hardware needs to fully release before it is reopened
+int apply_deadline_ms = 300; // A new config must produce its first frame within this, see --apply-deadline-ms
+int coalesce_ms = 200; // Structural changes wait this long for further updates before rebuilding, see --coalesce-ms
+const int COALESCE_MAX_WINDOWS = 5; // A continuous burst still rebuilds after this many windows
+int shutdown_ms = 2000; // Cap on draining and releasing all cameras at shutdown, see --shutdown-ms
+std::atomic<int> releasing_pipelines{0}; // pipelines still going to NULL when the shutdown deadline passed
+SoakRecorder *soak_recorder = nullptr; // set in soak mode, collects the rebuild times, see --soak
+
+// One camera of the map. The control thread writes the desired config, the rest is the camera's streaming
+// state, touched only by the worker currently servicing it (under serviceMutex).
+struct Camera {
+    CameraDescriptor descriptor;
+    int index = 0; // position in the map
+    StreamingConfig desired{}; // guarded by cfg_mutex
+    std::atomic<uint64_t> version{0};
+    std::atomic<uint64_t> updateUs{0}; // when the latest config arrived, for measuring update to apply latency
+    int wakeup = -1; // eventfd, signalled on config changes of this camera
+
+    std::mutex serviceMutex;
+    int timer = -1; // timerfd, brings the camera back after a restart delay or backoff
+    std::chrono::steady_clock::time_point retryAt{}; // no pipeline is started before this
+    GstElement *pipeline = nullptr;
+    GstBus *bus = nullptr;
+    int busFd = -1;
+    StreamingConfig current{}; // config of the running pipeline, guarded by pipelines_mutex for readers outside
+    GstElement *warmPipeline = nullptr;
+    StreamingConfig warmCfg{};
+    bool standby = false;
+    StandbyMeter standbyMeter;
+    uint64_t seenVersion = 0, startedVersion = 0;
+    int failures = 0;
+
+    // Config changes are transactions, committed by the first packet after them and rolled back without one
+    StreamingConfig lastGood{};
+    bool hasLastGood = false;
+    std::atomic<uint64_t> rejectedVersion{0}; // the camera streams lastGood while this is the desired version
+    bool trial = false, liveTrial = false, trialHasDeadline = false;
+    std::chrono::steady_clock::time_point trialDeadline{};
+    uint64_t trialStartUs = 0;
+    std::atomic<uint64_t> trialPacketUs{0}; // set by the payloader probe
+    uint64_t coldStartMs = 0; // PLAYING to first packet of the last rebuild, added to the deadline of the next
+
+    // Structural changes are debounced, the live part of each update is applied right away
+    bool rebuildPending = false;
+    std::chrono::steady_clock::time_point rebuildAt{}, rebuildPendingSince{};
+    int coalescedUpdates = 0; // structural updates waiting for the pending rebuild
+    uint64_t liveUpdates = 0, rebuilds = 0, rebuildsAvoided = 0;
+};
+
 std::mutex cfg_mutex;
-StreamingConfig desired_cfg = {};
-std::atomic<uint64_t> cfg_version{0};
+std::vector<std::unique_ptr<Camera> > cameras;
 std::atomic<bool> stop_requested{false};
+std::atomic<int> signals_received{0}; // counted apart from stop_requested, a stop command is not a signal
+bool warm_standby = false; // keep the camera pipelines opened and PAUSED while standing by, see --warm-standby
+StreamingConfig warm_standby_cfg = DEFAULT_STREAMING_CONFIG; // warmed up before the first config, see --warm-config
 
-// Track current config for each sensor to detect what changed
-std::vector<StreamingConfig> current_configs = {DEFAULT_STREAMING_CONFIG, DEFAULT_STREAMING_CONFIG};
+// The cameras are serviced by a small pool of workers sharing one epoll set instead of a thread per camera
+int engine_epoll = -1;
+int engine_stop = -1; // eventfd, left readable once stop is requested so that every worker sees it
+constexpr uint64_t ENGINE_STOP_EVENT = UINT64_MAX;
+
+void WakeWorkers() {
+    Wake(engine_stop);
+}
+
+// Recording is switched on and off by its own control command and survives pipeline rebuilds
+std::mutex recording_mutex;
+RecordingConfig recording_cfg = {};
+bool recording_requested = false;
 
 void StopPipeline(GstElement *pipeline) {
     if (pipeline == nullptr) { return; };
@@ -45,6 +124,19 @@ void StopPipeline(GstElement *pipeline) {
     gst_object_unref(pipeline);
 }
 
+#ifdef JETSON
+// Argus does not cope with sensors being opened concurrently, so the state changes that open one are serialized
+// while everything else about the pipelines is built in parallel
+std::mutex sensor_open_mutex;
+#endif
+
+GstStateChangeReturn OpenCameraPipeline(GstElement *pipeline, GstState state) {
+#ifdef JETSON
+    std::lock_guard<std::mutex> lock(sensor_open_mutex);
+#endif
+    return gst_element_set_state(pipeline, state);
+}
+
 void SetPipelineToPlayingState(GstElement *pipeline, const std::string &name) {
     const auto ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE) {
@@ -67,15 +159,18 @@ void SetPipelineToPlayingState(GstElement *pipeline, const std::string &name) {
     StopPipeline(pipeline);
 }
 
-GstElement *BuildCameraPipeline(int sensorId, const StreamingConfig &streamingConfig) {
+GstElement *BuildCameraPipeline(const Camera &camera, const StreamingConfig &streamingConfig) {
+    CameraDescriptor descriptor = camera.descriptor;
+    descriptor.port = GetCameraPort(streamingConfig, camera.descriptor, camera.index);
+
     std::ostringstream oss;
 
     switch (streamingConfig.codec) {
-        case JPEG: oss = GetJpegStreamingPipeline(streamingConfig, sensorId);
+        case JPEG: oss = GetJpegStreamingPipeline(streamingConfig, descriptor);
             break;
-        case H264: oss = GetH264StreamingPipeline(streamingConfig, sensorId);
+        case H264: oss = GetH264StreamingPipeline(streamingConfig, descriptor);
             break;
-        case H265: oss = GetH265StreamingPipeline(streamingConfig, sensorId);
+        case H265: oss = GetH265StreamingPipeline(streamingConfig, descriptor);
             break;
         case VP8:
         case VP9:
@@ -83,311 +178,759 @@ GstElement *BuildCameraPipeline(int sensorId, const StreamingConfig &streamingCo
             throw std::runtime_error("Unsupported codec in this build");
     }
 
-    const std::string side = sensorId == 0 ? "left" : "right";
+    const std::string &name = descriptor.name;
     const std::string pipelineStr = oss.str();
 
-    std::cout << "=== Building Pipeline for Camera " << sensorId << " (" << side << ") ===\n";
+    std::cout << "=== Building Pipeline for Camera " << name << " (sensor " << descriptor.sensorId << ") ===\n";
     std::cout << pipelineStr << "\n";
     std::cout << "=== End Pipeline ===\n";
+    EmitEvent("pipeline_building", name, {{"sensor", descriptor.sensorId}, {"port", descriptor.port}});
 
     GstElement *pipeline = gst_parse_launch(pipelineStr.c_str(), nullptr);
-    gst_element_set_name(pipeline, ("pipeline_" + side).c_str());
+    gst_element_set_name(pipeline, ("pipeline_" + name).c_str());
 
-    GstElement *camsrc_ident = gst_bin_get_by_name(GST_BIN(pipeline), "camsrc_ident");
-    GstElement *vidconv_ident = gst_bin_get_by_name(GST_BIN(pipeline), "vidconv_ident");
-    GstElement *enc_ident = gst_bin_get_by_name(GST_BIN(pipeline), "enc_ident");
-    GstElement *rtppay_ident = gst_bin_get_by_name(GST_BIN(pipeline), "rtppay_ident");
+    AttachStreamingMetadata(pipeline);
+    AttachPacketPacer(pipeline, streamingConfig.pacing, streamingConfig.fps);
+    AttachStageQueueCounters(pipeline);
+    AttachStageReport(pipeline);
 
-    g_signal_connect(camsrc_ident, "handoff", G_CALLBACK(OnIdentityHandoffCameraStreaming), nullptr);
-    g_signal_connect(vidconv_ident, "handoff", G_CALLBACK(OnIdentityHandoffCameraStreaming), nullptr);
-    g_signal_connect(enc_ident, "handoff", G_CALLBACK(OnIdentityHandoffCameraStreaming), nullptr);
-    g_signal_connect(rtppay_ident, "handoff", G_CALLBACK(OnIdentityHandoffCameraStreaming), nullptr);
+    if (streamingConfig.codec == Codec::JPEG) {
+        AttachJpegRestartInserter(pipeline, streamingConfig.restartInterval);
+    }
+
+    if (!AttachShmOutputs(pipeline, name, streamingConfig.horizontalResolution, streamingConfig.verticalResolution,
+                          streamingConfig.shmSlots)) {
+        gst_object_unref(pipeline);
+        throw std::runtime_error("Cannot open the shared-memory output");
+    }
+
+    if (!AttachUdpBatchSender(pipeline, streamingConfig.ip, descriptor.port, streamingConfig.pacing <= 0)) {
+        gst_object_unref(pipeline);
+        throw std::runtime_error("Cannot open the batched UDP sender");
+    }
 
+    MarkStartup("pipeline built", name);
     return pipeline;
 }
 
+// What a config change needs is looked up in the hot-update table (see hot_update.h)
 bool CanUpdateDynamically(const StreamingConfig &oldCfg, const StreamingConfig &newCfg) {
-    // Check if only quality/bitrate changed (can be updated without rebuild)
-    bool structuralChange = (
-        oldCfg.horizontalResolution != newCfg.horizontalResolution ||
-        oldCfg.verticalResolution != newCfg.verticalResolution ||
-        oldCfg.fps != newCfg.fps ||
-        oldCfg.codec != newCfg.codec ||
-        oldCfg.videoMode != newCfg.videoMode ||
-        oldCfg.ip != newCfg.ip ||
-        oldCfg.portLeft != newCfg.portLeft ||
-        oldCfg.portRight != newCfg.portRight
-    );
-
-    // Can update dynamically if no structural changes
-    return !structuralChange;
-}
-
-bool UpdatePipelineProperties(GstElement *pipeline, const StreamingConfig &newCfg, int sensorId) {
+    const HotUpdatePlan plan = GetHotUpdatePlan(oldCfg, newCfg);
+    if (plan.rebuild) {
+        std::cout << "Changed " << plan.reason << " needs a pipeline rebuild\n";
+    }
+    return !plan.rebuild;
+}
+
+// Applies only the live-settable fields that differ between the two configs
+bool UpdatePipelineProperties(GstElement *pipeline, const StreamingConfig &oldCfg, const StreamingConfig &newCfg,
+                              const Camera &camera) {
     if (pipeline == nullptr) {
         std::cerr << "Cannot update properties - pipeline is null\n";
         return false;
     }
 
-    std::cout << "=== Dynamic Property Update for Camera " << sensorId << " ===\n";
+    std::cout << "=== Dynamic Property Update for Camera " << camera.descriptor.name << " ===\n";
 
-    // Find the encoder element by name
-    GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
-    if (encoder == nullptr) {
-        std::cerr << "Failed to find encoder element\n";
-        return false;
+    const uint64_t begin = GetCurrentUs();
+    const HotUpdatePlan plan = GetHotUpdatePlan(oldCfg, newCfg);
+    const bool success = !plan.rebuild &&
+                         ApplyHotUpdate(pipeline, plan, newCfg, GetCameraPort(newCfg, camera.descriptor, camera.index));
+
+    if (success) {
+        std::cout << "=== Dynamic Update Complete ===\n";
+        json fields = json::array();
+        for (const auto *rule: plan.live) {
+            fields.push_back(rule->field);
+        }
+        EmitEvent("dynamic_update", camera.descriptor.name, {{"fields", fields}, {"apply_us", GetCurrentUs() - begin}});
     }
 
-    bool success = true;
+    return success;
+}
 
-    switch (newCfg.codec) {
-        case Codec::JPEG:
-            std::cout << "Updating JPEG quality to " << newCfg.encodingQuality << "\n";
-            g_object_set(encoder, "quality", newCfg.encodingQuality, nullptr);
-            break;
+// Builds a pipeline and brings it to PAUSED, which opens the camera and the encoder without streaming
+GstElement *WarmUpCameraPipeline(const Camera &camera, const StreamingConfig &cfg) {
+    GstElement *pipeline = nullptr;
+    try {
+        pipeline = BuildCameraPipeline(camera, cfg);
+    } catch (const std::exception &e) {
+        std::cerr << "Warm standby build failed: " << e.what() << "\n";
+        return nullptr;
+    }
 
-        case Codec::H264:
-        case Codec::H265:
-            std::cout << "Updating bitrate to " << newCfg.bitrate << "\n";
-            g_object_set(encoder, "bitrate", newCfg.bitrate, nullptr);
-            break;
+    const uint64_t begin = GetCurrentUs();
+    if (OpenCameraPipeline(pipeline, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE) {
+        std::cerr << "Unable to set warm standby pipeline PAUSED\n";
+        StopPipeline(pipeline);
+        return nullptr;
+    }
+    gst_element_get_state(pipeline, nullptr, nullptr, 5 * GST_SECOND);
+    std::cout << "Camera " << camera.descriptor.name << " warm in standby, opening took " << (GetCurrentUs() - begin) / 1000.0 << " ms\n";
+    return pipeline;
+}
 
-        default:
-            std::cerr << "Unsupported codec for dynamic update\n";
-            success = false;
-            break;
+bool IsCameraNeeded(const Camera &camera, const StreamingConfig &cfg, uint64_t version) {
+    // In MONO mode, only the first camera of the map should be active
+    return version != 0 && !(cfg.videoMode == VideoMode::MONO && camera.index != 0);
+}
+
+// Events carry the camera index in the upper and the fd in the lower half. The fds are one-shot, ServiceCamera
+// re-arms them from the camera's own state.
+void WatchFd(int fd, size_t index, int op) {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = static_cast<uint64_t>(index) << 32 | static_cast<uint32_t>(fd);
+    epoll_ctl(engine_epoll, op, fd, &event);
+}
+
+void ScheduleRetry(Camera &camera, int delayMs) {
+    camera.retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+    ArmTimer(camera.timer, delayMs);
+}
+
+void FailCamera(Camera &camera) {
+    camera.failures++;
+    if (camera.failures >= MAX_CONSECUTIVE_FAILURES) {
+        std::cerr << "Camera " << camera.descriptor.name << " has failed " << camera.failures <<
+                " times. Send a config update to retry.\n";
+        EmitEvent("pipeline_failed", camera.descriptor.name, {{"failures", camera.failures}, {"retry_ms", nullptr}});
+        camera.retryAt = std::chrono::steady_clock::time_point::max();
+        return;
     }
 
-    gst_object_unref(encoder);
+    // Exponential backoff: 200ms, 400ms, 800ms, 1.6s
+    const int backoffMs = 200 * (1 << (camera.failures - 1));
+    std::cerr << "Camera " << camera.descriptor.name << " failed " << camera.failures
+              << " times, waiting " << backoffMs << "ms before retry\n";
+    EmitEvent("pipeline_failed", camera.descriptor.name, {{"failures", camera.failures}, {"retry_ms", backoffMs}});
+    ScheduleRetry(camera, backoffMs);
+}
 
-    if (success) {
-        std::cout << "=== Dynamic Update Complete ===\n";
+void StopCamera(Camera &camera) {
+    epoll_ctl(engine_epoll, EPOLL_CTL_DEL, camera.busFd, nullptr);
+    gst_object_unref(camera.bus);
+    camera.bus = nullptr;
+    camera.busFd = -1;
+
+    {
+        std::lock_guard<std::mutex> lock(pipelines_mutex);
+        pipelines[camera.index] = nullptr;
     }
 
-    return success;
+    // Finalize the current recording segment before the pipeline goes down
+    StopRecording(camera.pipeline);
+    StopPipeline(camera.pipeline);
+    camera.pipeline = nullptr;
+    EmitEvent("pipeline_stopped", camera.descriptor.name);
+
+    // The next start reads the latest config anyway
+    camera.rebuildPending = false;
+    camera.coalescedUpdates = 0;
+}
+
+// A new pipeline has to be prepared before it starts, so that its first packet cannot be missed. A live update
+// passes the newest frame captured once the properties are set, the packets of that and older frames don't count.
+void PrepareTrial(Camera &camera, GstElement *pipeline, GstClockTime afterPts = GST_CLOCK_TIME_NONE) {
+    camera.trialStartUs = GetCurrentUs();
+    camera.trialPacketUs.store(0);
+    AttachFirstPacketSignal(pipeline, &camera.trialPacketUs, camera.wakeup, afterPts);
 }
 
-void RunCameraStreamingPipelineDynamic(int sensorId) {
-    // Stagger camera initialization to avoid Argus contention on startup
-    if (sensorId == 1) {
-        std::cout << "Delaying camera 1 initialization by 100 milliseconds...\n";
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+// While streaming the camera timer serves whichever comes first, the trial deadline or the deferred rebuild
+void RearmStreamingTimer(Camera &camera) {
+    auto next = std::chrono::steady_clock::time_point::max();
+    if (camera.trial && camera.trialHasDeadline) {
+        next = std::min(next, camera.trialDeadline);
     }
+    if (camera.rebuildPending) {
+        next = std::min(next, camera.rebuildAt);
+    }
+    if (next == std::chrono::steady_clock::time_point::max()) { return; }
 
-    uint64_t seen_version = 0;
-    int consecutive_failures = 0;
-    const int MAX_CONSECUTIVE_FAILURES = 5;  // After this, just sleep instead of retrying
+    const auto delay = std::chrono::ceil<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
+    ArmTimer(camera.timer, static_cast<int>(delay.count()));
+}
 
-    while (!stop_requested.load()) {
-        // If camera has failed too many times, just sleep and wait for config change
-        if (consecutive_failures >= MAX_CONSECUTIVE_FAILURES) {
-            std::cerr << "Camera " << sensorId << " has failed " << consecutive_failures
-                      << " times. Sleeping for 10s. Send a config update to retry.\n";
-            std::this_thread::sleep_for(std::chrono::seconds(10));
-            // Check if config changed during sleep, if so reset failures and try again
-            uint64_t current_version = cfg_version.load(std::memory_order_relaxed);
-            if (current_version != seen_version) {
-                std::cout << "Config changed, resetting failure counter for camera " << sensorId << "\n";
-                consecutive_failures = 0;
-            }
-            continue;
+// Only a config that can be rolled back gets a deadline, the last good one is given all the time it needs
+void BeginTrial(Camera &camera, bool live) {
+    camera.trial = true;
+    camera.liveTrial = live;
+    camera.trialHasDeadline = camera.hasLastGood && camera.current != camera.lastGood;
+    if (!camera.trialHasDeadline) { return; }
+
+    // A rebuild reopens the camera, which takes as long as it took last time before any frame can come
+    const int deadlineMs = apply_deadline_ms + (live ? 0 : static_cast<int>(camera.coldStartMs));
+    camera.trialDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs);
+    RearmStreamingTimer(camera);
+}
+
+void CommitTrial(Camera &camera) {
+    camera.trial = false;
+    if (!camera.liveTrial) {
+        camera.coldStartMs = (camera.trialPacketUs.load() - camera.trialStartUs) / 1000;
+    }
+    if (!camera.hasLastGood || camera.lastGood != camera.current) {
+        std::cout << "Camera " << camera.descriptor.name << " config version " << camera.seenVersion << " committed\n";
+        EmitEvent("config_committed", camera.descriptor.name, {{"version", camera.seenVersion}, {"live", camera.liveTrial}});
+    }
+    camera.lastGood = camera.current;
+    camera.hasLastGood = true;
+}
+
+void ReportRejectedConfig(const Camera &camera, const std::string &reason) {
+    std::cerr << "Camera " << camera.descriptor.name << " rejected config version " << camera.seenVersion << " (" << reason <<
+            "), rolling back to the last good config\n";
+    EmitEvent("config_rejected", camera.descriptor.name, {{"version", camera.seenVersion}, {"reason", reason}});
+}
+
+// Restarts the camera with the last good config. False when there is nothing to roll back to, i.e. the config
+// that failed is the last good one itself, which goes through the regular failure backoff.
+bool RollBack(Camera &camera, const StreamingConfig &failedCfg, const std::string &reason, int delayMs) {
+    if (!camera.hasLastGood || failedCfg == camera.lastGood) { return false; }
+    ReportRejectedConfig(camera, reason);
+    camera.rejectedVersion.store(camera.seenVersion);
+    ScheduleRetry(camera, delayMs);
+    return true;
+}
+
+// A live update is undone by applying the last good values to the running pipeline
+bool RollBackLive(Camera &camera, const std::string &reason) {
+    ReportRejectedConfig(camera, reason);
+    if (!UpdatePipelineProperties(camera.pipeline, camera.current, camera.lastGood, camera)) { return false; }
+    camera.rejectedVersion.store(camera.seenVersion);
+    camera.trial = false;
+    camera.rebuildPending = false; // the rejected version is not built either
+    camera.coalescedUpdates = 0;
+    std::lock_guard<std::mutex> lock(pipelines_mutex);
+    camera.current = camera.lastGood;
+    return true;
+}
+
+void StartCamera(Camera &camera) {
+    const std::string &name = camera.descriptor.name;
+    StreamingConfig cfg;
+    uint64_t version;
+    {
+        std::lock_guard<std::mutex> lk(cfg_mutex);
+        cfg = camera.desired;
+        version = camera.version.load(std::memory_order_relaxed);
+    }
+
+    // A config change cuts the backoff after failures short
+    if (version != camera.seenVersion && camera.failures > 0) {
+        if (camera.failures >= MAX_CONSECUTIVE_FAILURES) {
+            std::cout << "Config changed, resetting failure counter for camera " << name << "\n";
+            camera.failures = 0;
         }
+        camera.retryAt = std::chrono::steady_clock::now();
+    }
+    camera.seenVersion = version;
+    if (std::chrono::steady_clock::now() < camera.retryAt) { return; } // the timer brings the camera back
+
+    if (!IsCameraNeeded(camera, cfg, version)) {
+        if (camera.standby) { return; }
+        std::cout << "Camera " << name << (version == 0 ? " waiting for the first config" : " disabled in MONO mode") <<
+                ", standing by...\n";
+        if (warm_standby && camera.warmPipeline == nullptr) {
+            camera.warmCfg = version == 0 ? warm_standby_cfg : cfg;
+            camera.warmPipeline = WarmUpCameraPipeline(camera, camera.warmCfg);
+        }
+        camera.standby = true;
+        camera.standbyMeter = StandbyMeter{};
+        EmitEvent("standby", name, {{"reason", version == 0 ? "no config" : "mono"}, {"warm", camera.warmPipeline != nullptr}});
+        return;
+    }
+    if (camera.standby) {
+        ReportStandby(camera.standbyMeter, name);
+        camera.standby = false;
+    }
 
-        StreamingConfig cfg;
-        {
-            std::lock_guard<std::mutex> lk(cfg_mutex);
-            cfg = desired_cfg;
-            seen_version = cfg_version.load(std::memory_order_relaxed);
-            if (seen_version == 0) continue;
+    // A rejected config stays rejected until the next update, the camera streams the last good one meanwhile
+    if (version == camera.rejectedVersion.load() && camera.hasLastGood) {
+        cfg = camera.lastGood;
+    }
+
+    // A warm pipeline is used when the config only differs in what can be updated on the fly
+    const uint64_t startUs = GetCurrentUs();
+    GstElement *pipeline = nullptr;
+    bool warm = false;
+    if (camera.warmPipeline != nullptr) {
+        if (CanUpdateDynamically(camera.warmCfg, cfg) && UpdatePipelineProperties(camera.warmPipeline, camera.warmCfg, cfg, camera)) {
+            pipeline = camera.warmPipeline;
+            warm = true;
+        } else {
+            std::cout << "Camera " << name << " config differs from the warm standby pipeline, rebuilding\n";
+            StopPipeline(camera.warmPipeline);
         }
+        camera.warmPipeline = nullptr;
+    }
 
-        // In MONO mode, only camera 0 (left) should be active
-        if (cfg.videoMode == VideoMode::MONO && sensorId == 1) {
-            std::cout << "Camera 1 disabled in MONO mode, sleeping...\n";
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-            continue;
+    try {
+        if (pipeline == nullptr) {
+            pipeline = BuildCameraPipeline(camera, cfg);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Build failed: " << e.what() << "\n";
+        // Nothing was opened, so the last good config can go right back
+        if (!RollBack(camera, cfg, "build failed", 0)) {
+            FailCamera(camera);
         }
+        return;
+    }
 
-        GstElement *pipeline = nullptr;
-        try {
-            pipeline = BuildCameraPipeline(sensorId, cfg);
-        } catch (const std::exception &e) {
-            std::cerr << "Build failed: " << e.what() << "\n";
-            consecutive_failures++;
+    // Cold start of a new config is measured from its arrival, restarts after errors from the rebuild
+    if (camera.startedVersion != version) {
+        AttachFirstPacketReport(pipeline, camera.updateUs.load(), "the config update");
+        camera.startedVersion = version;
+    } else {
+        AttachFirstPacketReport(pipeline, GetCurrentUs(), "the pipeline restart");
+    }
 
-            // Exponential backoff: 200ms, 500ms, 1s, 2s, 5s, then 10s
-            int backoff_ms = consecutive_failures < MAX_CONSECUTIVE_FAILURES ?
-                            (200 * (1 << (consecutive_failures - 1))) : 10000;
-            std::cerr << "Camera " << sensorId << " failed " << consecutive_failures
-                      << " times, waiting " << backoff_ms << "ms before retry\n";
-            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
-            continue;
-        }
+    {
+        // publish for SignalHandler / debugging
+        std::lock_guard<std::mutex> lock(pipelines_mutex);
+        pipelines[camera.index] = pipeline;
+        camera.current = cfg;
+    }
+    AttachStartupProbes(pipeline, name);
+    PrepareTrial(camera, pipeline);
 
+    if (OpenCameraPipeline(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        std::cerr << "Unable to set pipeline PLAYING\n";
         {
-            // publish for SignalHandler / debugging
             std::lock_guard<std::mutex> lock(pipelines_mutex);
-            pipelines[sensorId] = pipeline;
+            pipelines[camera.index] = nullptr;
+        }
+        StopPipeline(pipeline);
+        if (!RollBack(camera, cfg, "cannot reach PLAYING", CAMERA_RELEASE_MS)) {
+            FailCamera(camera);
         }
+        return;
+    }
 
-        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
-            std::cerr << "Unable to set pipeline PLAYING\n";
-            StopPipeline(pipeline);
-            consecutive_failures++;
-
-            int backoff_ms = consecutive_failures < MAX_CONSECUTIVE_FAILURES ?
-                            (200 * (1 << (consecutive_failures - 1))) : 10000;
-            std::cerr << "Camera " << sensorId << " failed " << consecutive_failures
-                      << " times, waiting " << backoff_ms << "ms before retry\n";
-            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
-            continue;
-        }
-
-        // Store current config after successful pipeline start
-        // Reset failure counter on success
-        if (consecutive_failures > 0) {
-            std::cout << "Camera " << sensorId << " recovered after " << consecutive_failures << " failures\n";
-        }
-        consecutive_failures = 0;
-        current_configs[sensorId] = cfg;
-
-        GstBus *bus = gst_element_get_bus(pipeline);
-        bool rebuild = false;
-        bool error_during_streaming = false;
-
-        while (!stop_requested.load() && !rebuild) {
-            // 100ms poll so updates can be noticed
-            GstMessage *msg = gst_bus_timed_pop_filtered(
-                bus,
-                100 * GST_MSECOND,
-                (GstMessageType) (GST_MESSAGE_ERROR | GST_MESSAGE_EOS)
-            );
-
-            if (msg) {
-                std::cerr << "Camera " << sensorId << " received error/EOS during streaming\n";
-                gst_message_unref(msg);
-                rebuild = true;
-                error_during_streaming = true;  // Mark that error occurred after start
-            }
+    MarkStartup("state change to PLAYING", name);
 
-            // Check for config changes
-            uint64_t current_version = cfg_version.load(std::memory_order_relaxed);
-            if (current_version != seen_version) {
-                // Config changed - read the new config
-                StreamingConfig new_cfg;
-                {
-                    std::lock_guard<std::mutex> lk(cfg_mutex);
-                    new_cfg = desired_cfg;
-                    seen_version = current_version;
-                }
+    {
+        std::lock_guard<std::mutex> lock(pipelines_mutex);
+        std::lock_guard<std::mutex> lk(recording_mutex);
+        if (recording_requested) {
+            StartRecording(pipeline, cfg.codec, recording_cfg);
+        }
+    }
+
+    // Reset failure counter on success
+    if (camera.failures > 0) {
+        std::cout << "Camera " << name << " recovered after " << camera.failures << " failures\n";
+    }
+    camera.failures = 0;
+
+    std::cout << "Camera " << name << " config version " << version << " live " <<
+            GetCurrentUs() - camera.updateUs.load() << " us after the update\n";
+    const double startMs = (GetCurrentUs() - startUs) / 1000.0;
+    EmitEvent("pipeline_playing", name, {{"version", version}, {"start_ms", startMs}, {"warm", warm}});
+    if (soak_recorder != nullptr) {
+        RecordSoakRebuild(*soak_recorder, startMs);
+    }
+
+    camera.pipeline = pipeline;
+    camera.bus = gst_element_get_bus(pipeline);
+    GPollFD bus_fd;
+    gst_bus_get_pollfd(camera.bus, &bus_fd);
+    camera.busFd = bus_fd.fd;
+    WatchFd(camera.busFd, camera.index, EPOLL_CTL_ADD);
+    BeginTrial(camera, false);
+}
+
+// The live part of an update goes onto the running pipeline right away, as a transaction of its own
+bool ApplyLiveUpdate(Camera &camera, const StreamingConfig &target) {
+    std::cout << "Config change detected - applying dynamic update\n";
+    if (!UpdatePipelineProperties(camera.pipeline, camera.current, target, camera)) { return false; }
+    PrepareTrial(camera, camera.pipeline, GetLatestCapturedPts(GST_OBJECT_NAME(camera.pipeline)));
+
+    {
+        std::lock_guard<std::mutex> lock(pipelines_mutex);
+        camera.current = target;
+    }
+    camera.liveUpdates++;
+    std::cout << "Camera " << camera.descriptor.name << " config version " << camera.seenVersion << " applied " <<
+            GetCurrentUs() - camera.updateUs.load() << " us after the update\n";
+    BeginTrial(camera, true);
+    return true;
+}
+
+void ReportCoalescing(const Camera &camera, const std::string &outcome) {
+    std::cout << "Camera " << camera.descriptor.name << ": " << camera.coalescedUpdates << " structural updates " << outcome <<
+            " (" << camera.rebuilds << " rebuilds, " << camera.rebuildsAvoided << " avoided, " << camera.liveUpdates <<
+            " live updates so far)\n";
+    EmitEvent("coalescing", camera.descriptor.name, {{"updates", camera.coalescedUpdates}, {"outcome", outcome},
+                                                     {"rebuilds", camera.rebuilds}, {"rebuilds_avoided", camera.rebuildsAvoided},
+                                                     {"live_updates", camera.liveUpdates}});
+}
+
+void ServiceStreamingCamera(Camera &camera) {
+    const std::string &name = camera.descriptor.name;
+    bool rebuild = false;
+    bool error_during_streaming = false;
+
+    // Drain everything, messages left on the bus would keep its fd readable
+    while (GstMessage *msg = gst_bus_pop(camera.bus)) {
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR || GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS) {
+            std::cerr << "Camera " << name << " received error/EOS during streaming\n";
+            rebuild = true;
+            error_during_streaming = true;
+        }
+        gst_message_unref(msg);
+    }
+
+    // Check for config changes
+    const uint64_t current_version = camera.version.load(std::memory_order_relaxed);
+    if (!rebuild && current_version != camera.seenVersion) {
+        StreamingConfig new_cfg;
+        {
+            std::lock_guard<std::mutex> lk(cfg_mutex);
+            new_cfg = camera.desired;
+            camera.seenVersion = camera.version.load(std::memory_order_relaxed);
+        }
 
-                // Check if we can update dynamically (only quality/bitrate changed)
-                if (CanUpdateDynamically(current_configs[sensorId], new_cfg)) {
-                    std::cout << "Config change detected - applying dynamic update\n";
-                    if (UpdatePipelineProperties(pipeline, new_cfg, sensorId)) {
-                        // Update successful, store new config
-                        current_configs[sensorId] = new_cfg;
-                        // NO rebuild needed!
-                    } else {
-                        std::cerr << "Dynamic update failed, will rebuild pipeline\n";
-                        rebuild = true;
-                    }
-                } else {
-                    std::cout << "Config change requires pipeline rebuild\n";
-                    rebuild = true;
+        if (!IsCameraNeeded(camera, new_cfg, camera.seenVersion)) {
+            std::cout << "Camera " << name << " no longer needed\n";
+            rebuild = true;
+        } else {
+            const HotUpdatePlan plan = GetHotUpdatePlan(camera.current, new_cfg);
+            if (plan.rebuild) {
+                // A burst of structural changes ends up in a single rebuild with the latest values
+                const auto now = std::chrono::steady_clock::now();
+                if (!camera.rebuildPending) {
+                    camera.rebuildPending = true;
+                    camera.rebuildPendingSince = now;
                 }
+                camera.coalescedUpdates++;
+                camera.rebuildAt = std::min(now + std::chrono::milliseconds(coalesce_ms),
+                                            camera.rebuildPendingSince + std::chrono::milliseconds(coalesce_ms * COALESCE_MAX_WINDOWS));
+                std::cout << "Changed " << plan.reason << " needs a pipeline rebuild, waiting " << coalesce_ms <<
+                        " ms for further updates\n";
             }
-        }
 
-        gst_object_unref(bus);
-        StopPipeline(pipeline);
+            const StreamingConfig target = plan.rebuild ? GetLiveSubset(camera.current, new_cfg) : new_cfg;
+            if (target != camera.current && !ApplyLiveUpdate(camera, target)) {
+                std::cerr << "Dynamic update failed, will rebuild pipeline\n";
+                rebuild = true;
+            }
+        }
+    }
 
+    // Once the burst is over, the rebuild is only needed if the structural fields did not end up where they started
+    if (!rebuild && camera.rebuildPending && std::chrono::steady_clock::now() >= camera.rebuildAt) {
+        StreamingConfig desired;
         {
-            std::lock_guard<std::mutex> lock(pipelines_mutex);
-            pipelines[sensorId] = nullptr;
+            std::lock_guard<std::mutex> lk(cfg_mutex);
+            desired = camera.desired;
         }
 
+        if (GetHotUpdatePlan(camera.current, desired).rebuild) {
+            camera.rebuilds++;
+            camera.rebuildsAvoided += camera.coalescedUpdates - 1;
+            ReportCoalescing(camera, "coalesced into one rebuild");
+            rebuild = true;
+        } else {
+            camera.rebuildsAvoided += camera.coalescedUpdates;
+            ReportCoalescing(camera, "cancelled out, no rebuild");
+        }
+        camera.rebuildPending = false;
+        camera.coalescedUpdates = 0;
+    }
+
+    // The first packet since the last change commits it, no packet by the deadline rejects it
+    std::string rejection = error_during_streaming ? "error before the first frame" : "";
+    if (camera.trial && camera.trialPacketUs.load() != 0) {
+        CommitTrial(camera);
+    } else if (!rebuild && camera.trial && camera.trialHasDeadline && std::chrono::steady_clock::now() >= camera.trialDeadline) {
+        rejection = "no frame within the deadline";
+        if (!camera.liveTrial || !RollBackLive(camera, rejection)) {
+            rebuild = true;
+            error_during_streaming = true;
+        }
+    }
+
+    if (!rebuild) {
+        RearmStreamingTimer(camera);
+        return;
+    }
+    const StreamingConfig failedCfg = camera.current;
+    const bool inTrial = camera.trial;
+    camera.trial = false;
+    StopCamera(camera);
+
+    if (error_during_streaming) {
+        if (!inTrial || !RollBack(camera, failedCfg, rejection, CAMERA_RELEASE_MS)) {
+            FailCamera(camera);
+        }
+    } else {
         // Give camera hardware time to fully release before rebuilding
-        if (rebuild && !stop_requested.load()) {
-            // If error occurred during streaming, increment failure counter
-            if (error_during_streaming) {
-                consecutive_failures++;
-            }
+        std::cout << "Waiting for camera " << name << " to fully release...\n";
+        ScheduleRetry(camera, CAMERA_RELEASE_MS);
+    }
+}
 
-            // Apply exponential backoff if we have repeated failures
-            if (consecutive_failures > 0) {
-                // Exponential backoff: 200ms, 500ms, 1s, 2s, 5s, then 10s
-                int backoff_ms = consecutive_failures < MAX_CONSECUTIVE_FAILURES ?
-                                            (200 * (1 << (consecutive_failures - 1))) : 10000;
-                std::cerr << "Camera " << sensorId << " had " << consecutive_failures
-                          << " consecutive failures, waiting " << backoff_ms << "ms before retry\n";
-                std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
-            } else {
-                // Normal rebuild (config change), use shorter delay
-                std::cout << "Waiting for camera " << sensorId << " to fully release...\n";
-                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+// Runs on a worker whenever one of the camera's fds fires. Everything pending is handled in one go, so a
+// worker that had to wait for the mutex behind another one usually finds nothing left to do.
+void ServiceCamera(Camera &camera) {
+    std::lock_guard<std::mutex> lock(camera.serviceMutex);
+    if (stop_requested.load()) { return; }
+
+    const bool wasStandby = camera.standby;
+    const uint64_t cpuBegin = GetThreadCpuNs();
+
+    DrainWakeup(camera.wakeup);
+    DrainWakeup(camera.timer);
+    if (camera.pipeline != nullptr) {
+        ServiceStreamingCamera(camera);
+    }
+    if (camera.pipeline == nullptr) {
+        StartCamera(camera);
+    }
+
+    if (wasStandby && camera.standby) {
+        camera.standbyMeter.cpuNs += GetThreadCpuNs() - cpuBegin;
+    }
+
+    // Not the fd of the event, a bus torn down meanwhile may have left its number to another camera's new bus
+    WatchFd(camera.wakeup, camera.index, EPOLL_CTL_MOD);
+    WatchFd(camera.timer, camera.index, EPOLL_CTL_MOD);
+    if (camera.busFd >= 0) {
+        WatchFd(camera.busFd, camera.index, EPOLL_CTL_MOD);
+    }
+}
+
+void RunCameraWorker() {
+    epoll_event events[8];
+    while (!stop_requested.load()) {
+        const int count = epoll_wait(engine_epoll, events, 8, -1);
+        if (count < 0 && errno != EINTR) {
+            std::cerr << "Camera worker epoll failed: " << strerror(errno) << "\n";
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == ENGINE_STOP_EVENT) { continue; }
+            ServiceCamera(*cameras[events[i].data.u64 >> 32]);
+        }
+    }
+}
+
+// Sends EOS to all running pipelines at once, so that encoders, senders and recordings flush, then releases all
+// cameras in parallel. Both steps are bounded, a sensor stuck in its driver must not hold up a service restart.
+void ShutdownCameras() {
+    const auto begin = std::chrono::steady_clock::now();
+    const auto drainDeadline = begin + std::chrono::milliseconds(shutdown_ms / 2);
+    const auto releaseDeadline = begin + std::chrono::milliseconds(shutdown_ms);
+
+    for (auto &camera: cameras) {
+        if (camera->pipeline == nullptr) { continue; }
+        DrainRecordingWithPipeline(camera->pipeline);
+        gst_element_send_event(camera->pipeline, gst_event_new_eos());
+    }
+
+    for (auto &camera: cameras) {
+        if (camera->pipeline == nullptr) { continue; }
+        const auto left = std::max(drainDeadline - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration::zero());
+        GstMessage *msg = gst_bus_timed_pop_filtered(camera->bus, std::chrono::duration_cast<std::chrono::nanoseconds>(left).count(),
+                                                     static_cast<GstMessageType>(GST_MESSAGE_ERROR | GST_MESSAGE_EOS));
+        if (msg == nullptr) {
+            std::cerr << "Camera " << camera->descriptor.name << " did not drain in time\n";
+        } else {
+            gst_message_unref(msg);
+        }
+    }
+    const auto drained = std::chrono::steady_clock::now();
+
+    std::vector<GstElement *> releasing;
+    for (auto &camera: cameras) {
+        if (camera->pipeline != nullptr) {
+            epoll_ctl(engine_epoll, EPOLL_CTL_DEL, camera->busFd, nullptr);
+            gst_object_unref(camera->bus);
+            {
+                std::lock_guard<std::mutex> lock(pipelines_mutex);
+                pipelines[camera->index] = nullptr;
             }
+            releasing.push_back(camera->pipeline);
+            camera->pipeline = nullptr;
+        }
+        if (camera->warmPipeline != nullptr) {
+            releasing.push_back(camera->warmPipeline);
+            camera->warmPipeline = nullptr;
         }
     }
+
+    // Detached, a release that misses the deadline is left to the process exit
+    struct ReleaseState {
+        std::mutex mutex;
+        std::condition_variable released;
+    };
+    auto state = std::make_shared<ReleaseState>();
+    releasing_pipelines.store(static_cast<int>(releasing.size()));
+    for (GstElement *pipeline: releasing) {
+        std::thread([pipeline, state] {
+            StopPipeline(pipeline);
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                releasing_pipelines.fetch_sub(1);
+            }
+            state->released.notify_all();
+        }).detach();
+    }
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->released.wait_until(lock, releaseDeadline, [] { return releasing_pipelines.load() == 0; });
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    EmitEvent("shutdown", "", {{"pipelines", releasing.size()},
+                               {"total_ms", std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()},
+                               {"drain_ms", std::chrono::duration_cast<std::chrono::milliseconds>(drained - begin).count()},
+                               {"release_ms", std::chrono::duration_cast<std::chrono::milliseconds>(end - drained).count()},
+                               {"still_releasing", releasing_pipelines.load()}});
+    std::cout << "Shutdown of " << releasing.size() << " pipelines took " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " ms (EOS drain " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(drained - begin).count() << " ms, release " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - drained).count() << " ms)\n";
+    if (releasing_pipelines.load() > 0) {
+        std::cerr << releasing_pipelines.load() << " pipelines still releasing after " << shutdown_ms << " ms\n";
+    }
 }
 
-int RunCameraStreaming() {
-    std::cout << "Streaming driver running; waiting for updates on stdin\n";
-    std::thread t0(RunCameraStreamingPipelineDynamic, 0);
-    std::thread t1(RunCameraStreamingPipelineDynamic, 1);
+int RunCameraStreaming(int workerCount) {
+    engine_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (engine_epoll < 0) {
+        std::cerr << "Cannot create the camera epoll set: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    epoll_event stop_event{};
+    stop_event.events = EPOLLIN;
+    stop_event.data.u64 = ENGINE_STOP_EVENT;
+    epoll_ctl(engine_epoll, EPOLL_CTL_ADD, engine_stop, &stop_event);
+
+    for (auto &camera: cameras) {
+        WatchFd(camera->wakeup, camera->index, EPOLL_CTL_ADD);
+        WatchFd(camera->timer, camera->index, EPOLL_CTL_ADD);
+        // All cameras start right away, only the sensor opening itself is serialized (see OpenCameraPipeline).
+        // The per-frame instrumentation they share is locked and set up before PLAYING (see logging.h).
+        ScheduleRetry(*camera, 0);
+    }
+
+    std::cout << "Streaming driver running " << cameras.size() << " cameras on " << workerCount <<
+            " workers; waiting for updates on stdin\n";
+    json cameraNames = json::array();
+    for (const auto &camera: cameras) {
+        cameraNames.push_back(camera->descriptor.name);
+    }
+    EmitEvent("started", "", {{"cameras", cameraNames}, {"workers", workerCount}});
+    std::vector<std::thread> workers;
+    for (int i = 0; i < workerCount; i++) {
+        workers.emplace_back(RunCameraWorker);
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    // The workers are gone, tear the cameras down from here
+    ShutdownCameras();
 
-    t0.join();
-    t1.join();
+    close(engine_epoll);
     return 0;
 }
 
-Codec GetCodecFromString(const std::string &codecString) {
-    if (codecString == "JPEG") return Codec::JPEG;
-    if (codecString == "VP8") return Codec::VP8;
-    if (codecString == "VP9") return Codec::VP9;
-    if (codecString == "H264") return Codec::H264;
-    if (codecString == "H265") return Codec::H265;
-    throw std::invalid_argument("Invalid codec passed!");
-}
-
-VideoMode GetVideoModeFromString(const std::string &videoModeString) {
-    if (videoModeString == "stereo") return VideoMode::STEREO;
-    if (videoModeString == "mono") return VideoMode::MONO;
-    throw std::invalid_argument("Invalid video mode passed!");
-}
-
-StreamingConfig ConfigFromJson(const json &c) {
-    StreamingConfig out;
-    out.ip = c.at("ip").get<std::string>();
-    out.portLeft = c.at("portLeft").get<int>();
-    out.portRight = c.at("portRight").get<int>();
-    out.codec = GetCodecFromString(c.at("codec").get<std::string>());
-    out.encodingQuality = c.at("encodingQuality").get<int>();
-    out.bitrate = c.at("bitrate").get<int>();
-    out.horizontalResolution = c.at("horizontalResolution").get<int>();
-    out.verticalResolution = c.at("verticalResolution").get<int>();
-    out.videoMode = GetVideoModeFromString(c.at("videoMode").get<std::string>());
-    out.fps = c.at("fps").get<int>();
-    return out;
-}
+// Receiver mode: the frames are only counted here, the renderer and test tools hook into receiver.h the same way
+struct ReceivedStats {
+    uint64_t frames = 0;
+    uint64_t latencyUs = 0;
+    uint64_t windowBeginUs = GetCurrentUs();
+};
 
-std::string CodecToString(Codec codec) {
-    switch (codec) {
-        case JPEG: return "JPEG";
-        case VP8: return "VP8";
-        case VP9: return "VP9";
-        case H264: return "H264";
-        case H265: return "H265";
-        default: return "UNKNOWN";
+void OnDecodedFrame(const DecodedFrame &frame, void *userData) {
+    auto &stats = *static_cast<ReceivedStats *>(userData);
+    stats.frames++;
+    if (frame.captureUs != 0) {
+        stats.latencyUs += frame.decodedUs - frame.captureUs;
     }
+
+    const uint64_t elapsedUs = frame.decodedUs - stats.windowBeginUs;
+    if (elapsedUs < 1'000'000) { return; }
+    const double fps = stats.frames * 1e6 / elapsedUs;
+    const double latencyMs = stats.latencyUs / 1000.0 / stats.frames;
+    std::cout << "Camera " << frame.camera << " received " << fps << " frames/s, " << frame.width << "x" << frame.height <<
+            ", frame " << frame.frameId << ", " << latencyMs << " ms capture to decoded frame\n";
+    EmitEvent("received", frame.camera, {{"fps", fps}, {"frame_id", frame.frameId}, {"capture_to_frame_ms", latencyMs}});
+    stats = ReceivedStats{};
 }
 
-std::string VideoModeToString(VideoMode mode) {
-    switch (mode) {
-        case STEREO: return "STEREO";
-        case MONO: return "MONO";
-        default: return "UNKNOWN";
+int RunReceiving(const StreamingConfig &cfg, const std::vector<CameraDescriptor> &cameraMap) {
+    std::vector<GstElement *> receivers;
+    std::vector<std::unique_ptr<ReceivedStats> > stats;
+    int rc = 0;
+    for (size_t i = 0; i < cameraMap.size() && rc == 0; i++) {
+        // In MONO mode, only the first camera of the map is streamed
+        if (cfg.videoMode == VideoMode::MONO && i != 0) { continue; }
+
+        const CameraDescriptor &camera = cameraMap[i];
+        GstElement *pipeline = nullptr;
+        try {
+            pipeline = BuildReceivingPipeline(cfg, GetCameraPort(cfg, camera, static_cast<int>(i)), camera.name, RECEIVER_APPSINK);
+        } catch (const std::exception &e) {
+            std::cerr << "Camera " << camera.name << ": " << e.what() << "\n";
+            rc = 1;
+            break;
+        }
+        stats.push_back(std::make_unique<ReceivedStats>());
+        AttachFrameDelivery(pipeline, camera.name, OnDecodedFrame, stats.back().get());
+        receivers.push_back(pipeline);
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            std::cerr << "Unable to set the receiving pipeline of camera " << camera.name << " PLAYING\n";
+            rc = 1;
+        }
+    }
+
+    if (rc == 0) {
+        std::cout << "Receiving " << receivers.size() << " streams\n";
+    }
+
+    // Sleeps until a stop or a bus message, the same way the camera workers wait
+    std::vector<GstBus *> buses;
+    std::vector<pollfd> fds = {{engine_stop, POLLIN, 0}};
+    for (GstElement *pipeline: receivers) {
+        buses.push_back(gst_element_get_bus(pipeline));
+        GPollFD busFd;
+        gst_bus_get_pollfd(buses.back(), &busFd);
+        fds.push_back({busFd.fd, POLLIN, 0});
     }
+    while (rc == 0 && !stop_requested.load()) {
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+            std::cerr << "Receiver poll failed: " << strerror(errno) << "\n";
+            rc = 1;
+            break;
+        }
+        for (size_t i = 0; i < buses.size(); i++) {
+            if (!(fds[i + 1].revents & POLLIN)) { continue; }
+            // The bus fd stays readable while any message is queued, so all of them are popped
+            while (GstMessage *msg = gst_bus_pop(buses[i])) {
+                if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR || GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS) {
+                    std::cerr << GST_OBJECT_NAME(receivers[i]) << " received error/EOS\n";
+                    rc = 1;
+                }
+                gst_message_unref(msg);
+            }
+        }
+    }
+
+    for (GstBus *bus: buses) {
+        gst_object_unref(bus);
+    }
+    for (GstElement *pipeline: receivers) {
+        StopPipeline(pipeline);
+    }
+    return rc;
 }
 
 void DumpConfig(const StreamingConfig &cfg) {
@@ -401,68 +944,408 @@ void DumpConfig(const StreamingConfig &cfg) {
     std::cout << "  Resolution: " << cfg.horizontalResolution << "x" << cfg.verticalResolution << "\n";
     std::cout << "  Video Mode: " << VideoModeToString(cfg.videoMode) << "\n";
     std::cout << "  FPS: " << cfg.fps << "\n";
+    std::cout << "  MTU: " << cfg.mtu << "\n";
+    std::cout << "  Pacing: " << cfg.pacing << "\n";
+    std::cout << "  Batch Send: " << (cfg.batchSend ? "yes" : "no") << "\n";
+    std::cout << "  Slices: " << cfg.slices << "\n";
+    std::cout << "  Restart Interval: " << cfg.restartInterval << "\n";
+    std::cout << "  Stage Queues: " << ((cfg.stageQueues & STAGE_QUEUE_CAPTURE) ? "capture " : "") <<
+            ((cfg.stageQueues & STAGE_QUEUE_CONVERT) ? "convert " : "") <<
+            ((cfg.stageQueues & STAGE_QUEUE_ENCODE) ? "encode " : "") << "(" << cfg.stageQueueMs << " ms)\n";
+    std::cout << "  Shared Memory Output: " << ShmOutputModeToString(cfg.shmOutput) << " (" << cfg.shmSlots << " slots)\n";
     std::cout << "==========================\n";
 }
 
+// Only async-signal-safe calls in here, the workers and ShutdownCameras() do the actual work
 void SignalHandler(int signum) {
-    std::cout << "Interrupt signal (" << signum << ") received. Will be stopping " << pipelines.size() <<
-            " pipelines!\n";
+    if (signals_received.fetch_add(1) > 0) {
+        _exit(128 + signum); // a second signal gives up on the graceful shutdown
+    }
+    stop_requested.store(true);
+    Wake(engine_stop);
+}
 
-    std::lock_guard<std::mutex> lock(pipelines_mutex);
-    for (auto pipeline: pipelines) {
-        StopPipeline(pipeline);
+// Camera names end up in pipeline, shared-memory and file names, so they are kept to a safe character set
+CameraDescriptor CameraFromJson(const json &c, int index) {
+    CameraDescriptor out;
+    out.sensorId = c.value("sensorId", index);
+    out.name = c.value("name", "camera" + std::to_string(index));
+    out.port = c.value("port", 0);
+    out.orientation = c.value("orientation", out.orientation);
+    if (out.sensorId < 0) throw std::invalid_argument("Invalid camera sensor id passed!");
+    if (out.name.empty() || out.name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != std::string::npos)
+        throw std::invalid_argument("Invalid camera name passed!");
+    if (out.port < 0 || out.port > 65535 || (out.port == 0 && index > 1)) throw std::invalid_argument("Invalid camera port passed!");
+    if (!IsValidOrientation(out.orientation)) throw std::invalid_argument("Invalid camera orientation passed!");
+    return out;
+}
+
+// The map is a JSON array of {"sensorId", "name", "port", "orientation"}, in the order the cameras are indexed
+std::vector<CameraDescriptor> LoadCameraMap(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) throw std::invalid_argument("Cannot open camera map " + path);
+
+    const json map = json::parse(file);
+    if (!map.is_array() || map.empty()) throw std::invalid_argument("Invalid camera map passed!");
+
+    std::vector<CameraDescriptor> out;
+    for (const auto &entry: map) {
+        out.push_back(CameraFromJson(entry, static_cast<int>(out.size())));
+        for (size_t i = 0; i + 1 < out.size(); i++) {
+            if (out[i].name == out.back().name) throw std::invalid_argument("Duplicate camera name passed!");
+        }
     }
+    return out;
+}
 
-    exit(signum);
+RecordingConfig RecordingConfigFromJson(const json &c) {
+    RecordingConfig out;
+    out.directory = c.value("directory", out.directory);
+    out.segmentSeconds = c.value("segmentSeconds", out.segmentSeconds);
+    out.maxDiskMb = c.value("maxDiskMb", out.maxDiskMb);
+    if (out.directory.empty()) throw std::invalid_argument("Invalid recording directory passed!");
+    if (out.segmentSeconds < 1) throw std::invalid_argument("Invalid recording segment duration passed!");
+    if (out.maxDiskMb < 1) throw std::invalid_argument("Invalid recording disk budget passed!");
+    return out;
 }
 
-void ControlLoop() {
-    std::string line;
-    while (std::getline(std::cin, line)) {
-        if (line.empty()) continue;
+void SetRecording(bool enabled, const RecordingConfig &cfg) {
+    {
+        std::lock_guard<std::mutex> lk(recording_mutex);
+        recording_requested = enabled;
+        recording_cfg = cfg;
+    }
 
-        try {
-            json msg = json::parse(line);
-            const std::string cmd = msg.value("cmd", "");
-
-            if (cmd == "update") {
-                StreamingConfig cfg = ConfigFromJson(msg.at("config"));
-                {
-                    std::lock_guard<std::mutex> lk(cfg_mutex);
-                    desired_cfg = cfg;
-                    cfg_version.fetch_add(1, std::memory_order_relaxed);
-                }
-                std::cout << "Config updated (version " << cfg_version.load() << ")\n";
-                DumpConfig(cfg);
-            } else if (cmd == "stop") {
-                stop_requested.store(true);
-                break;
+    // Stopping waits for each branch to drain, which must not hold up the workers, so it runs on references
+    // taken under the lock
+    std::vector<GstElement *> stopping;
+    {
+        std::lock_guard<std::mutex> lock(pipelines_mutex);
+        for (size_t index = 0; index < pipelines.size(); index++) {
+            if (pipelines[index] == nullptr) { continue; }
+            if (enabled) {
+                StartRecording(pipelines[index], cameras[index]->current.codec, cfg);
+            } else {
+                stopping.push_back(static_cast<GstElement *>(gst_object_ref(pipelines[index])));
             }
-        } catch (const std::exception &e) {
-            std::cerr << "Bad control message: " << e.what() << "\n";
         }
     }
+    for (GstElement *pipeline: stopping) {
+        StopRecording(pipeline);
+        gst_object_unref(pipeline);
+    }
+}
+
+// "camera" selects a single camera by its index in the map or its name, without it the update applies to all
+std::vector<int> GetTargetCameras(const json &msg) {
+    std::vector<int> targets;
+    if (!msg.contains("camera")) {
+        for (int index = 0; index < static_cast<int>(cameras.size()); index++) {
+            targets.push_back(index);
+        }
+        return targets;
+    }
+
+    const json &camera = msg.at("camera");
+    int index = -1;
+    if (camera.is_string()) {
+        for (const auto &candidate: cameras) {
+            if (candidate->descriptor.name == camera.get<std::string>()) { index = candidate->index; }
+        }
+    } else {
+        index = camera.get<int>();
+    }
+    if (index < 0 || index >= static_cast<int>(cameras.size())) throw std::invalid_argument("Invalid camera passed!");
+    targets.push_back(index);
+    return targets;
+}
+
+// Only a camera whose config actually changes gets a new version, the others are not touched
+void SetDesiredConfig(int index, const StreamingConfig &cfg) {
+    Camera &camera = *cameras[index];
+    {
+        std::lock_guard<std::mutex> lk(cfg_mutex);
+        // Sending a rejected config again retries it
+        if (camera.version.load() != 0 && camera.desired == cfg && camera.rejectedVersion.load() != camera.version.load()) {
+            std::cout << "Camera " << camera.descriptor.name << " config unchanged\n";
+            return;
+        }
+        camera.desired = cfg;
+        camera.updateUs.store(GetCurrentUs());
+        camera.version.fetch_add(1, std::memory_order_relaxed);
+    }
+    Wake(camera.wakeup);
+    MarkStartup("first config", camera.descriptor.name);
+    std::cout << "Camera " << camera.descriptor.name << " config updated (version " << camera.version.load() << ")\n";
+    EmitEvent("config_accepted", camera.descriptor.name, {{"version", camera.version.load()}, {"codec", CodecToString(cfg.codec)},
+                                                          {"width", cfg.horizontalResolution}, {"height", cfg.verticalResolution},
+                                                          {"fps", cfg.fps}});
+}
+
+// Returns false on the stop command
+bool HandleControlMessage(const std::string &line) {
+    try {
+        json msg = json::parse(line);
+        const std::string cmd = msg.value("cmd", "");
+
+        if (cmd == "update") {
+            StreamingConfig cfg = ConfigFromJson(msg.at("config"));
+            for (int index: GetTargetCameras(msg)) {
+                SetDesiredConfig(index, cfg);
+            }
+            DumpConfig(cfg);
+        } else if (cmd == "record") {
+            const std::string action = msg.value("action", "start");
+            if (action == "start") {
+                SetRecording(true, RecordingConfigFromJson(msg));
+            } else if (action == "stop") {
+                SetRecording(false, recording_cfg);
+            } else {
+                throw std::invalid_argument("Invalid recording action passed!");
+            }
+        } else if (cmd == "stop") {
+            return false;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Bad control message: " << e.what() << "\n";
+        EmitEvent("config_rejected", "", {{"reason", e.what()}});
+    }
+    return true;
+}
+
+// stdin is polled together with the stop eventfd, so that a signal also ends this thread
+void ControlLoop() {
+    std::string pending;
+    char chunk[4096];
+    bool running = true;
+
+    while (running && !stop_requested.load()) {
+        pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {engine_stop, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+        if (fds[1].revents & POLLIN) { break; }
+
+        const ssize_t count = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (count < 0 && errno == EINTR) { continue; }
+        if (count <= 0) { break; } // stdin closed
+
+        pending.append(chunk, count);
+        size_t newline;
+        while (running && (newline = pending.find('\n')) != std::string::npos) {
+            const std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (!line.empty()) {
+                running = HandleControlMessage(line);
+            }
+        }
+    }
+
+    stop_requested.store(true);
+    WakeWorkers();
+}
+
+// Soak mode replaces stdin with a seeded churn of updates through the same path (see soak.h). Returns 2 when
+// anything drifted past its threshold.
+int SoakLoop(SoakRecorder &recorder, uint64_t updates, uint32_t seed, int intervalMs, const SoakThresholds &thresholds,
+             const std::string &reportPath) {
+    std::mt19937 rng(seed);
+    json config = SOAK_INITIAL_CONFIG;
+    std::cout << "Soak: " << updates << " updates every " << intervalMs << " ms, seed " << seed << "\n";
+
+    const auto begin = std::chrono::steady_clock::now();
+    auto nextSample = begin;
+    uint64_t sent = 0;
+    while (sent < updates && !stop_requested.load()) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= nextSample) {
+            const SoakSample sample = TakeSoakSample(recorder, std::chrono::duration<double>(now - begin).count(), sent);
+            std::cout << "Soak " << sample.elapsedS << " s: " << sent << " updates, " << sample.rebuilds << " rebuilds, RSS " <<
+                    sample.rssKb / 1024 << " MB, " << sample.threads << " threads, " << sample.fds << " fds, " <<
+                    sample.liveObjects << " GstObjects\n";
+            nextSample += std::chrono::milliseconds(SOAK_SAMPLE_MS);
+        }
+        HandleControlMessage(GetSoakUpdate(rng, config, static_cast<int>(cameras.size())).dump());
+        sent++;
+
+        pollfd stop = {engine_stop, POLLIN, 0};
+        poll(&stop, 1, intervalMs);
+    }
+    TakeSoakSample(recorder, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(), sent);
+
+    bool passed = false;
+    const json checks = CheckSoakDrift(recorder, thresholds, passed);
+    const json report = GetSoakReport(recorder, checks, passed, seed);
+    if (!reportPath.empty()) {
+        std::ofstream file(reportPath, std::ios::trunc);
+        file << report.dump(2) << "\n";
+    }
+    std::cout << "Soak " << (passed ? "passed" : "FAILED") << " after " << sent << " updates, " <<
+            report["rebuilds"]["count"] << " rebuilds, p95 " << report["rebuilds"]["p95_ms"] << " ms\n";
+    EmitEvent("soak_done", "", {{"passed", passed}, {"updates", sent}, {"rebuilds", report["rebuilds"]["count"]},
+                                {"rebuild_p95_ms", report["rebuilds"]["p95_ms"]}, {"checks", checks}});
 
     stop_requested.store(true);
+    WakeWorkers();
+    return passed ? 0 : 2;
 }
 
 int main(int argc, char *argv[]) {
+    BeginStartupTimeline();
     std::vector<std::string> argList(argv + 1, argv + argc);
 
     // Disable stdout buffering for real-time logging
     std::cout.setf(std::ios::unitbuf);
     std::cerr.setf(std::ios::unitbuf);
 
+    // --log human|events|both picks free-form text, JSON-lines events (see events.h) or both, text then on stderr
+    LogMode logMode = LOG_HUMAN;
+    // --warm-standby opens the cameras before the first update arrives, with the default config (JPEG 1920x1080@60)
+    // or the one of --warm-config <config.json>. Only a first config differing in live-settable fields from it
+    // gets the warm pipeline, e.g. another codec or resolution still reopens the camera.
+    warm_standby = std::find(argList.begin(), argList.end(), "--warm-standby") != argList.end();
+    // --registry-update rescans the plugin directories, needed once after installing or updating plugins
+    const bool registryUpdate = std::find(argList.begin(), argList.end(), "--registry-update") != argList.end();
+
+    // --cameras <file.json> replaces the default stereo pair, --workers <n> sizes the pool servicing them,
+    // --apply-deadline-ms <ms> is how long a new config may go without a frame before it is rolled back,
+    // --coalesce-ms <ms> is how long structural changes wait for further updates (0 rebuilds right away),
+    // --shutdown-ms <ms> caps the EOS drain and camera release on stop,
+    // --receive <config.json> runs the receiving side of the cameras in that streaming config instead (not on Jetson),
+    // --soak <updates> churns the cameras with that many updates instead of reading stdin and fails on drift, with
+    // --soak-seed <n>, --soak-interval-ms <ms> between updates, --soak-thresholds <file.json> and --soak-report <file.json>
+    std::vector<CameraDescriptor> cameraMap = GetDefaultCameraMap();
+    int workerCount = 0;
+    std::string receiveConfigPath;
+    uint64_t soakUpdates = 0;
+    uint32_t soakSeed = 1;
+    int soakIntervalMs = 50;
+    SoakThresholds soakThresholds{};
+    std::string soakReportPath;
+    for (size_t i = 0; i + 1 < argList.size(); i++) {
+        try {
+            if (argList[i] == "--log") {
+                const std::string &mode = argList[i + 1];
+                if (mode == "human") { logMode = LOG_HUMAN; }
+                else if (mode == "events") { logMode = LOG_EVENTS; }
+                else if (mode == "both") { logMode = LOG_BOTH; }
+                else throw std::invalid_argument("Invalid log mode passed!");
+            } else if (argList[i] == "--receive") {
+#ifdef JETSON
+                // The Jetson build only has the sending pipelines, receive on a desktop build instead
+                throw std::invalid_argument("--receive is not supported on the Jetson build!");
+#else
+                receiveConfigPath = argList[i + 1];
+#endif
+            } else if (argList[i] == "--warm-config") {
+                std::ifstream file(argList[i + 1]);
+                if (!file) throw std::invalid_argument("Cannot open " + argList[i + 1]);
+                warm_standby_cfg = ConfigFromJson(json::parse(file));
+            } else if (argList[i] == "--cameras") {
+                cameraMap = LoadCameraMap(argList[i + 1]);
+            } else if (argList[i] == "--apply-deadline-ms") {
+                apply_deadline_ms = std::stoi(argList[i + 1]);
+                if (apply_deadline_ms < 1) throw std::invalid_argument("Invalid apply deadline passed!");
+            } else if (argList[i] == "--coalesce-ms") {
+                coalesce_ms = std::stoi(argList[i + 1]);
+                if (coalesce_ms < 0) throw std::invalid_argument("Invalid coalescing window passed!");
+            } else if (argList[i] == "--shutdown-ms") {
+                shutdown_ms = std::stoi(argList[i + 1]);
+                if (shutdown_ms < 1) throw std::invalid_argument("Invalid shutdown deadline passed!");
+            } else if (argList[i] == "--soak") {
+                soakUpdates = std::stoull(argList[i + 1]);
+                if (soakUpdates < 1) throw std::invalid_argument("Invalid soak update count passed!");
+            } else if (argList[i] == "--soak-seed") {
+                soakSeed = static_cast<uint32_t>(std::stoul(argList[i + 1]));
+            } else if (argList[i] == "--soak-interval-ms") {
+                soakIntervalMs = std::stoi(argList[i + 1]);
+                if (soakIntervalMs < 0) throw std::invalid_argument("Invalid soak interval passed!");
+            } else if (argList[i] == "--soak-thresholds") {
+                std::ifstream file(argList[i + 1]);
+                if (!file) throw std::invalid_argument("Cannot open " + argList[i + 1]);
+                soakThresholds = SoakThresholdsFromJson(json::parse(file));
+            } else if (argList[i] == "--soak-report") {
+                soakReportPath = argList[i + 1];
+            } else if (argList[i] == "--workers") {
+                workerCount = std::stoi(argList[i + 1]);
+                if (workerCount < 1) throw std::invalid_argument("Invalid worker count passed!");
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "Bad command line: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (workerCount == 0) {
+        workerCount = std::min(static_cast<int>(cameraMap.size()), 4);
+    }
+    SetLogMode(logMode);
+
+    engine_stop = CreateWakeup();
+    for (const auto &descriptor: cameraMap) {
+        cameras.push_back(std::make_unique<Camera>());
+        Camera &camera = *cameras.back();
+        camera.descriptor = descriptor;
+        camera.index = static_cast<int>(cameras.size()) - 1;
+        camera.wakeup = CreateWakeup();
+        camera.timer = CreateTimer();
+        if (engine_stop < 0 || camera.wakeup < 0 || camera.timer < 0) {
+            std::cerr << "Cannot create camera wakeup: " << strerror(errno) << "\n";
+            return 1;
+        }
+        std::cout << "Camera " << camera.index << ": " << descriptor.name << ", sensor " << descriptor.sensorId <<
+                ", port " << (descriptor.port > 0 ? std::to_string(descriptor.port) : camera.index == 0 ? "portLeft" : "portRight") <<
+                ", " << descriptor.orientation << "\n";
+    }
+    pipelines.assign(cameras.size(), nullptr);
+
+    if (!registryUpdate) {
+        DisableRegistryRescan();
+    }
+    if (soakUpdates > 0) {
+        EnableObjectTracking();
+    }
     gst_init(nullptr, nullptr);
     gst_debug_set_default_threshold(GST_LEVEL_ERROR);
+    MarkStartup("gst_init");
 
     signal(SIGTERM, SignalHandler);
+    signal(SIGINT, SignalHandler);
 
-    std::thread ctrl(ControlLoop);
-    int rc = RunCameraStreaming();
+    if (!receiveConfigPath.empty()) {
+        std::ifstream file(receiveConfigPath);
+        try {
+            if (!file) throw std::invalid_argument("Cannot open " + receiveConfigPath);
+            return RunReceiving(ConfigFromJson(json::parse(file)), cameraMap);
+        } catch (const std::exception &e) {
+            std::cerr << "Bad receive config: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    // Runs while the supervisor sends the first config, a camera starting meanwhile waits on the same plugin load
+    std::thread preload(PreloadStreamingPlugins);
+
+    SoakRecorder soakRecorder;
+    int soakRc = 0;
+    if (soakUpdates > 0) {
+        soak_recorder = &soakRecorder;
+    }
+    std::thread ctrl = soakUpdates == 0 ? std::thread(ControlLoop) : std::thread([&] {
+        soakRc = SoakLoop(soakRecorder, soakUpdates, soakSeed, soakIntervalMs, soakThresholds, soakReportPath);
+    });
+    int rc = RunCameraStreaming(workerCount);
 
     stop_requested.store(true);
+    WakeWorkers();
     ctrl.join();
+    rc = std::max(rc, soakRc);
+    preload.join();
+    DestroyShmRings();
 
+    // Skip the static destructors while a stuck camera release is still running in the background
+    if (releasing_pipelines.load() > 0) {
+        _exit(rc);
+    }
     return rc;
 }
@@ -0,0 +1,283 @@
+//
+// Loss and concealment test of the JPEG restart intervals (jpeg_restart.h): a frame with restart markers is
+// packetized as RTP/JPEG, packets are dropped and the rebuilt frame has to lose exactly the restart intervals the
+// dropped bytes touched. After concealment only those MCUs may differ from the intact decode, both in packed RGB and
+// in the I420 planes the quality measurement decodes to.
+// Usage: jpeg_concealment_test, exits 1 on a failure
+//
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "jpeg_restart.h"
+
+constexpr int WIDTH = 320, HEIGHT = 240; // 20x15 MCUs of 16x16, one restart interval per MCU row
+constexpr size_t PACKET_SCAN_BYTES = 200;
+
+int failures = 0;
+
+void Check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+std::vector<uint8_t> EncodeTestJpeg(int width, int height) {
+    std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+    uint32_t noise = 1;
+    for (size_t i = 0; i < rgb.size(); i++) {
+        noise = noise * 1664525 + 1013904223;
+        const size_t pixel = i / 3;
+        rgb[i] = static_cast<uint8_t>(pixel % width + pixel / width + (noise >> 27) + i % 3 * 40);
+    }
+
+    jpeg_compress_struct cinfo{};
+    jpeg_error_mgr err{};
+    unsigned char *outBuffer = nullptr;
+    unsigned long outSize = 0;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &outBuffer, &outSize);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = rgb.data() + static_cast<size_t>(cinfo.next_scanline) * width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    std::vector<uint8_t> jpeg(outBuffer, outBuffer + outSize);
+    jpeg_destroy_compress(&cinfo);
+    free(outBuffer);
+    return jpeg;
+}
+
+// Packed RGB without fancy upsampling, so that a pixel only depends on its own MCU
+bool DecodeJpeg(const std::vector<uint8_t> &jpeg, std::vector<uint8_t> &rgb) {
+    jpeg_decompress_struct cinfo{};
+    JpegErrorManager err{};
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = OnJpegError;
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_mem_src(&cinfo, jpeg.data(), jpeg.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+    rgb.assign(static_cast<size_t>(cinfo.output_width) * cinfo.output_height * 3, 0);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = rgb.data() + static_cast<size_t>(cinfo.output_scanline) * cinfo.output_width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+// Any mapping will do as long as every plane sample comes from its own MCU, here the top left pixel of its block
+std::vector<uint8_t> ToI420(const std::vector<uint8_t> &rgb, const std::vector<DecodedPlane> &planes) {
+    std::vector<uint8_t> frame(GetDecodedFrameSize(planes), 0);
+    for (size_t p = 0; p < planes.size(); p++) {
+        const DecodedPlane &plane = planes[p];
+        for (int y = 0; y < plane.height; y++) {
+            for (int x = 0; x < plane.width; x++) {
+                const size_t pixel = static_cast<size_t>(y * plane.ySub) * WIDTH + x * plane.xSub;
+                frame[plane.offset + static_cast<size_t>(y) * plane.stride + x] = rgb[pixel * 3 + p];
+            }
+        }
+    }
+    return frame;
+}
+
+void CheckPlanarConcealment(const std::string &name, const std::vector<uint8_t> &decoded, const std::vector<uint8_t> &intact,
+                            const std::set<uint32_t> &lost, uint16_t restartInterval, const AssembledJpeg &assembled) {
+    const auto planes = GetDecodedPlanes("I420", WIDTH, HEIGHT);
+    std::vector<uint8_t> frame = ToI420(decoded, planes);
+    const std::vector<uint8_t> reference = ToI420(intact, planes);
+    const std::vector<uint8_t> previous(frame.size(), 7);
+    ConcealJpegMcus(frame.data(), previous.data(), WIDTH, HEIGHT, planes, assembled);
+
+    const uint32_t mcusPerRow = WIDTH / assembled.mcuWidth;
+    size_t concealedWrong = 0, intactWrong = 0;
+    for (const auto &plane: planes) {
+        for (int y = 0; y < plane.height; y++) {
+            for (int x = 0; x < plane.width; x++) {
+                const uint32_t mcu = y * plane.ySub / assembled.mcuHeight * mcusPerRow + x * plane.xSub / assembled.mcuWidth;
+                const bool concealed = lost.count(mcu / restartInterval) > 0;
+                const size_t i = plane.offset + static_cast<size_t>(y) * plane.stride + x;
+                if (concealed && frame[i] != previous[i]) { concealedWrong++; }
+                if (!concealed && frame[i] != reference[i]) { intactWrong++; }
+            }
+        }
+    }
+    Check(concealedWrong == 0, name + ", I420: " + std::to_string(concealedWrong) + " concealed samples not from the previous frame");
+    Check(intactWrong == 0, name + ", I420: " + std::to_string(intactWrong) + " samples outside the lost intervals changed");
+}
+
+// The parts of a JPEG that RTP/JPEG carries
+struct ScanInfo {
+    std::vector<uint8_t> qtables; // luma then chroma, zigzag order
+    std::vector<uint8_t> scan; // entropy coded data without the EOI
+    uint16_t restartInterval = 0;
+    std::vector<size_t> markers; // offset of every restart marker in the scan
+};
+
+ScanInfo ParseJpeg(const std::vector<uint8_t> &jpeg) {
+    ScanInfo info;
+    size_t i = 2;
+    while (i + 4 <= jpeg.size()) {
+        const uint8_t marker = jpeg[i + 1];
+        const size_t length = jpeg[i + 2] << 8 | jpeg[i + 3];
+        if (marker == 0xdb) {
+            for (size_t t = i + 4; t + 65 <= i + 2 + length; t += 65) {
+                info.qtables.insert(info.qtables.end(), jpeg.begin() + t + 1, jpeg.begin() + t + 65);
+            }
+        } else if (marker == 0xdd) {
+            info.restartInterval = jpeg[i + 4] << 8 | jpeg[i + 5];
+        } else if (marker == 0xda) {
+            info.scan.assign(jpeg.begin() + i + 2 + length, jpeg.end() - 2);
+            break;
+        }
+        i += 2 + length;
+    }
+    for (size_t j = 0; j < info.scan.size(); j++) {
+        if (IsRestartMarker(info.scan, j)) {
+            info.markers.push_back(j);
+            j++;
+        }
+    }
+    return info;
+}
+
+// RFC 2435 payloads of type 65 (4:2:0 with restart markers), in-band tables in the first one
+std::vector<std::vector<uint8_t> > Packetize(const ScanInfo &info) {
+    std::vector<std::vector<uint8_t> > packets;
+    for (size_t offset = 0; offset < info.scan.size(); offset += PACKET_SCAN_BYTES) {
+        std::vector<uint8_t> payload = {
+            0, static_cast<uint8_t>(offset >> 16), static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset),
+            65, 255, WIDTH / 8, HEIGHT / 8,
+            static_cast<uint8_t>(info.restartInterval >> 8), static_cast<uint8_t>(info.restartInterval), 0xff, 0xff
+        };
+        if (offset == 0) {
+            payload.insert(payload.end(), {0, 0, static_cast<uint8_t>(info.qtables.size() >> 8), static_cast<uint8_t>(info.qtables.size())});
+            payload.insert(payload.end(), info.qtables.begin(), info.qtables.end());
+        }
+        const size_t end = std::min(offset + PACKET_SCAN_BYTES, info.scan.size());
+        payload.insert(payload.end(), info.scan.begin() + offset, info.scan.begin() + end);
+        packets.push_back(std::move(payload));
+    }
+    return packets;
+}
+
+// Restart interval k spans from its preceding marker to the end of its own, losing either marker loses it
+std::set<uint32_t> GetAffectedIntervals(const ScanInfo &info, const std::set<size_t> &dropped) {
+    std::set<uint32_t> affected;
+    const uint32_t intervals = static_cast<uint32_t>(info.markers.size()) + 1;
+    for (const size_t packet: dropped) {
+        const size_t from = packet * PACKET_SCAN_BYTES, to = std::min(from + PACKET_SCAN_BYTES, info.scan.size());
+        for (uint32_t k = 0; k < intervals; k++) {
+            const size_t begin = k == 0 ? 0 : info.markers[k - 1];
+            const size_t end = k < info.markers.size() ? info.markers[k] + 2 : info.scan.size();
+            if (from < end && to > begin) { affected.insert(k); }
+        }
+    }
+    return affected;
+}
+
+void CheckLoss(const std::string &name, RtpJpegAssembler &assembler, uint32_t rtpTimestamp, const ScanInfo &info,
+               const std::vector<std::vector<uint8_t> > &packets, const std::set<size_t> &dropped,
+               const std::vector<uint8_t> &intact) {
+    AssembledJpeg assembled;
+    bool finished = false;
+    for (size_t p = 0; p < packets.size(); p++) {
+        if (dropped.count(p) > 0) { continue; }
+        finished = PushRtpJpegPayload(assembler, rtpTimestamp, p + 1 == packets.size(), packets[p].data(), packets[p].size(),
+                                      assembled);
+    }
+    // Without the marker packet the frame only finishes with the first packet of the next one
+    if (!finished) {
+        finished = PushRtpJpegPayload(assembler, rtpTimestamp + 1, false, packets[1].data(), packets[1].size(), assembled);
+        assembler.active = false;
+        assembler.fragments.clear();
+    }
+    Check(finished, name + ": frame finished");
+    if (!finished) { return; }
+
+    std::set<uint32_t> lost;
+    for (const auto &range: assembled.lostMcus) {
+        Check(range.first % info.restartInterval == 0, name + ": lost range starts on a restart interval");
+        lost.insert(range.first / info.restartInterval);
+    }
+    const auto affected = GetAffectedIntervals(info, dropped);
+    Check(lost == affected, name + ": lost " + std::to_string(lost.size()) + " restart intervals, the drop touched " +
+                            std::to_string(affected.size()));
+
+    std::vector<uint8_t> decoded;
+    Check(DecodeJpeg(assembled.data, decoded) && decoded.size() == intact.size(), name + ": rebuilt frame decodes");
+    if (decoded.size() != intact.size()) { return; }
+    CheckPlanarConcealment(name, decoded, intact, lost, info.restartInterval, assembled);
+
+    // A flat previous frame stands out wherever it was copied in
+    const std::vector<uint8_t> previous(intact.size(), 7);
+    ConcealJpegMcus(decoded.data(), previous.data(), WIDTH, HEIGHT, WIDTH * 3, assembled);
+
+    const uint32_t mcusPerRow = WIDTH / assembled.mcuWidth;
+    size_t concealedWrong = 0, intactWrong = 0;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            const uint32_t mcu = y / assembled.mcuHeight * mcusPerRow + x / assembled.mcuWidth;
+            const bool concealed = lost.count(mcu / info.restartInterval) > 0;
+            const size_t i = (static_cast<size_t>(y) * WIDTH + x) * 3;
+            for (int c = 0; c < 3; c++) {
+                if (concealed && decoded[i + c] != previous[i + c]) { concealedWrong++; }
+                if (!concealed && decoded[i + c] != intact[i + c]) { intactWrong++; }
+            }
+        }
+    }
+    Check(concealedWrong == 0, name + ": " + std::to_string(concealedWrong) + " concealed samples not from the previous frame");
+    Check(intactWrong == 0, name + ": " + std::to_string(intactWrong) + " samples outside the lost intervals changed");
+}
+
+int main() {
+    std::vector<uint8_t> restarted;
+    const std::vector<uint8_t> source = EncodeTestJpeg(WIDTH, HEIGHT);
+    if (!AddJpegRestartMarkers(source.data(), source.size(), 1, restarted)) {
+        std::cerr << "FAILED: adding the restart markers\n";
+        return 1;
+    }
+    const ScanInfo info = ParseJpeg(restarted);
+    const auto packets = Packetize(info);
+    Check(info.restartInterval == WIDTH / 16 && info.markers.size() == HEIGHT / 16 - 1, "one restart interval per MCU row");
+    Check(packets.size() >= 8, "enough packets to drop some, got " + std::to_string(packets.size()));
+
+    std::vector<uint8_t> intact;
+    Check(DecodeJpeg(restarted, intact), "restarted frame decodes");
+    if (failures > 0) { return 1; }
+
+    RtpJpegAssembler assembler;
+    const size_t last = packets.size() - 1;
+    CheckLoss("no loss", assembler, 1000, info, packets, {}, intact);
+    CheckLoss("one packet in the middle", assembler, 2000, info, packets, {packets.size() / 2}, intact);
+    CheckLoss("two packets apart", assembler, 3000, info, packets, {2, packets.size() - 3}, intact);
+    CheckLoss("the packet carrying a restart marker", assembler, 3500, info, packets, {info.markers[4] / PACKET_SCAN_BYTES}, intact);
+    std::set<size_t> burst;
+    for (size_t p = info.markers[1] / PACKET_SCAN_BYTES; p <= info.markers[3] / PACKET_SCAN_BYTES; p++) {
+        burst.insert(p);
+    }
+    CheckLoss("a burst over several restart intervals", assembler, 4000, info, packets, burst, intact);
+    CheckLoss("the first packet, tables from the last frame", assembler, 5000, info, packets, {0}, intact);
+    CheckLoss("the marker packet", assembler, 6000, info, packets, {last}, intact);
+
+    std::cout << (failures == 0 ? "JPEG concealment test passed\n" : "JPEG concealment test failed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+//
+// Disk budget test of the recordings (recording.h): two cameras whose names are prefixes of each other record side
+// by side, pruning one camera down to its budget must delete its oldest segments and leave the other camera's alone.
+// Usage: recording_prune_test, exits 1 on a failure
+//
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "recording.h"
+
+constexpr size_t SEGMENT_BYTES = 1000;
+
+int failures = 0;
+
+void Check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+bool Exists(const std::string &path) {
+    struct stat st{};
+    return stat(path.c_str(), &st) == 0;
+}
+
+std::vector<std::string> WriteSegments(const std::string &prefix, int count) {
+    std::vector<std::string> paths;
+    for (int i = 0; i < count; i++) {
+        paths.push_back(prefix + "20260101-00000" + std::to_string(i) + "_" + std::to_string(i) + ".mkv");
+        std::ofstream(paths.back(), std::ios::binary) << std::string(SEGMENT_BYTES, 'x');
+    }
+    return paths;
+}
+
+// Oldest first, so the first `deleted` segments must be gone and the rest kept
+void CheckPruned(const std::string &name, const std::vector<std::string> &paths, size_t deleted) {
+    for (size_t i = 0; i < paths.size(); i++) {
+        Check(Exists(paths[i]) == (i >= deleted), name + ": " + paths[i] + (i < deleted ? " deleted" : " kept"));
+    }
+}
+
+void RemoveAll(const std::vector<std::string> &paths) {
+    for (const auto &path: paths) {
+        unlink(path.c_str());
+    }
+}
+
+int main() {
+    char directoryTemplate[] = "/tmp/recording_prune_test_XXXXXX";
+    if (mkdtemp(directoryTemplate) == nullptr) {
+        std::cerr << "FAILED: creating the test directory\n";
+        return 1;
+    }
+    const std::string directory = directoryTemplate;
+
+    // The layout StartRecording uses, one subdirectory per camera
+    const std::string front = GetRecordingPrefix(directory, "pipeline_front");
+    const std::string frontWide = GetRecordingPrefix(directory, "pipeline_front_wide");
+    mkdir(front.c_str(), 0755);
+    mkdir(frontWide.c_str(), 0755);
+    const auto frontSegments = WriteSegments(front, 4);
+    const auto frontWideSegments = WriteSegments(frontWide, 4);
+    PruneRecordings(front, 2 * SEGMENT_BYTES);
+    CheckPruned("subdirectories, the pruned camera", frontSegments, 2);
+    CheckPruned("subdirectories, the other camera", frontWideSegments, 0);
+    RemoveAll(frontSegments);
+    RemoveAll(frontWideSegments);
+    rmdir(front.c_str());
+    rmdir(frontWide.c_str());
+
+    // Both cameras in one directory, the segment name itself has to tell them apart
+    const auto flatFront = WriteSegments(directory + "/pipeline_front_", 3);
+    const auto flatFrontWide = WriteSegments(directory + "/pipeline_front_wide_", 3);
+    const std::string otherFile = directory + "/pipeline_front_notes.mkv";
+    std::ofstream(otherFile) << "not a segment";
+    PruneRecordings(directory + "/pipeline_front_", 0);
+    CheckPruned("one directory, the pruned camera", flatFront, 3);
+    CheckPruned("one directory, the other camera", flatFrontWide, 0);
+    Check(Exists(otherFile), "one directory, a file that is no segment kept");
+    RemoveAll(flatFront);
+    RemoveAll(flatFrontWide);
+    unlink(otherFile.c_str());
+    rmdir(directory.c_str());
+
+    std::cout << (failures == 0 ? "Recording prune test passed\n" : "Recording prune test failed\n");
+    return failures == 0 ? 0 : 1;
+}